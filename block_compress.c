@@ -0,0 +1,554 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "block_compress.c"
+ *
+ *   Purpose : Write the output stream in fixed-size blocks, compressed
+ *             with LZ4 or zstd and checksummed on a few worker threads, into
+ *             a self-describing container with a block index so it can be
+ *             read from any point.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "block_compress.h"
+#include "crc32c.h"
+#include "rt_sched.h"
+
+#define ZSTD_DEFAULT_LEVEL 1
+
+enum {
+  SLOT_FILLING,
+  SLOT_QUEUED,
+  SLOT_DONE,
+};
+
+int parse_compress(const char *arg, enum pkz_codec *codec, int *level)
+{
+  if (strcmp(arg, "lz4") == 0) {
+#ifdef HAVE_LZ4
+    *codec = PKZ_LZ4;
+    *level = 0;
+    return 0;
+#else
+    fprintf(stderr, "Not built with LZ4 support.\n");
+    return -1;
+#endif
+  }
+  if (strncmp(arg, "zstd", 4) == 0 && (arg[4] == 0 || arg[4] == ':')) {
+#ifdef HAVE_ZSTD
+    char *end;
+    *codec = PKZ_ZSTD;
+    *level = ZSTD_DEFAULT_LEVEL;
+    if (arg[4] == ':') {
+      *level = strtol(arg + 5, &end, 10);
+      if (*end || end == arg + 5 || *level < 1 ||
+          *level > ZSTD_maxCLevel())
+        return -1;
+    }
+    return 0;
+#else
+    fprintf(stderr, "Not built with zstd support.\n");
+    return -1;
+#endif
+  }
+  return -1;
+}
+
+/* Samples and bytes in the smallest whole unit of format. */
+static void format_group(enum sample_format format, uint32_t *samples,
+                         uint32_t *bytes)
+{
+  switch (format) {
+    case FORMAT_1BIT:
+      *samples = 8;
+      *bytes = 1;
+      break;
+    case FORMAT_DENSE3:
+      *samples = 8;
+      *bytes = 3;
+      break;
+    default:
+      *samples = 2;
+      *bytes = 1;
+      break;
+  }
+}
+
+static size_t compress_bound(enum pkz_codec codec, size_t len)
+{
+  switch (codec) {
+#ifdef HAVE_LZ4
+    case PKZ_LZ4:
+      return LZ4_compressBound(len);
+#endif
+#ifdef HAVE_ZSTD
+    case PKZ_ZSTD:
+      return ZSTD_compressBound(len);
+#endif
+    default:
+      return len;
+  }
+}
+
+/* Compress a slot, falling back to storing it as it is. zctx is the
+ * worker's own zstd context. */
+static void compress_slot(struct block_compress *c, struct block_slot *s,
+                          void *zctx)
+{
+  size_t n = 0;
+
+  switch (c->codec) {
+#ifdef HAVE_LZ4
+    case PKZ_LZ4: {
+      int r = LZ4_compress_default((const char *)s->raw, (char *)s->comp,
+                                   s->raw_len, c->comp_bound);
+      n = r > 0 ? r : 0;
+      break;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case PKZ_ZSTD:
+      n = ZSTD_compressCCtx(zctx, s->comp, c->comp_bound, s->raw, s->raw_len,
+                            c->level);
+      if (ZSTD_isError(n))
+        n = 0;
+      break;
+#endif
+    default:
+      break;
+  }
+  if (n == 0 || n >= s->raw_len) {
+    s->codec = PKZ_STORED;
+    s->comp_len = s->raw_len;
+  } else {
+    s->codec = c->codec;
+    s->comp_len = n;
+  }
+  s->crc = crc32c(0, s->codec == PKZ_STORED ? s->raw : s->comp, s->comp_len);
+}
+
+static void *compress_worker(void *arg)
+{
+  struct block_compress *c = arg;
+  void *zctx = NULL;
+
+#ifdef HAVE_ZSTD
+  if (c->codec == PKZ_ZSTD)
+    zctx = ZSTD_createCCtx();
+#endif
+  pthread_mutex_lock(&c->lock);
+  while (1) {
+    struct block_slot *s;
+    while (!c->stop && c->next_job == c->head)
+      pthread_cond_wait(&c->work, &c->lock);
+    if (c->next_job == c->head)
+      break;
+    s = &c->slots[c->next_job++ % c->num_slots];
+    pthread_mutex_unlock(&c->lock);
+    compress_slot(c, s, zctx);
+    pthread_mutex_lock(&c->lock);
+    s->state = SLOT_DONE;
+    pthread_cond_broadcast(&c->done);
+  }
+  pthread_mutex_unlock(&c->lock);
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(zctx);
+#endif
+  return NULL;
+}
+
+int block_compress_init(struct block_compress *c, enum pkz_codec codec,
+                        int level, size_t block_size, int threads,
+                        enum sample_format format, block_sink_fn sink,
+                        void *sink_ctx)
+{
+  struct pkz_header *h = &c->header;
+
+  memset(c, 0, sizeof(*c));
+  c->codec = codec;
+  c->level = level;
+  c->format = format;
+  c->block_size = block_size;
+  c->comp_bound = compress_bound(codec, block_size);
+  c->sink = sink;
+  c->sink_ctx = sink_ctx;
+  memcpy(h->magic, PKZ_MAGIC, sizeof(h->magic));
+  h->version = PKZ_VERSION;
+  h->header_size = PKZ_HEADER_SIZE;
+  h->format = format;
+  h->codec = codec;
+  h->level = level;
+  h->block_size = block_size;
+  format_group(format, &h->group_samples, &h->group_bytes);
+  /* Enough slots that every worker has one while the writer fills one and
+   * has another to write out. */
+  c->num_slots = threads * 2 + 2;
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->work, NULL);
+  pthread_cond_init(&c->done, NULL);
+
+  if (block_size % h->group_bytes) {
+    fprintf(stderr, "Block size %zu is not a whole number of %u byte "
+            "groups\n", block_size, h->group_bytes);
+    block_compress_destroy(c);
+    return -1;
+  }
+  if (!(c->slots = calloc(c->num_slots, sizeof(*c->slots))) ||
+      !(c->threads = calloc(threads, sizeof(*c->threads)))) {
+    fprintf(stderr, "Unable to allocate compression buffers\n");
+    block_compress_destroy(c);
+    return -1;
+  }
+  for (int i = 0; i < c->num_slots; i++) {
+    if (!(c->slots[i].raw = malloc(block_size)) ||
+        !(c->slots[i].comp = malloc(c->comp_bound))) {
+      fprintf(stderr, "Unable to allocate compression buffers\n");
+      block_compress_destroy(c);
+      return -1;
+    }
+  }
+  for (; c->num_threads < threads; c->num_threads++) {
+    if (rt_thread_create(&c->threads[c->num_threads], compress_worker,
+                         c) != 0) {
+      fprintf(stderr, "Unable to start compression threads\n");
+      block_compress_destroy(c);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void block_compress_describe(struct block_compress *c, const char *host,
+                             const char *device, int usb_pid,
+                             int64_t start_ns)
+{
+  struct pkz_header *h = &c->header;
+
+  memset(h->host, 0, sizeof(h->host));
+  memset(h->device, 0, sizeof(h->device));
+  if (host)
+    strncpy(h->host, host, sizeof(h->host) - 1);
+  if (device)
+    strncpy(h->device, device, sizeof(h->device) - 1);
+  h->usb_pid = usb_pid;
+  h->start_ns = start_ns;
+}
+
+void block_compress_time(struct block_compress *c, uint64_t sample,
+                         int64_t ns)
+{
+  if (c->num_times &&
+      sample <= c->times[(c->num_times - 1) % BLOCK_TIMES].sample)
+    return;
+  c->times[c->num_times++ % BLOCK_TIMES] = (struct block_time){ sample, ns };
+}
+
+/* Clock time of sample, from the two readings around it, or the nearest
+ * two if it is outside them. 0 until there are two. */
+static int64_t time_of(struct block_compress *c, uint64_t sample)
+{
+  uint64_t first = c->num_times > BLOCK_TIMES ? c->num_times - BLOCK_TIMES :
+                   0;
+  uint64_t i = c->num_times - 1;
+  const struct block_time *a, *b;
+
+  if (c->num_times < 2)
+    return 0;
+  /* Readings are in order, find the last one at or before sample. */
+  while (i > first && c->times[i % BLOCK_TIMES].sample > sample)
+    i--;
+  if (i == c->num_times - 1)
+    i--;
+  a = &c->times[i % BLOCK_TIMES];
+  b = &c->times[(i + 1) % BLOCK_TIMES];
+  return a->ns + (int64_t)((double)(b->ns - a->ns) *
+                           ((double)sample - a->sample) /
+                           (b->sample - a->sample));
+}
+
+void block_compress_mark(struct block_compress *c, uint64_t start,
+                         uint64_t end, uint32_t flags)
+{
+  struct block_mark *m;
+
+  if (end <= start)
+    end = start + 1;
+  /* Out of room: widen the last one, flagging a few more blocks. */
+  if (c->num_marks == BLOCK_MARKS) {
+    m = &c->marks[BLOCK_MARKS - 1];
+    if (end > m->end)
+      m->end = end;
+    if (start < m->start)
+      m->start = start;
+    m->flags |= flags;
+    return;
+  }
+  c->marks[c->num_marks++] = (struct block_mark){ start, end, flags };
+}
+
+/* Flags for the block of samples [start, end), forgetting marks that end
+ * in it. Marks for blocks already written go on this one. */
+static uint32_t take_marks(struct block_compress *c, uint64_t end)
+{
+  uint32_t flags = 0;
+  int n = 0;
+
+  for (int i = 0; i < c->num_marks; i++) {
+    if (c->marks[i].start < end)
+      flags |= c->marks[i].flags;
+    if (c->marks[i].end > end)
+      c->marks[n++] = c->marks[i];
+  }
+  c->num_marks = n;
+  return flags;
+}
+
+void block_compress_destroy(struct block_compress *c)
+{
+  pthread_mutex_lock(&c->lock);
+  c->stop = 1;
+  pthread_cond_broadcast(&c->work);
+  pthread_mutex_unlock(&c->lock);
+  for (int i = 0; i < c->num_threads; i++)
+    pthread_join(c->threads[i], NULL);
+  if (c->slots) {
+    for (int i = 0; i < c->num_slots; i++) {
+      free(c->slots[i].raw);
+      free(c->slots[i].comp);
+    }
+  }
+  free(c->slots);
+  free(c->threads);
+  free(c->index);
+  pthread_cond_destroy(&c->work);
+  pthread_cond_destroy(&c->done);
+  pthread_mutex_destroy(&c->lock);
+  c->slots = NULL;
+  c->threads = NULL;
+  c->index = NULL;
+  c->num_threads = 0;
+}
+
+static int emit(struct block_compress *c, const void *data, size_t len)
+{
+  if (c->sink(c->sink_ctx, data, len) < 0)
+    return -1;
+  c->file_offset += len;
+  return 0;
+}
+
+static int start_container(struct block_compress *c)
+{
+  c->header.base_sample = c->sample;
+  c->started = 1;
+  c->file_offset = 0;
+  c->raw_offset = 0;
+  c->base_sample = c->sample;
+  c->index_len = 0;
+  return emit(c, &c->header, sizeof(c->header));
+}
+
+uint64_t block_compress_sample_at(const struct block_compress *c,
+                                  uint64_t file_offset)
+{
+  size_t lo = 0, hi = c->index_len;
+
+  if (file_offset >= c->file_offset)
+    return c->sample;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    uint64_t end = mid + 1 < c->index_len ? c->index[mid + 1].file_offset :
+                   c->file_offset;
+    if (end <= file_offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < c->index_len ? c->index[lo].sample : c->sample;
+}
+
+uint32_t block_crc(const struct pkz_block *b, const void *comp)
+{
+  return crc32c(crc32c(0, comp, b->comp_len), &b->codec,
+                sizeof(*b) - offsetof(struct pkz_block, codec));
+}
+
+/* Write out a compressed slot and note it in the index. */
+static int write_slot(struct block_compress *c, struct block_slot *s)
+{
+  uint64_t samples = s->raw_len / c->header.group_bytes *
+                     c->header.group_samples;
+  struct pkz_block b;
+  struct pkz_index_entry *e;
+
+  b.magic = PKZ_BLOCK_MAGIC;
+  b.codec = s->codec;
+  b.format = c->format;
+  b.flags = take_marks(c, c->sample + samples);
+  b.raw_len = s->raw_len;
+  b.comp_len = s->comp_len;
+  b.sample = c->sample;
+  b.time_ns = time_of(c, c->sample);
+  b.crc = crc32c(s->crc, &b.codec,
+                 sizeof(b) - offsetof(struct pkz_block, codec));
+  if (c->index_len == c->index_cap) {
+    size_t cap = c->index_cap ? c->index_cap * 2 : 1024;
+    struct pkz_index_entry *index = realloc(c->index, cap * sizeof(*index));
+    if (!index)
+      return -1;
+    c->index = index;
+    c->index_cap = cap;
+  }
+  e = &c->index[c->index_len++];
+  e->file_offset = c->file_offset;
+  e->sample = b.sample;
+  e->time_ns = b.time_ns;
+  e->flags = b.flags;
+  e->crc = b.crc;
+  if (emit(c, &b, sizeof(b)) < 0 ||
+      emit(c, s->codec == PKZ_STORED ? s->raw : s->comp, s->comp_len) < 0)
+    return -1;
+  c->raw_offset += s->raw_len;
+  c->sample += samples;
+  c->raw_bytes += s->raw_len;
+  c->comp_bytes += sizeof(b) + s->comp_len;
+  s->raw_len = 0;
+  s->state = SLOT_FILLING;
+  return 0;
+}
+
+/* Write out the blocks that are done, in order. With wait, until every
+ * queued block is out. */
+static int drain(struct block_compress *c, int wait)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&c->lock);
+  while (c->tail < c->head) {
+    struct block_slot *s = &c->slots[c->tail % c->num_slots];
+    if (s->state != SLOT_DONE) {
+      if (!wait)
+        break;
+      pthread_cond_wait(&c->done, &c->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&c->lock);
+    ret = write_slot(c, s);
+    pthread_mutex_lock(&c->lock);
+    c->tail++;
+    if (ret < 0)
+      break;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return ret;
+}
+
+static void submit(struct block_compress *c)
+{
+  pthread_mutex_lock(&c->lock);
+  c->slots[c->head % c->num_slots].state = SLOT_QUEUED;
+  c->head++;
+  pthread_cond_signal(&c->work);
+  pthread_mutex_unlock(&c->lock);
+}
+
+int block_compress_write(struct block_compress *c, const void *data,
+                         size_t len)
+{
+  const uint8_t *p = data;
+
+  if (!c->started && start_container(c) < 0)
+    return -1;
+  while (len) {
+    struct block_slot *s;
+    size_t n;
+    /* Every slot busy: wait for the oldest to be written out. */
+    if (c->head - c->tail == (uint64_t)c->num_slots) {
+      pthread_mutex_lock(&c->lock);
+      while (c->slots[c->tail % c->num_slots].state != SLOT_DONE)
+        pthread_cond_wait(&c->done, &c->lock);
+      pthread_mutex_unlock(&c->lock);
+      if (drain(c, 0) < 0)
+        return -1;
+    }
+    s = &c->slots[c->head % c->num_slots];
+    n = c->block_size - s->raw_len;
+    if (n > len)
+      n = len;
+    memcpy(s->raw + s->raw_len, p, n);
+    s->raw_len += n;
+    p += n;
+    len -= n;
+    if (s->raw_len == c->block_size)
+      submit(c);
+  }
+  return drain(c, 0);
+}
+
+int block_compress_finish(struct block_compress *c)
+{
+  struct pkz_footer f;
+  uint64_t index_offset;
+
+  if (!c->started && start_container(c) < 0)
+    return -1;
+  if (c->slots[c->head % c->num_slots].raw_len)
+    submit(c);
+  if (drain(c, 1) < 0)
+    return -1;
+  index_offset = c->file_offset;
+  if (c->index_len &&
+      emit(c, c->index, c->index_len * sizeof(*c->index)) < 0)
+    return -1;
+  memset(&f, 0, sizeof(f));
+  f.index_offset = index_offset;
+  f.blocks = c->index_len;
+  f.raw_length = c->raw_offset;
+  f.samples = c->sample - c->base_sample;
+  f.index_crc = crc32c(0, c->index, c->index_len * sizeof(*c->index));
+  memcpy(f.magic, PKZ_FOOTER_MAGIC, sizeof(f.magic));
+  c->started = 0;
+  return emit(c, &f, sizeof(f));
+}
+
+int block_decompress(const struct pkz_block *b, const void *comp, void *out)
+{
+  switch (b->codec) {
+    case PKZ_STORED:
+      if (b->comp_len != b->raw_len)
+        return -1;
+      memcpy(out, comp, b->raw_len);
+      return 0;
+#ifdef HAVE_LZ4
+    case PKZ_LZ4:
+      return LZ4_decompress_safe(comp, out, b->comp_len, b->raw_len) ==
+             (int)b->raw_len ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+    case PKZ_ZSTD:
+      return ZSTD_decompress(out, b->raw_len, comp, b->comp_len) ==
+             b->raw_len ? 0 : -1;
+#endif
+    default:
+      return -1;
+  }
+}
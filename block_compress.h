@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __BLOCK_COMPRESS_H
+#define __BLOCK_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "sample_format.h"
+
+/* Block container output (--container, and --compress): the stream is cut
+ * into blocks of block_size bytes, compressed by a pool of worker threads
+ * and written in order, in this format (integers little-endian):
+ *
+ *   struct pkz_header, with what was captured where and when
+ *   for each block: struct pkz_block, then comp_len bytes
+ *   struct pkz_index_entry for each block
+ *   struct pkz_footer
+ *
+ * Every block but the last holds block_size bytes, samples_per_block()
+ * samples, so the block holding a sample or byte offset is found by
+ * division and its place in the file from the index. Blocks carry the
+ * stream sample number and wall clock time of their first sample, the
+ * sample format and PKZ_BLOCK_* flags, and a CRC-32C of the payload then
+ * the rest of the block header. A block that doesn't get smaller is stored
+ * with codec PKZ_STORED, as are all blocks without --compress. The index
+ * and footer are written when the file is finished; without them (after a
+ * crash) the blocks can still be read in order from the start. pkz_reader.h
+ * reads it.
+ */
+
+#define PKZ_MAGIC "PKSZBLK1"
+#define PKZ_FOOTER_MAGIC "PKSZIDX1"
+#define PKZ_BLOCK_MAGIC 0x424b5a50  /* "PZKB" */
+#define PKZ_VERSION 2
+#define PKZ_HEADER_SIZE 512
+
+enum pkz_codec {
+  PKZ_STORED = 0,
+  PKZ_LZ4 = 1,
+  PKZ_ZSTD = 2,
+};
+
+/* Block flags. */
+#define PKZ_BLOCK_GAP  0x1   /* Samples were dropped before one in here. */
+#define PKZ_BLOCK_FIFO 0x2   /* Has bytes flagged by the FPGA FIFO. */
+
+struct pkz_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;      /* PKZ_HEADER_SIZE, the first block follows. */
+  uint32_t format;           /* enum sample_format of the stream. */
+  uint32_t codec;            /* Codec asked for, blocks may be stored. */
+  int32_t level;
+  uint32_t block_size;       /* Bytes per block but the last. */
+  uint32_t group_samples;    /* The format packs group_samples samples */
+  uint32_t group_bytes;      /* into group_bytes bytes. */
+  uint64_t base_sample;      /* Stream sample number of the first sample. */
+  int64_t start_ns;          /* CLOCK_REALTIME the capture started at. */
+  uint32_t usb_pid;          /* Of the device captured from. */
+  uint32_t reserved0;
+  char host[64];             /* Where it was captured. */
+  char device[32];           /* Device name, as in sample_grabber messages. */
+  uint8_t reserved[352];
+};
+
+struct pkz_block {
+  uint32_t magic;
+  uint32_t crc;              /* CRC-32C of the payload, then the rest of
+                              * this header from codec on. */
+  uint16_t codec;
+  uint16_t format;
+  uint32_t flags;
+  uint32_t raw_len;
+  uint32_t comp_len;
+  uint64_t sample;           /* Stream sample number of the first sample. */
+  int64_t time_ns;           /* Its CLOCK_REALTIME, 0 if not known. */
+};
+
+struct pkz_index_entry {
+  uint64_t file_offset;      /* Of the struct pkz_block. */
+  uint64_t sample;
+  int64_t time_ns;
+  uint32_t flags;
+  uint32_t crc;
+};
+
+struct pkz_footer {
+  uint64_t index_offset;
+  uint64_t blocks;
+  uint64_t raw_length;       /* Bytes in all blocks. */
+  uint64_t samples;          /* Samples in all blocks. */
+  uint32_t index_crc;        /* CRC-32C of the index. */
+  uint32_t reserved;
+  char magic[8];
+};
+
+/* Samples in each block of a container, but the last. */
+static inline uint64_t samples_per_block(const struct pkz_header *h)
+{
+  return (uint64_t)h->block_size / h->group_bytes * h->group_samples;
+}
+
+/* Where finished blocks go, e.g. file_output_write. Returns 0 or -1. */
+typedef int (*block_sink_fn)(void *ctx, const void *data, size_t len);
+
+struct block_slot {
+  uint8_t *raw;
+  uint8_t *comp;
+  size_t raw_len;
+  size_t comp_len;
+  uint32_t codec;
+  uint32_t crc;              /* Of the payload so far. */
+  int state;
+};
+
+/* A flag for the samples [start, end) of the stream, waiting for the blocks
+ * holding them to be written. */
+struct block_mark {
+  uint64_t start, end;
+  uint32_t flags;
+};
+
+/* Clock reading for a stream sample number. */
+struct block_time {
+  uint64_t sample;
+  int64_t ns;
+};
+
+#define BLOCK_MARKS 64
+#define BLOCK_TIMES 64
+
+struct block_compress {
+  enum pkz_codec codec;
+  int level;
+  enum sample_format format;
+  size_t block_size;
+  size_t comp_bound;
+  /* Header fields that are the same for every file. */
+  struct pkz_header header;
+
+  block_sink_fn sink;
+  void *sink_ctx;
+
+  /* Blocks go round the slots in order: the writer fills slot head, the
+   * workers compress queued slots and the writer writes slot tail out once
+   * it is done. */
+  int num_slots;
+  struct block_slot *slots;
+  uint64_t head, tail, next_job;
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  int stop;
+  int num_threads;
+  pthread_t *threads;
+
+  /* Container being written. */
+  int started;
+  uint64_t file_offset;
+  uint64_t raw_offset;
+  uint64_t base_sample;
+  struct pkz_index_entry *index;
+  size_t index_len, index_cap;
+
+  /* Stream sample number of the next block out, and the flags and clock
+   * readings to describe blocks with, all used by the writing thread
+   * only. */
+  uint64_t sample;
+  struct block_mark marks[BLOCK_MARKS];
+  int num_marks;
+  struct block_time times[BLOCK_TIMES];
+  uint64_t num_times;
+
+  /* Totals over all files. */
+  uint64_t raw_bytes, comp_bytes;
+};
+
+/* Parse "lz4", "zstd" or "zstd:LEVEL". Returns 0, or -1 if the codec is
+ * unknown or wasn't built in.
+ */
+int parse_compress(const char *arg, enum pkz_codec *codec, int *level);
+
+/* Set up compression with codec at level (PKZ_STORED for none) in blocks
+ * of block_size bytes, a whole number of the format's groups, using threads
+ * workers, writing to sink, for a stream in format that starts at sample 0.
+ * Returns 0, or -1 with a message printed.
+ */
+int block_compress_init(struct block_compress *c, enum pkz_codec codec,
+                        int level, size_t block_size, int threads,
+                        enum sample_format format, block_sink_fn sink,
+                        void *sink_ctx);
+
+/* Fill in where and when the capture is from, for the header of every
+ * file from now on. host and device may be NULL.
+ */
+void block_compress_describe(struct block_compress *c, const char *host,
+                             const char *device, int usb_pid,
+                             int64_t start_ns);
+
+/* Note that stream sample number sample was read at CLOCK_REALTIME ns.
+ * Block times are interpolated between these, so call it as they come in,
+ * at least every block or so.
+ */
+void block_compress_time(struct block_compress *c, uint64_t sample,
+                         int64_t ns);
+
+/* Set PKZ_BLOCK_* flags on the blocks holding stream samples [start, end),
+ * or the one holding start if end <= start. Blocks already written out
+ * can't be changed, the next one gets the flags instead.
+ */
+void block_compress_mark(struct block_compress *c, uint64_t start,
+                         uint64_t end, uint32_t flags);
+
+/* Stop the workers and free everything. Anything not finished is lost. */
+void block_compress_destroy(struct block_compress *c);
+
+/* Add len bytes to the stream, writing out blocks as they are done and
+ * waiting while all slots are busy. Returns 0, or -1 if the sink failed.
+ */
+int block_compress_write(struct block_compress *c, const void *data,
+                         size_t len);
+
+/* Write out the last, short block and the index and footer, ending the
+ * container. The next write starts a new one, e.g. after switching the
+ * sink's file. Returns 0, or -1 if the sink failed.
+ */
+int block_compress_finish(struct block_compress *c);
+
+/* Stream sample number the container is whole up to when cut short at
+ * file_offset: the first sample of the first block not wholly before it.
+ */
+uint64_t block_compress_sample_at(const struct block_compress *c,
+                                  uint64_t file_offset);
+
+/* CRC a block should have, given its header and comp_len bytes of
+ * payload. */
+uint32_t block_crc(const struct pkz_block *b, const void *comp);
+
+/* Decompress a block read from a container into out, which has room for
+ * raw_len bytes. Returns 0, or -1 if it is corrupt or the codec wasn't
+ * built in.
+ */
+int block_decompress(const struct pkz_block *b, const void *comp, void *out);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "crc32c.c"
+ *
+ *   Purpose : CRC-32C checksums of container blocks, with the SSE4.2 crc32
+ *             instruction 8 bytes at a time, or slicing-by-8 tables without
+ *             it.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/* Reflected Castagnoli polynomial. */
+#define POLY 0x82F63B78
+
+static uint32_t table[8][256];
+/* Compression workers may make their first calls at the same time. */
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void make_table(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+    table[0][i] = c;
+  }
+  for (uint32_t i = 0; i < 256; i++)
+    for (int t = 1; t < 8; t++)
+      table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+}
+
+uint32_t crc32c_table(uint32_t crc, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  pthread_once(&table_once, make_table);
+  crc = ~crc;
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    v ^= crc;
+    crc = table[7][v & 0xFF] ^ table[6][(v >> 8) & 0xFF] ^
+          table[5][(v >> 16) & 0xFF] ^ table[4][(v >> 24) & 0xFF] ^
+          table[3][(v >> 32) & 0xFF] ^ table[2][(v >> 40) & 0xFF] ^
+          table[1][(v >> 48) & 0xFF] ^ table[0][v >> 56];
+  }
+  while (len--)
+    crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+  return ~crc;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  uint64_t c = ~crc;
+
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  while (len--)
+    c = _mm_crc32_u8(c, *p++);
+  return ~(uint32_t)c;
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+typedef uint32_t (*crc_fn)(uint32_t, const void *, size_t);
+
+static crc_fn crc_impl;
+static const char *crc_impl_name;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void crc_select(void)
+{
+#if defined(HAVE_X86_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc_impl_name = "sse4.2";
+    crc_impl = crc32c_sse42;
+    return;
+  }
+#endif
+  crc_impl_name = "table";
+  crc_impl = crc32c_table;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+  pthread_once(&select_once, crc_select);
+  return crc_impl(crc, data, len);
+}
+
+const char *crc32c_impl(void)
+{
+  pthread_once(&select_once, crc_select);
+  return crc_impl_name;
+}
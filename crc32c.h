@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), as used by iSCSI and ext4: crc32c(0, data, len)
+ * for a whole buffer, or pass the previous result to continue one. Uses the
+ * SSE4.2 crc32 instruction where the host has it, selected on first call.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/* Table driven reference implementation of crc32c. */
+uint32_t crc32c_table(uint32_t crc, const void *data, size_t len);
+
+/* Name of the implementation crc32c dispatches to. */
+const char *crc32c_impl(void);
+
+#endif
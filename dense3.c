@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "dense3.c"
+ *
+ *   Purpose : Pack Piksi bytes into dense3, 8 samples in 3 bytes, and back.
+ *             The vector kernels work like base64 codecs with 6-bit fields:
+ *             multiply-add the fields of each 4 bytes into one 24-bit value
+ *             and shuffle out its bytes, or shuffle 3 bytes into each 32-bit
+ *             lane and shift the fields into place with multiplies.
+ */
+
+#include "dense3.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/* The 6 sample bits of each Piksi byte. */
+#define SAMPLE_BITS 0xFC
+/* FIFO error flag bit meaning "no error" (the flag is active low). */
+#define FLAG_OK 0x01
+
+size_t dense3_pack_scalar(const uint8_t *in, size_t n, uint8_t *out)
+{
+  for (size_t i = 0; i < n / 4; i++) {
+    uint32_t v = (uint32_t)(in[0] >> 2) << 18 | (uint32_t)(in[1] >> 2) << 12 |
+                 (uint32_t)(in[2] >> 2) << 6 | (in[3] >> 2);
+    out[0] = v >> 16;
+    out[1] = v >> 8;
+    out[2] = v;
+    in += 4;
+    out += 3;
+  }
+  return n / 4 * 3;
+}
+
+size_t dense3_unpack_scalar(const uint8_t *in, size_t n, uint8_t *out)
+{
+  for (size_t i = 0; i < n / 3; i++) {
+    uint32_t v = (uint32_t)in[0] << 16 | (uint32_t)in[1] << 8 | in[2];
+    out[0] = (v >> 16 & SAMPLE_BITS) | FLAG_OK;
+    out[1] = (v >> 10 & SAMPLE_BITS) | FLAG_OK;
+    out[2] = (v >> 4 & SAMPLE_BITS) | FLAG_OK;
+    out[3] = (v << 2 & SAMPLE_BITS) | FLAG_OK;
+    in += 3;
+    out += 4;
+  }
+  return n / 3 * 4;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* The vector kernels load and store whole registers, so they stop while a
+ * full register is still left on both sides and let the scalar code finish.
+ */
+
+/* Each 32-bit lane of 4 Piksi bytes to its 24-bit dense3 value. */
+__attribute__((target("ssse3")))
+static inline __m128i pack_lanes_ssse3(__m128i x)
+{
+  __m128i f = _mm_and_si128(_mm_srli_epi16(x, 2), _mm_set1_epi8(0x3F));
+  /* First field of each byte pair * 64 + second, then pairs * 4096. */
+  __m128i pairs = _mm_maddubs_epi16(f, _mm_set1_epi16(0x0140));
+  return _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+}
+
+/* Each 32-bit lane holding bytes [d1 d0 d2 d1] of a group back to 4 Piksi
+ * bytes: the low 16 bits give the first two fields, the high 16 bits the
+ * other two, each shifted up to bits [7:2] of its byte. */
+__attribute__((target("ssse3")))
+static inline __m128i unpack_lanes_ssse3(__m128i t)
+{
+  __m128i r = _mm_mulhi_epu16(t, _mm_set1_epi32(0x10000100));
+  __m128i l = _mm_mullo_epi16(t, _mm_set1_epi32(0x04000040));
+  __m128i v = _mm_or_si128(_mm_and_si128(r, _mm_set1_epi16(0x00FC)),
+                           _mm_and_si128(l, _mm_set1_epi16((short)0xFC00)));
+  return _mm_or_si128(v, _mm_set1_epi8(FLAG_OK));
+}
+
+__attribute__((target("ssse3")))
+static size_t dense3_pack_ssse3(const uint8_t *in, size_t n, uint8_t *out)
+{
+  const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                      -1, -1, -1, -1);
+  size_t i = 0, o = 0;
+
+  for (; i + 32 <= n; i += 16, o += 12) {
+    __m128i v = pack_lanes_ssse3(_mm_loadu_si128((const __m128i *)(in + i)));
+    _mm_storeu_si128((__m128i *)(out + o), _mm_shuffle_epi8(v, order));
+  }
+  return o + dense3_pack_scalar(in + i, n - i, out + o);
+}
+
+__attribute__((target("ssse3")))
+static size_t dense3_unpack_ssse3(const uint8_t *in, size_t n, uint8_t *out)
+{
+  const __m128i spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7,
+                                       10, 9, 11, 10);
+  size_t i = 0, o = 0;
+
+  for (; i + 16 <= n; i += 12, o += 16) {
+    __m128i t = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + i)),
+                                 spread);
+    _mm_storeu_si128((__m128i *)(out + o), unpack_lanes_ssse3(t));
+  }
+  return o + dense3_unpack_scalar(in + i, n - i, out + o);
+}
+
+__attribute__((target("avx2")))
+static size_t dense3_pack_avx2(const uint8_t *in, size_t n, uint8_t *out)
+{
+  const __m256i order = _mm256_setr_epi8(
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  /* Close up the 12 bytes from each 128-bit half. */
+  const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  size_t i = 0, o = 0;
+
+  for (; i + 64 <= n; i += 32, o += 24) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+    __m256i f = _mm256_and_si256(_mm256_srli_epi16(x, 2),
+                                 _mm256_set1_epi8(0x3F));
+    __m256i pairs = _mm256_maddubs_epi16(f, _mm256_set1_epi16(0x0140));
+    __m256i v = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+    v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, order), compact);
+    _mm256_storeu_si256((__m256i *)(out + o), v);
+  }
+  return o + dense3_pack_ssse3(in + i, n - i, out + o);
+}
+
+__attribute__((target("avx2")))
+static size_t dense3_unpack_avx2(const uint8_t *in, size_t n, uint8_t *out)
+{
+  /* Input bytes 0-11 to the low half and 12-23 to the high half. */
+  const __m256i halves = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+  const __m256i spread = _mm256_setr_epi8(
+    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  size_t i = 0, o = 0;
+
+  for (; i + 32 <= n; i += 24, o += 32) {
+    __m256i t = _mm256_permutevar8x32_epi32(
+      _mm256_loadu_si256((const __m256i *)(in + i)), halves);
+    __m256i r, l, v;
+    t = _mm256_shuffle_epi8(t, spread);
+    r = _mm256_mulhi_epu16(t, _mm256_set1_epi32(0x10000100));
+    l = _mm256_mullo_epi16(t, _mm256_set1_epi32(0x04000040));
+    v = _mm256_or_si256(_mm256_and_si256(r, _mm256_set1_epi16(0x00FC)),
+                        _mm256_and_si256(l, _mm256_set1_epi16((short)0xFC00)));
+    _mm256_storeu_si256((__m256i *)(out + o),
+                        _mm256_or_si256(v, _mm256_set1_epi8(FLAG_OK)));
+  }
+  return o + dense3_unpack_ssse3(in + i, n - i, out + o);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+typedef size_t (*convert_fn)(const uint8_t *, size_t, uint8_t *);
+
+static convert_fn pack_impl, unpack_impl;
+static const char *impl_name;
+/* Writer threads may make the first calls at the same time. */
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void dense3_select(void)
+{
+#if defined(HAVE_X86_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    impl_name = "avx2";
+    pack_impl = dense3_pack_avx2;
+    unpack_impl = dense3_unpack_avx2;
+    return;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    impl_name = "ssse3";
+    pack_impl = dense3_pack_ssse3;
+    unpack_impl = dense3_unpack_ssse3;
+    return;
+  }
+#endif
+  impl_name = "scalar";
+  pack_impl = dense3_pack_scalar;
+  unpack_impl = dense3_unpack_scalar;
+}
+
+size_t dense3_pack(const uint8_t *in, size_t n, uint8_t *out)
+{
+  pthread_once(&select_once, dense3_select);
+  return pack_impl(in, n, out);
+}
+
+size_t dense3_unpack(const uint8_t *in, size_t n, uint8_t *out)
+{
+  pthread_once(&select_once, dense3_select);
+  return unpack_impl(in, n, out);
+}
+
+const char *dense3_impl(void)
+{
+  pthread_once(&select_once, dense3_select);
+  return impl_name;
+}
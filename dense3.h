@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __DENSE3_H
+#define __DENSE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* dense3 (FORMAT_DENSE3): every group of 4 Piksi bytes, 8 samples, becomes
+ * 3 bytes holding the 6 sample bits of each byte in order, MSB first:
+ *
+ *   in:  aaaaaa.. bbbbbb.. cccccc.. dddddd..
+ *   out: aaaaaabb bbbbcccc ccdddddd
+ *
+ * Bits 1 and 0 of each Piksi byte (unused, and the FIFO error flag) are
+ * dropped, so unpacking gives the samples back exactly, with the flag
+ * cleared to "no error".
+ */
+
+/* Pack the n / 4 whole groups at in into out. Returns the bytes written,
+ * n / 4 * 3. Uses the fastest kernel for the host, selected on first call.
+ */
+size_t dense3_pack(const uint8_t *in, size_t n, uint8_t *out);
+
+/* Unpack the n / 3 whole groups at in into out. Returns the bytes written,
+ * n / 3 * 4.
+ */
+size_t dense3_unpack(const uint8_t *in, size_t n, uint8_t *out);
+
+/* Reference implementations of the above. */
+size_t dense3_pack_scalar(const uint8_t *in, size_t n, uint8_t *out);
+size_t dense3_unpack_scalar(const uint8_t *in, size_t n, uint8_t *out);
+
+/* Name of the kernels dense3_pack and dense3_unpack dispatch to. */
+const char *dense3_impl(void);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "fifo_bench.c"
+ *
+ *   Purpose : Time the FIFO error flag scan readCallback runs on every USB
+ *             buffer, the byte loop against the kernel fifo_error_scan
+ *             picks on this host, over an error-free buffer. Both are
+ *             checked against each other first, with errors injected.
+ *
+ *   Usage :   ./fifo_bench [SIZE [ITERATIONS]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "fifo_check.h"
+
+#define DEFAULT_SIZE (64*1024)
+#define DEFAULT_ITERATIONS 20000
+#define CHECK_ROUNDS 1000
+
+typedef size_t (scan_fn)(const uint8_t *buf, size_t len);
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Random bytes with the flag clear (no error), at any alignment. */
+static void fill(uint8_t *buf, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    buf[i] = rand() | 0x01;
+}
+
+static int check(uint8_t *buf, size_t size)
+{
+  for (int round = 0; round < CHECK_ROUNDS; round++) {
+    size_t start = rand() % 64, len = rand() % (size - start);
+    fill(buf, size);
+    if (round % 4 && len)
+      buf[start + rand() % len] &= ~0x01;
+    if (fifo_error_scan(buf + start, len) !=
+        fifo_error_scan_scalar(buf + start, len)) {
+      fprintf(stderr, "%s disagrees with the byte loop at offset %zu, "
+              "length %zu\n", fifo_error_scan_impl(), start, len);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void bench(const char *name, scan_fn *scan, const uint8_t *buf,
+                  size_t size, long iterations)
+{
+  volatile size_t sink = 0;
+  int64_t start = now_ns(), ns;
+#ifdef HAVE_RDTSC
+  uint64_t cycles = __rdtsc();
+#endif
+
+  for (long i = 0; i < iterations; i++)
+    sink += scan(buf, size);
+  ns = now_ns() - start;
+  (void)sink;
+  printf("%-8s %8.2f GB/s", name, (double)size * iterations / ns);
+#ifdef HAVE_RDTSC
+  cycles = __rdtsc() - cycles;
+  printf(" %8.2f bytes/cycle (TSC)", (double)size * iterations / cycles);
+#endif
+  printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+  size_t size = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_SIZE;
+  long iterations = argc > 2 ? atol(argv[2]) : DEFAULT_ITERATIONS;
+  uint8_t *buf;
+
+  if (size < 64 || iterations <= 0) {
+    fprintf(stderr, "Usage: %s [SIZE [ITERATIONS]], SIZE at least 64\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!(buf = malloc(size))) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  if (check(buf, size) < 0)
+    return EXIT_FAILURE;
+
+  fill(buf, size);
+  printf("%zu byte buffer, %ld iterations\n", size, iterations);
+  /* Warm up the cache and the dispatch. */
+  fifo_error_scan(buf, size);
+  bench("byte", fifo_error_scan_scalar, buf, size, iterations / 10 + 1);
+  bench(fifo_error_scan_impl(), fifo_error_scan, buf, size, iterations);
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "fifo_check.c"
+ *
+ *   Purpose : Scan blocks of received bytes for the FPGA FIFO error flag.
+ *             Every byte from the device has the flag in bit 0 (active low),
+ *             so a block is error free exactly when the AND of all its bytes
+ *             still has bit 0 set. The vector kernels AND 16/32/64 bytes at
+ *             a time and only search for the exact index in a block that
+ *             fails that test.
+ */
+
+#include "fifo_check.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL
+#endif
+
+size_t fifo_error_scan_scalar(const uint8_t *buf, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    if (FPGA_FIFO_ERROR_CHECK(buf[i]))
+      return i;
+  return len;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Move bit 0 of every byte to bit 7 and collect them. Shifting 16-bit lanes
+ * left by 7 puts bit 0 of both bytes in the lane at their bit 7, which is all
+ * movemask looks at. A set bit in the result means "no error" for that byte.
+ */
+static inline uint32_t flag_mask_sse2(__m128i v)
+{
+  return (uint32_t)_mm_movemask_epi8(_mm_slli_epi16(v, 7));
+}
+
+static size_t fifo_error_scan_sse2(const uint8_t *buf, size_t len)
+{
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(buf + i + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(buf + i + 48));
+    __m128i all = _mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d));
+    if (flag_mask_sse2(all) != 0xFFFF)
+      break;
+  }
+  for (; i + 16 <= len; i += 16) {
+    uint32_t m = flag_mask_sse2(_mm_loadu_si128((const __m128i *)(buf + i)));
+    if (m != 0xFFFF)
+      return i + __builtin_ctz(~m);
+  }
+  return i + fifo_error_scan_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t fifo_error_scan_avx2(const uint8_t *buf, size_t len)
+{
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+    __m256i all = _mm256_slli_epi16(_mm256_and_si256(a, b), 7);
+    if ((uint32_t)_mm256_movemask_epi8(all) != 0xFFFFFFFF)
+      break;
+  }
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+    uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_slli_epi16(v, 7));
+    if (m != 0xFFFFFFFF)
+      return i + __builtin_ctz(~m);
+  }
+  return i + fifo_error_scan_scalar(buf + i, len - i);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef HAVE_NEON_KERNEL
+
+static inline int block_ok_neon(uint8x16_t v)
+{
+  uint8x8_t r = vand_u8(vget_low_u8(v), vget_high_u8(v));
+  return (vget_lane_u64(vreinterpret_u64_u8(r), 0) & 0x0101010101010101ULL)
+         == 0x0101010101010101ULL;
+}
+
+static size_t fifo_error_scan_neon(const uint8_t *buf, size_t len)
+{
+  size_t i = 0;
+
+  for (; i + 64 <= len; i += 64) {
+    uint8x16_t a = vld1q_u8(buf + i);
+    uint8x16_t b = vld1q_u8(buf + i + 16);
+    uint8x16_t c = vld1q_u8(buf + i + 32);
+    uint8x16_t d = vld1q_u8(buf + i + 48);
+    if (!block_ok_neon(vandq_u8(vandq_u8(a, b), vandq_u8(c, d))))
+      break;
+  }
+  for (; i + 16 <= len; i += 16)
+    if (!block_ok_neon(vld1q_u8(buf + i)))
+      break;
+  return i + fifo_error_scan_scalar(buf + i, len - i);
+}
+
+#endif /* HAVE_NEON_KERNEL */
+
+size_t fifo_error_run_length(const uint8_t *buf, size_t len)
+{
+  /* Error runs are short and rare, so a plain loop is fine here. */
+  size_t i = 0;
+
+  while (i < len && FPGA_FIFO_ERROR_CHECK(buf[i]))
+    i++;
+  return i;
+}
+
+typedef size_t (*scan_fn)(const uint8_t *, size_t);
+
+static scan_fn scan_impl;
+static const char *scan_impl_name;
+
+static void scan_select(void)
+{
+#if defined(HAVE_X86_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan_impl_name = "avx2";
+    scan_impl = fifo_error_scan_avx2;
+  } else {
+    scan_impl_name = "sse2";
+    scan_impl = fifo_error_scan_sse2;
+  }
+#elif defined(HAVE_NEON_KERNEL)
+  scan_impl_name = "neon";
+  scan_impl = fifo_error_scan_neon;
+#else
+  scan_impl_name = "scalar";
+  scan_impl = fifo_error_scan_scalar;
+#endif
+}
+
+size_t fifo_error_scan(const uint8_t *buf, size_t len)
+{
+  if (!scan_impl)
+    scan_select();
+  return scan_impl(buf, len);
+}
+
+const char *fifo_error_scan_impl(void)
+{
+  if (!scan_impl)
+    scan_select();
+  return scan_impl_name;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __FIFO_CHECK_H
+#define __FIFO_CHECK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* FPGA FIFO Error Flag is 0th bit, active low. */
+#define FPGA_FIFO_ERROR_CHECK(byte) (!((byte) & 0x01))
+
+/* Return the index of the first byte in buf with the FPGA FIFO error flag
+ * set, or len if there is none. Uses the widest vector unit available on the
+ * host, selected on first call.
+ */
+size_t fifo_error_scan(const uint8_t *buf, size_t len);
+
+/* Return the number of bytes at the start of buf that have the FPGA FIFO
+ * error flag set, i.e. the length of the error run starting at buf.
+ */
+size_t fifo_error_run_length(const uint8_t *buf, size_t len);
+
+/* Byte-at-a-time reference implementation of fifo_error_scan. */
+size_t fifo_error_scan_scalar(const uint8_t *buf, size_t len);
+
+/* Name of the implementation fifo_error_scan dispatches to. */
+const char *fifo_error_scan_impl(void);
+
+#endif
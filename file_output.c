@@ -0,0 +1,793 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "file_output.c"
+ *
+ *   Purpose : Output file backends for file_writer. Besides plain stdio,
+ *             samples can be written with O_DIRECT, bypassing the page
+ *             cache so dirty page writeback can't stall the writer, from
+ *             a ring of aligned buffers handed to an I/O thread or queued
+ *             several at a time with io_uring, optionally keeping the
+ *             unsynced data within bounds.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio_ext.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "file_output.h"
+#include "rt_sched.h"
+
+/* Most bytes written back at a time under a durability policy. */
+#define WRITE_BEHIND (8*1024*1024)
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+int parse_output_backend(const char *arg, enum output_backend *backend)
+{
+  if (strcmp(arg, "stdio") == 0)
+    *backend = OUTPUT_STDIO;
+  else if (strcmp(arg, "direct") == 0)
+    *backend = OUTPUT_DIRECT;
+  else if (strcmp(arg, "uring") == 0)
+    *backend = OUTPUT_URING;
+  else
+    return -1;
+  return 0;
+}
+
+static int write_all(int fd, const uint8_t *p, size_t len, uint64_t offset)
+{
+  while (len) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static int64_t monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Apply the durability policy to fd, written up to end: start write-back
+ * of each new window, first waiting for the window before it and dropping
+ * that from the page cache, and fdatasync once a limit is reached. Returns
+ * 0, or -1 with errno set if the sync failed.
+ */
+static int write_behind(struct file_output *o, int fd, uint64_t end)
+{
+  uint64_t window = WRITE_BEHIND;
+  int64_t now;
+
+  if (o->durable_bytes && o->durable_bytes / 4 < window)
+    window = o->durable_bytes / 4 ? o->durable_bytes / 4 : 1;
+  /* O_DIRECT data never sits in the page cache. */
+  if (!o->direct && end - o->written_back >= window) {
+    if (o->written_back > o->dropped) {
+      sync_file_range(fd, o->dropped, o->written_back - o->dropped,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                      SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(fd, o->dropped, o->written_back - o->dropped,
+                    POSIX_FADV_DONTNEED);
+      o->dropped = o->written_back;
+    }
+    sync_file_range(fd, o->written_back, end - o->written_back,
+                    SYNC_FILE_RANGE_WRITE);
+    o->written_back = end;
+  }
+
+  now = monotonic_ns();
+  if (end == o->durable ||
+      !((o->durable_bytes && end - o->durable >= o->durable_bytes) ||
+        (o->durable_ns && now - o->durable_at >= o->durable_ns)))
+    return 0;
+  /* Mostly written back already, this waits for the rest and the size. */
+  if (fdatasync(fd) < 0)
+    return -1;
+  if (!o->direct)
+    posix_fadvise(fd, o->dropped, end - o->dropped, POSIX_FADV_DONTNEED);
+  o->written_back = o->dropped = end;
+  o->durable_at = now;
+  __atomic_store_n(&o->durable, end, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static int durability_on(const struct file_output *o)
+{
+  return o->durable_bytes || o->durable_ns;
+}
+
+#ifdef HAVE_IO_URING
+
+/* user_data of sync SQEs, buffer writes use the buffer index. */
+#define SYNC_TAG (~(uint64_t)0)
+
+struct output_uring {
+  int fd;
+  unsigned entries;
+  int fixed;               /* Buffers are registered. */
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+static void uring_free(struct output_uring *r)
+{
+  if (r->sqes && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+    munmap(r->cq_ptr, r->cq_len);
+  if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+    munmap(r->sq_ptr, r->sq_len);
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r);
+}
+
+static int uring_setup(struct file_output *o)
+{
+  struct io_uring_params p;
+  struct output_uring *r;
+  struct iovec *iov;
+
+  if (!(r = calloc(1, sizeof(*r))))
+    return -1;
+  memset(&p, 0, sizeof(p));
+  /* Room for a write and a linked sync per buffer. */
+  if ((r->fd = syscall(__NR_io_uring_setup, 2 * o->num_bufs, &p)) < 0) {
+    free(r);
+    return -1;
+  }
+  r->entries = p.sq_entries;
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len)
+      r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ptr = r->sq_ptr;
+  else
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  if (r->cq_ptr == MAP_FAILED)
+    goto fail;
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto fail;
+
+  r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+  r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+  r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+  r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+  /* Registered buffers save the kernel mapping the pages on every write.
+   * They count against RLIMIT_MEMLOCK, so carry on without if refused. */
+  if ((iov = calloc(o->num_bufs, sizeof(*iov)))) {
+    for (int i = 0; i < o->num_bufs; i++) {
+      iov[i].iov_base = o->bufs[i];
+      iov[i].iov_len = o->buf_size;
+    }
+    r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                       iov, o->num_bufs) == 0;
+    free(iov);
+  }
+
+  o->ring = r;
+  return 0;
+
+fail:
+  uring_free(r);
+  return -1;
+}
+
+/* The k-th free SQE past the tail, or NULL if the ring lacks room. */
+static struct io_uring_sqe *get_sqe(struct output_uring *r, unsigned k)
+{
+  unsigned tail = *r->sq_tail + k;
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  struct io_uring_sqe *sqe;
+
+  if (tail - head >= r->entries)
+    return NULL;
+  sqe = &r->sqes[tail & *r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+  return sqe;
+}
+
+static void advance_sq(struct output_uring *r, unsigned n)
+{
+  __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(struct output_uring *r, unsigned submit,
+                       unsigned wait)
+{
+  int ret;
+
+  do {
+    ret = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+/* Handle completions, waiting for at least one if wait is set. Returns -1
+ * if the wait failed.
+ */
+static int reap(struct file_output *o, int wait)
+{
+  struct output_uring *r = o->ring;
+  unsigned head = *r->cq_head;
+
+  if (wait && head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) &&
+      uring_enter(r, 0, 1) < 0) {
+    if (!o->error)
+      o->error = errno;
+    return -1;
+  }
+
+  while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    if (cqe->user_data == SYNC_TAG) {
+      o->syncs_in_flight--;
+      /* A sync behind a failed write is cancelled, the write reports. */
+      if (cqe->res < 0 && cqe->res != -ECANCELED && !o->error)
+        o->error = -cqe->res;
+    } else {
+      int i = (int)cqe->user_data;
+      if (cqe->res < 0) {
+        if (!o->error)
+          o->error = -cqe->res;
+      } else if ((size_t)cqe->res < o->lens[i]) {
+        /* Rare short write, finish it synchronously. */
+        if (write_all(o->fd, o->bufs[i] + cqe->res, o->lens[i] - cqe->res,
+                      o->offsets[i] + cqe->res) < 0 && !o->error)
+          o->error = errno;
+      }
+      o->busy[i] = 0;
+      o->completed++;
+    }
+    head++;
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+/* Queue buffer i as a write, with a sync linked behind it if it crosses
+ * the next sync interval.
+ */
+static int uring_submit(struct file_output *o, int i)
+{
+  struct output_uring *r = o->ring;
+  struct io_uring_sqe *sqe, *sync = NULL;
+  uint64_t end = o->offsets[i] + o->lens[i];
+  int need_sync = o->sync_interval && end - o->synced >= o->sync_interval;
+  uint64_t synced = o->synced;
+  unsigned n = 1;
+  int taken;
+
+  /* Everything is submitted as soon as it is queued and the ring has two
+   * entries per buffer, so there is always room. */
+  if (!(sqe = get_sqe(r, 0)) || (need_sync && !(sync = get_sqe(r, 1)))) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = o->fd;
+  sqe->addr = (uint64_t)(uintptr_t)o->bufs[i];
+  sqe->len = o->lens[i];
+  sqe->off = o->offsets[i];
+  sqe->buf_index = r->fixed ? i : 0;
+  sqe->user_data = i;
+
+  if (need_sync) {
+    sqe->flags |= IOSQE_IO_LINK;
+    sync->fd = o->fd;
+    sync->user_data = SYNC_TAG;
+    if (o->direct) {
+      /* The data is already past the page cache, so make it and the file
+       * size durable, after every write before it. */
+      sync->opcode = IORING_OP_FSYNC;
+      sync->fsync_flags = IORING_FSYNC_DATASYNC;
+      sync->flags |= IOSQE_IO_DRAIN;
+    } else {
+      /* Just start write-back of the interval, without waiting on it. */
+      sync->opcode = IORING_OP_SYNC_FILE_RANGE;
+      sync->off = o->synced;
+      sync->len = end - o->synced;
+      sync->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+    }
+    o->synced = end;
+    o->syncs_in_flight++;
+    n = 2;
+  }
+
+  o->busy[i] = 1;
+  advance_sq(r, n);
+  if ((taken = uring_enter(r, n, 0)) < (int)n) {
+    int err = taken < 0 ? errno : EBUSY;
+    /* Entries the kernel didn't take would go with the next enter, maybe
+     * once the buffer is refilled, so take them back. Without SQPOLL
+     * nothing else consumes them. A write it took stays busy until its
+     * completion is reaped. */
+    if (taken < 0)
+      taken = 0;
+    __atomic_store_n(r->sq_tail, *r->sq_tail - (n - taken), __ATOMIC_RELEASE);
+    if (!taken)
+      o->busy[i] = 0;
+    if (need_sync && taken < 2) {
+      o->synced = synced;
+      o->syncs_in_flight--;
+    }
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+#endif /* HAVE_IO_URING */
+
+static void *io_thread(void *arg)
+{
+  struct file_output *o = arg;
+
+  pthread_mutex_lock(&o->lock);
+  while (1) {
+    while (o->completed == o->submitted && !o->stop)
+      pthread_cond_wait(&o->cond, &o->lock);
+    if (o->completed == o->submitted)
+      break;
+    int i = o->completed % o->num_bufs;
+    pthread_mutex_unlock(&o->lock);
+
+    int err = write_all(o->fd, o->bufs[i], o->lens[i], o->offsets[i]) < 0 ?
+              errno : 0;
+    if (!err && durability_on(o) &&
+        write_behind(o, o->fd, o->offsets[i] + o->lens[i]) < 0)
+      err = errno;
+
+    pthread_mutex_lock(&o->lock);
+    if (err && !o->error)
+      o->error = err;
+    o->completed++;
+    pthread_cond_broadcast(&o->cond);
+  }
+  pthread_mutex_unlock(&o->lock);
+  return NULL;
+}
+
+static void free_buffers(struct file_output *o)
+{
+  for (int i = 0; o->bufs && i < o->num_bufs; i++)
+    free(o->bufs[i]);
+  free(o->bufs);
+  free(o->lens);
+  free(o->offsets);
+  free(o->busy);
+  o->bufs = NULL;
+}
+
+int file_output_init(struct file_output *o, enum output_backend backend,
+                     size_t buf_size, int num_bufs)
+{
+  memset(o, 0, sizeof(*o));
+  o->backend = backend;
+  o->fd = -1;
+  if (backend == OUTPUT_STDIO)
+    return 0;
+
+  o->buf_size = (buf_size + OUTPUT_ALIGN - 1) & ~(size_t)(OUTPUT_ALIGN - 1);
+  o->num_bufs = num_bufs < 2 ? 2 : num_bufs;
+  o->bufs = calloc(o->num_bufs, sizeof(*o->bufs));
+  o->lens = calloc(o->num_bufs, sizeof(*o->lens));
+  o->offsets = calloc(o->num_bufs, sizeof(*o->offsets));
+  o->busy = calloc(o->num_bufs, sizeof(*o->busy));
+  if (!o->bufs || !o->lens || !o->offsets || !o->busy)
+    goto fail;
+  for (int i = 0; i < o->num_bufs; i++)
+    if (posix_memalign((void **)&o->bufs[i], OUTPUT_ALIGN, o->buf_size))
+      goto fail;
+
+  if (backend == OUTPUT_URING) {
+#ifdef HAVE_IO_URING
+    if (uring_setup(o) == 0)
+      return 0;
+    fprintf(stderr, "io_uring unavailable (%s), using --io direct\n",
+            strerror(errno));
+#else
+    fprintf(stderr, "Built without io_uring, using --io direct\n");
+#endif
+    o->backend = OUTPUT_DIRECT;
+  }
+
+  pthread_mutex_init(&o->lock, NULL);
+  pthread_cond_init(&o->cond, NULL);
+  if (rt_thread_create(&o->thread, io_thread, o) != 0) {
+    pthread_cond_destroy(&o->cond);
+    pthread_mutex_destroy(&o->lock);
+    goto fail;
+  }
+  return 0;
+
+fail:
+  free_buffers(o);
+  return -1;
+}
+
+void file_output_destroy(struct file_output *o)
+{
+  if (o->fd >= 0 || o->file)
+    file_output_close(o);
+  if (o->backend == OUTPUT_STDIO || !o->bufs)
+    return;
+
+#ifdef HAVE_IO_URING
+  if (o->backend == OUTPUT_URING) {
+    uring_free(o->ring);
+    o->ring = NULL;
+    free_buffers(o);
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&o->lock);
+  o->stop = 1;
+  pthread_cond_broadcast(&o->cond);
+  pthread_mutex_unlock(&o->lock);
+  pthread_join(o->thread, NULL);
+  pthread_cond_destroy(&o->cond);
+  pthread_mutex_destroy(&o->lock);
+  free_buffers(o);
+}
+
+void file_output_set_sync(struct file_output *o, uint64_t interval)
+{
+  o->sync_interval = interval;
+}
+
+void file_output_set_durability(struct file_output *o, uint64_t max_bytes,
+                                int64_t max_ns)
+{
+  o->durable_bytes = max_bytes;
+  o->durable_ns = max_ns;
+}
+
+uint64_t file_output_durable(struct file_output *o)
+{
+  return __atomic_load_n(&o->durable, __ATOMIC_ACQUIRE);
+}
+
+uint64_t file_output_written(struct file_output *o)
+{
+  uint64_t end = o->offset - o->fill;
+
+  if (o->backend == OUTPUT_STDIO)
+    return o->file ? o->offset - __fpending(o->file) : o->offset;
+#ifdef HAVE_IO_URING
+  if (o->backend == OUTPUT_URING) {
+    /* Writes complete in any order, the first one still busy counts. */
+    reap(o, 0);
+    for (int i = 0; i < o->num_bufs; i++)
+      if (o->busy[i] && o->offsets[i] < end)
+        end = o->offsets[i];
+    return end;
+  }
+#endif
+  /* The I/O thread writes buffers in turn. */
+  pthread_mutex_lock(&o->lock);
+  if (o->completed != o->submitted)
+    end = o->offsets[o->completed % o->num_bufs];
+  pthread_mutex_unlock(&o->lock);
+  return end;
+}
+
+int file_output_create(enum output_backend backend, const char *path,
+                       uint64_t prealloc, struct output_file *f)
+{
+  const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+  memset(f, 0, sizeof(*f));
+  f->fd = -1;
+  if (backend != OUTPUT_STDIO) {
+    f->fd = open(path, flags | O_DIRECT, 0644);
+    f->direct = f->fd >= 0;
+    if (f->fd < 0 && errno != EINVAL)
+      return -1;
+    /* Filesystems like tmpfs don't do O_DIRECT. Still double buffer. */
+    if (f->fd < 0)
+      fprintf(stderr, "%s doesn't support O_DIRECT, writing through the page "
+              "cache\n", path);
+  }
+  if (f->fd < 0 && (f->fd = open(path, flags, 0644)) < 0)
+    return -1;
+
+  /* Writes into allocated space don't have to allocate blocks. The size is
+   * kept, so a file left by a crash ends at its last write rather than in
+   * zeros; only the blocks past its end stay allocated until it is
+   * truncated. Not all filesystems can. */
+  if (prealloc && fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, prealloc) == 0)
+    f->allocated = prealloc;
+
+  if (backend == OUTPUT_STDIO && !(f->file = fdopen(f->fd, "w"))) {
+    int err = errno;
+    close(f->fd);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+int file_output_finish(struct output_file *f, int sync)
+{
+  int fd = f->file ? fileno(f->file) : f->fd;
+  int ret = 0;
+
+  /* Free the allocated blocks past the end. */
+  if (f->allocated > f->length && ftruncate(fd, f->length) < 0)
+    ret = -1;
+  if (sync && fsync(fd) < 0)
+    ret = -1;
+  if (f->file ? fclose(f->file) != 0 : close(f->fd) < 0)
+    ret = -1;
+  f->file = NULL;
+  f->fd = -1;
+  return ret;
+}
+
+void file_output_attach(struct file_output *o, const struct output_file *f)
+{
+  o->fd = f->fd;
+  o->file = f->file;
+  o->direct = f->direct;
+  o->allocated = f->allocated;
+  o->offset = 0;
+  o->fill = 0;
+  o->error = 0;
+  o->synced = 0;
+  o->written_back = 0;
+  o->dropped = 0;
+  o->durable_at = monotonic_ns();
+  __atomic_store_n(&o->durable, 0, __ATOMIC_RELEASE);
+}
+
+int file_output_open(struct file_output *o, const char *path)
+{
+  struct output_file f;
+
+  if (file_output_create(o->backend, path, 0, &f) < 0)
+    return -1;
+  file_output_attach(o, &f);
+  return 0;
+}
+
+/* Queue the buffer being filled for writing and wait until the next one is
+ * free.
+ */
+static int submit(struct file_output *o)
+{
+  int i = o->submitted % o->num_bufs;
+  int err;
+
+  o->lens[i] = o->fill;
+  o->offsets[i] = o->offset - o->fill;
+  o->fill = 0;
+
+#ifdef HAVE_IO_URING
+  if (o->backend == OUTPUT_URING) {
+    if (uring_submit(o, i) < 0 && !o->error)
+      o->error = errno;
+    o->submitted++;
+    while (o->busy[o->submitted % o->num_bufs])
+      if (reap(o, 1) < 0)
+        break;
+    reap(o, 0);
+    if (o->error) {
+      errno = o->error;
+      return -1;
+    }
+    return 0;
+  }
+#endif
+
+  pthread_mutex_lock(&o->lock);
+  o->submitted++;
+  pthread_cond_broadcast(&o->cond);
+  while (o->submitted - o->completed >= o->num_bufs)
+    pthread_cond_wait(&o->cond, &o->lock);
+  err = o->error;
+  pthread_mutex_unlock(&o->lock);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/* Wait for everything queued to be written. */
+static int drain(struct file_output *o)
+{
+  int err;
+
+#ifdef HAVE_IO_URING
+  if (o->backend == OUTPUT_URING) {
+    int busy = 1;
+    while (busy || o->syncs_in_flight) {
+      busy = 0;
+      for (int i = 0; i < o->num_bufs; i++)
+        busy |= o->busy[i];
+      if ((busy || o->syncs_in_flight) && reap(o, 1) < 0)
+        break;
+    }
+    err = o->error;
+    if (err) {
+      errno = err;
+      return -1;
+    }
+    return 0;
+  }
+#endif
+
+  pthread_mutex_lock(&o->lock);
+  while (o->completed != o->submitted)
+    pthread_cond_wait(&o->cond, &o->lock);
+  err = o->error;
+  pthread_mutex_unlock(&o->lock);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+int file_output_write(struct file_output *o, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  if (o->backend == OUTPUT_STDIO) {
+    o->offset += len;
+    if (fwrite(data, len, 1, o->file) != 1)
+      return -1;
+    /* Write-back only sees what stdio has handed to the kernel. */
+    if (durability_on(o) &&
+        (fflush(o->file) != 0 || write_behind(o, o->fd, o->offset) < 0))
+      return -1;
+    return 0;
+  }
+
+  while (len) {
+    size_t n = o->buf_size - o->fill;
+    if (n > len)
+      n = len;
+    memcpy(o->bufs[o->submitted % o->num_bufs] + o->fill, p, n);
+    o->fill += n;
+    o->offset += n;
+    p += n;
+    len -= n;
+    if (o->fill == o->buf_size && submit(o) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int file_output_detach(struct file_output *o, struct output_file *f)
+{
+  int ret = 0;
+
+  f->fd = o->fd;
+  f->file = o->file;
+  f->direct = o->direct;
+  f->allocated = o->allocated;
+  f->length = o->offset;
+  o->file = NULL;
+
+  if (o->backend == OUTPUT_STDIO) {
+    o->fd = -1;
+    return fflush(f->file) == 0 ? 0 : -1;
+  }
+
+  /* Queue the aligned part of the last buffer as usual, then write the
+   * tail after dropping O_DIRECT, which only takes whole blocks. */
+  size_t tail = o->fill % OUTPUT_ALIGN;
+  size_t aligned = o->fill - tail;
+  uint8_t *last = o->bufs[o->submitted % o->num_bufs];
+  if (aligned) {
+    uint8_t *next;
+    o->fill = aligned;
+    o->offset -= tail;
+    if (submit(o) < 0)
+      ret = -1;
+    next = o->bufs[o->submitted % o->num_bufs];
+    memcpy(next, last + aligned, tail);
+    last = next;
+    o->offset += tail;
+  }
+  if (drain(o) < 0)
+    ret = -1;
+  /* Nothing is in flight on the old file from here. */
+  o->fd = -1;
+  if (tail) {
+    if (f->direct)
+      fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_DIRECT);
+    f->direct = 0;
+    if (write_all(f->fd, last, tail, o->offset - tail) < 0)
+      ret = -1;
+  }
+  o->fill = 0;
+  return ret;
+}
+
+int file_output_swap(struct file_output *o, const struct output_file *next,
+                     struct output_file *old)
+{
+  int ret = file_output_detach(o, old);
+
+  file_output_attach(o, next);
+  return ret;
+}
+
+int file_output_close(struct file_output *o)
+{
+  struct output_file f;
+  int ret;
+
+  if (o->fd < 0 && !o->file)
+    return 0;
+  ret = file_output_detach(o, &f);
+  if (file_output_finish(&f, durability_on(o)) < 0)
+    ret = -1;
+  else if (durability_on(o))
+    __atomic_store_n(&o->durable, f.length, __ATOMIC_RELEASE);
+  return ret;
+}
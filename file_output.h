@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __FILE_OUTPUT_H
+#define __FILE_OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* How file_writer gets samples to disk. */
+enum output_backend {
+  OUTPUT_STDIO,    /* fwrite through stdio and the page cache. */
+  OUTPUT_DIRECT,   /* O_DIRECT from aligned buffers, written by an I/O thread
+                    * while the next buffer fills. */
+  OUTPUT_URING,    /* O_DIRECT from registered buffers with several writes
+                    * in flight through io_uring. Falls back to
+                    * OUTPUT_DIRECT where io_uring is unavailable. */
+};
+
+/* Alignment of O_DIRECT buffers, file offsets and lengths. */
+#define OUTPUT_ALIGN 4096
+
+/* A file outside a file_output: opened ahead of its turn, or taken out of
+ * use by a rotation and waiting to be finished.
+ */
+struct output_file {
+  int fd;
+  FILE *file;              /* OUTPUT_STDIO, on top of fd. */
+  int direct;              /* fd is open with O_DIRECT. */
+  uint64_t length;         /* Bytes written, once taken out of use. */
+  uint64_t allocated;      /* Bytes preallocated, freed past length when
+                            * finished. */
+};
+
+/* An output file, reused across rotations. With OUTPUT_DIRECT, data is
+ * copied into one of num_bufs aligned buffers; each full buffer is queued
+ * for the I/O thread and the next one is filled meanwhile. A buffer is
+ * reused once the I/O thread's completed count shows it has been written.
+ * OUTPUT_URING uses the same buffers but submits each full one as a write
+ * SQE, so up to num_bufs - 1 writes are queued on the device at once; a
+ * buffer is reused once its completion has been reaped.
+ */
+struct file_output {
+  enum output_backend backend;
+  int fd;
+  FILE *file;
+  uint64_t offset;         /* File offset of the next byte to be queued. */
+  int direct;              /* fd is open with O_DIRECT. */
+  uint64_t allocated;      /* Bytes preallocated in the file. */
+
+  size_t buf_size;
+  int num_bufs;
+  uint8_t **bufs;
+  size_t *lens;
+  uint64_t *offsets;
+  size_t fill;             /* Bytes in the buffer being filled. */
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint64_t submitted;      /* Buffers queued, the one filling is number
+                            * submitted. */
+  uint64_t completed;      /* Buffers the I/O thread has written. */
+  int error;               /* errno of the first failed write. */
+  int stop;
+
+  /* OUTPUT_URING. */
+  struct output_uring *ring;
+  int *busy;               /* Buffer has a write in flight. */
+  uint64_t sync_interval;  /* Bytes between linked syncs, 0 for none. */
+  uint64_t synced;         /* File offset covered by the last sync. */
+  int syncs_in_flight;
+
+  /* Durability policy, applied by whichever thread writes to fd: the
+   * caller with OUTPUT_STDIO, the I/O thread with OUTPUT_DIRECT. */
+  uint64_t durable_bytes;  /* Most bytes left unsynced, 0 for no limit. */
+  int64_t durable_ns;      /* Longest data is left unsynced, 0 for none. */
+  uint64_t written_back;   /* Write-back started up to here, */
+  uint64_t dropped;        /* and waited for and dropped from the page
+                            * cache up to here. */
+  uint64_t durable;        /* File offset synced up to, read atomically. */
+  int64_t durable_at;      /* CLOCK_MONOTONIC of the last sync. */
+};
+
+/* Set up an output using backend. For OUTPUT_DIRECT and OUTPUT_URING,
+ * buf_size is rounded up to OUTPUT_ALIGN and num_bufs (at least 2) buffers
+ * are allocated. Returns 0 on success, -1 on error.
+ */
+int file_output_init(struct file_output *o, enum output_backend backend,
+                     size_t buf_size, int num_bufs);
+void file_output_destroy(struct file_output *o);
+
+/* With OUTPUT_URING, sync the file every interval bytes: an fdatasync
+ * linked behind the write that crosses the interval (and draining all
+ * earlier ones), or a sync_file_range write-out of the interval if the
+ * file isn't open with O_DIRECT. Ignored by the other backends.
+ */
+void file_output_set_sync(struct file_output *o, uint64_t interval);
+
+/* Keep at most about max_bytes, or max_ns worth, of written data unsynced
+ * (0 for no limit on either, the default, turning the policy off). Data
+ * is written back a window at a time with sync_file_range as it comes in,
+ * and dropped from the page cache once on disk, so syncs find little left
+ * to do and long captures don't fill the cache; fdatasync then makes it
+ * durable when a limit is reached, and the file is fsynced when closed.
+ * For OUTPUT_STDIO and OUTPUT_DIRECT; OUTPUT_URING has its own syncs.
+ */
+void file_output_set_durability(struct file_output *o, uint64_t max_bytes,
+                                int64_t max_ns);
+
+/* File offset of the current file known to be on disk under the policy
+ * above. Can be called while the I/O thread is writing.
+ */
+uint64_t file_output_durable(struct file_output *o);
+
+/* File offset of the current file up to which data has been handed to the
+ * kernel, so that it would survive this process being killed, though not a
+ * power cut. The rest is still in stdio's or the backend's buffers. Only
+ * for the writing thread.
+ */
+uint64_t file_output_written(struct file_output *o);
+
+/* Create and truncate path and direct output to it. Returns 0 or -1 with
+ * errno set.
+ */
+int file_output_open(struct file_output *o, const char *path);
+
+/* Create and truncate path for backend without attaching it to an output,
+ * so that can be done away from the writing thread. If prealloc is not 0,
+ * that many bytes are allocated up front where the filesystem supports it,
+ * without changing the file size.
+ * Returns 0 or -1 with errno set.
+ */
+int file_output_create(enum output_backend backend, const char *path,
+                       uint64_t prealloc, struct output_file *f);
+
+/* Direct output to f, a file from file_output_create, when none is open.
+ */
+void file_output_attach(struct file_output *o, const struct output_file *f);
+
+/* Write out everything queued, including an unaligned tail, and hand the
+ * file back in f, still open, for file_output_finish. No file is open
+ * afterwards. Returns 0, or -1 with errno set if writing failed.
+ */
+int file_output_detach(struct file_output *o, struct output_file *f);
+
+/* Write out everything queued to the current file and switch to next, a
+ * file from file_output_create. The old file is handed back in old, still
+ * open, for file_output_finish. Returns 0, or -1 with errno set if writing
+ * to the old file failed; next is in use either way.
+ */
+int file_output_swap(struct file_output *o, const struct output_file *next,
+                     struct output_file *old);
+
+/* Free the blocks preallocated past the end of a file from
+ * file_output_swap, fsync it if sync is set, and close it. Returns 0 or -1
+ * with errno set.
+ */
+int file_output_finish(struct output_file *f, int sync);
+
+/* Append len bytes. Returns 0, or -1 with errno set if this or an earlier
+ * queued write failed.
+ */
+int file_output_write(struct file_output *o, const void *data, size_t len);
+
+/* Write out everything queued, including an unaligned tail, and close the
+ * file. Returns 0 or -1 with errno set.
+ */
+int file_output_close(struct file_output *o);
+
+int parse_output_backend(const char *arg, enum output_backend *backend);
+
+#endif
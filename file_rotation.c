@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "file_rotation.c"
+ *
+ *   Purpose : Name rotated output files, and open the next one and finish
+ *             the last one on a helper thread, so rotating doesn't make
+ *             the writer wait on filesystem metadata updates.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include "file_rotation.h"
+#include "rt_sched.h"
+
+void file_rotation_name(const struct file_rotation *r,
+                        struct rotation_point start, char *path, size_t len)
+{
+  char startstr[22];
+  struct tm tm;
+
+  if (r->sample_names)
+    snprintf(startstr, sizeof(startstr), "%012llu",
+             (unsigned long long)start.sample);
+  else
+    strftime(startstr, sizeof(startstr), "%Y%m%d-%H%M%S",
+             localtime_r(&start.time, &tm));
+  snprintf(path, len, "%.*s-%s%s", (int)r->base_len, r->filename, startstr,
+           r->filename + r->base_len);
+}
+
+/* Make the directory entry of a new file durable. */
+static void sync_dir(const char *path)
+{
+  char dir[ROTATION_PATH_MAX];
+  int fd;
+
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = 0;
+  if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0)
+    return;
+  fsync(fd);
+  close(fd);
+}
+
+static int make_next(struct file_rotation *r, struct rotation_point start,
+                     uint64_t prealloc, struct output_file *f, FILE **tidx,
+                     char *path)
+{
+  char name[ROTATION_PATH_MAX + 8];
+
+  *tidx = NULL;
+  file_rotation_name(r, start, path, ROTATION_PATH_MAX);
+  if (file_output_create(r->backend, path, prealloc, f) < 0)
+    return -1;
+  if (r->timestamps) {
+    snprintf(name, sizeof(name), "%s.tidx", path);
+    if (!(*tidx = fopen(name, "w")))
+      fprintf(stderr, "Can't open timestamp index %s, Error %s\n", name,
+              strerror(errno));
+  }
+  sync_dir(path);
+  return 0;
+}
+
+static void finish(struct output_file *f, FILE *tidx)
+{
+  if (file_output_finish(f, 1) < 0)
+    perror("Error finishing output file");
+  if (tidx && fclose(tidx) != 0)
+    perror("Error finishing timestamp index");
+}
+
+static void *rotation_thread(void *arg)
+{
+  struct file_rotation *r = arg;
+
+  pthread_mutex_lock(&r->lock);
+  while (1) {
+    if (r->retire_head != r->retire_tail) {
+      unsigned i = r->retire_head % ROTATION_QUEUE;
+      pthread_mutex_unlock(&r->lock);
+      finish(&r->retired[i].file, r->retired[i].tidx);
+      pthread_mutex_lock(&r->lock);
+      r->retire_head++;
+      pthread_cond_broadcast(&r->cond);
+    } else if (r->stop) {
+      break;
+    } else if (r->requested && !r->ready) {
+      struct rotation_point start = r->next_start;
+      uint64_t prealloc = r->prealloc;
+      struct output_file f;
+      FILE *tidx;
+      char path[ROTATION_PATH_MAX];
+      pthread_mutex_unlock(&r->lock);
+      int err = make_next(r, start, prealloc, &f, &tidx, path) < 0 ?
+                errno : 0;
+      pthread_mutex_lock(&r->lock);
+      r->next = f;
+      r->next_tidx = tidx;
+      memcpy(r->next_path, path, sizeof(path));
+      r->error = err;
+      r->ready = 1;
+      pthread_cond_broadcast(&r->cond);
+    } else {
+      pthread_cond_wait(&r->cond, &r->lock);
+    }
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+int file_rotation_init(struct file_rotation *r, const char *filename,
+                       enum output_backend backend, int timestamps,
+                       int sample_names)
+{
+  const char *ext;
+
+  memset(r, 0, sizeof(*r));
+  r->backend = backend;
+  r->timestamps = timestamps;
+  r->sample_names = sample_names;
+  strncpy(r->filename, filename, sizeof(r->filename) - 1);
+  ext = strrchr(r->filename, '.');
+  r->base_len = ext ? (size_t)(ext - r->filename) : strlen(r->filename);
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  if (rt_thread_create(&r->thread, rotation_thread, r) != 0) {
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    return -1;
+  }
+  return 0;
+}
+
+/* Remove a made file that won't be used. */
+static void discard_next(struct file_rotation *r)
+{
+  char name[ROTATION_PATH_MAX + 8];
+
+  r->ready = 0;
+  r->requested = 0;
+  if (r->error)
+    return;
+  r->next.length = 0;
+  file_output_finish(&r->next, 0);
+  unlink(r->next_path);
+  if (r->next_tidx) {
+    fclose(r->next_tidx);
+    snprintf(name, sizeof(name), "%s.tidx", r->next_path);
+    unlink(name);
+  }
+}
+
+void file_rotation_destroy(struct file_rotation *r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  pthread_join(r->thread, NULL);
+
+  if (r->ready)
+    discard_next(r);
+  pthread_cond_destroy(&r->cond);
+  pthread_mutex_destroy(&r->lock);
+}
+
+void file_rotation_request(struct file_rotation *r,
+                           struct rotation_point start, uint64_t prealloc)
+{
+  pthread_mutex_lock(&r->lock);
+  if (!r->requested) {
+    r->requested = 1;
+    r->next_start = start;
+    r->prealloc = prealloc;
+    pthread_cond_broadcast(&r->cond);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+int file_rotation_take(struct file_rotation *r, struct rotation_point start,
+                       struct output_file *f, FILE **tidx, char *path,
+                       size_t len)
+{
+  int err;
+
+  pthread_mutex_lock(&r->lock);
+  while (1) {
+    if (r->requested && (r->next_start.time != start.time ||
+                         r->next_start.sample != start.sample)) {
+      /* Made for a guess at where this file would start that was off. */
+      while (!r->ready)
+        pthread_cond_wait(&r->cond, &r->lock);
+      discard_next(r);
+    }
+    if (!r->requested) {
+      r->requested = 1;
+      r->next_start = start;
+      r->prealloc = 0;
+      pthread_cond_broadcast(&r->cond);
+    }
+    if (r->ready)
+      break;
+    pthread_cond_wait(&r->cond, &r->lock);
+  }
+  *f = r->next;
+  if (tidx)
+    *tidx = r->next_tidx;
+  snprintf(path, len, "%s", r->next_path);
+  err = r->error;
+  r->requested = 0;
+  r->ready = 0;
+  pthread_mutex_unlock(&r->lock);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+void file_rotation_retire(struct file_rotation *r,
+                          const struct output_file *f, FILE *tidx)
+{
+  pthread_mutex_lock(&r->lock);
+  /* Only if the disk is far behind. */
+  while (r->retire_tail - r->retire_head >= ROTATION_QUEUE)
+    pthread_cond_wait(&r->cond, &r->lock);
+  r->retired[r->retire_tail % ROTATION_QUEUE].file = *f;
+  r->retired[r->retire_tail % ROTATION_QUEUE].tidx = tidx;
+  r->retire_tail++;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
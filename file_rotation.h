@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __FILE_ROTATION_H
+#define __FILE_ROTATION_H
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "file_output.h"
+
+#define ROTATION_PATH_MAX 2240
+/* Old files waiting to be finished. */
+#define ROTATION_QUEUE 8
+
+/* Rotated files are named after the output filename with the local time
+ * they start at inserted before the extension, e.g. out-20160412-130000.dat,
+ * or the stream sample number they start at for rotation by sample count or
+ * size, e.g. out-000163680000.dat.
+ *
+ * A helper thread keeps the filesystem work of rotating off the writing
+ * thread: it creates and preallocates the next file (and its timestamp
+ * index) ahead of time and syncs the directory entry, and once the writer
+ * has moved on it truncates the old file to its length, fsyncs and closes
+ * it.
+ */
+/* Where a file starts. */
+struct rotation_point {
+  time_t time;
+  uint64_t sample;
+};
+
+struct file_rotation {
+  enum output_backend backend;
+  char filename[ROTATION_PATH_MAX];
+  size_t base_len;         /* Length of filename without its extension. */
+  int timestamps;          /* Also open a .tidx for each file. */
+  int sample_names;        /* Name files by sample number, not time. */
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+
+  /* The next file, asked for by the writer and made by the helper. */
+  int requested;
+  struct rotation_point next_start;
+  uint64_t prealloc;
+  int ready;
+  int error;               /* errno if making the next file failed. */
+  struct output_file next;
+  FILE *next_tidx;
+  char next_path[ROTATION_PATH_MAX];
+
+  /* Old files for the helper to finish. */
+  struct {
+    struct output_file file;
+    FILE *tidx;
+  } retired[ROTATION_QUEUE];
+  unsigned retire_head, retire_tail;
+};
+
+/* Set up naming after filename and start the helper thread. Returns 0 or
+ * -1 on error.
+ */
+int file_rotation_init(struct file_rotation *r, const char *filename,
+                       enum output_backend backend, int timestamps,
+                       int sample_names);
+
+/* Finish all retired files, remove a next file that was never used, and
+ * stop the helper.
+ */
+void file_rotation_destroy(struct file_rotation *r);
+
+/* The name of the file starting at start. */
+void file_rotation_name(const struct file_rotation *r,
+                        struct rotation_point start, char *path, size_t len);
+
+/* Ask for the file starting at start to be made, preallocated to prealloc bytes
+ * (0 for none). Does nothing if one is already asked for.
+ */
+void file_rotation_request(struct file_rotation *r,
+                           struct rotation_point start, uint64_t prealloc);
+
+/* Take the file starting at start, asking for it first if that hasn't been
+ * done (or a file starting elsewhere was asked for), and waiting for it if
+ * the helper isn't done yet. *tidx is set to NULL unless timestamps were
+ * asked for; without them tidx itself may be NULL. Returns 0, or -1 with
+ * errno set if it couldn't be made.
+ */
+int file_rotation_take(struct file_rotation *r, struct rotation_point start,
+                       struct output_file *f, FILE **tidx, char *path,
+                       size_t len);
+
+/* Hand an old file (from file_output_swap) and its timestamp index (or
+ * NULL) to the helper to finish.
+ */
+void file_rotation_retire(struct file_rotation *r,
+                          const struct output_file *f, FILE *tidx);
+
+#endif
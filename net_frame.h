@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __NET_FRAME_H
+#define __NET_FRAME_H
+
+#include <stdint.h>
+
+/* Wire format of sample_grabber --net, shared with the receivers.
+ *
+ * Each TCP connection starts with a struct net_hello, followed by frames,
+ * each a struct net_frame and length bytes of raw Piksi samples. Integers
+ * are little-endian.
+ *
+ * seq counts frames from 0 for the whole capture, across reconnects. After
+ * a reconnect the sender starts again at a frame that may already have
+ * been received, so a receiver should ignore frames with a seq it has seen.
+ * Data the sender had to drop shows up as a jump in sample and
+ * NET_FRAME_GAP on the frame after it.
+ *
+ * A receiver may send back struct net_ack, each giving the bytes of whole
+ * frames (after the hello) it has stored on this connection, starting with
+ * 0 as soon as it has read the hello. Stored means written to the kernel,
+ * so the data survives the receiver being killed but not necessarily a
+ * power cut on its host. The sender then keeps frames until
+ * they are acknowledged and resends the rest after a reconnect. Without
+ * acknowledgements, frames in flight when a connection drops are lost and
+ * show up as a jump in seq.
+ */
+
+#define NET_HELLO_MAGIC "PKSHELO1"
+#define NET_FRAME_MAGIC 0x46534b50  /* "PKSF" */
+#define NET_ACK_MAGIC 0x41534b50    /* "PKSA" */
+#define NET_PROTO_VERSION 1
+
+struct net_hello {
+  char magic[8];
+  uint32_t version;
+  uint32_t samples_per_byte;  /* 2 */
+  int32_t pid;                /* Of the sender. */
+  uint32_t reserved;
+  int64_t start_ns;           /* CLOCK_REALTIME when the capture started. */
+  char host[64];              /* Sender's host name. */
+  char device[32];            /* Device name, e.g. 8398. */
+};
+
+/* Samples before this frame were dropped by the sender. */
+#define NET_FRAME_GAP  (1 << 0)
+/* The payload has bytes flagged by the FPGA FIFO error flag (--continue). */
+#define NET_FRAME_FIFO (1 << 1)
+/* Last frame of the capture, with no payload. */
+#define NET_FRAME_END  (1 << 2)
+
+struct net_frame {
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t seq;
+  uint64_t sample;            /* Stream sample number of the first sample. */
+  int64_t time_ns;            /* CLOCK_REALTIME at USB completion. */
+  uint32_t length;            /* Payload bytes. */
+  uint32_t reserved;
+};
+
+struct net_ack {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t bytes;
+};
+
+#endif
@@ -0,0 +1,573 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "net_sink.c"
+ *
+ *   Purpose : Stream the captured samples to a receiver over TCP in
+ *             sequence-numbered frames, riding out network outages with a
+ *             bounded backlog.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+
+#include "net_sink.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+/* Socket send buffer, about half a second of samples. */
+#define NET_SNDBUF (8*1024*1024)
+/* Largest single send, and the smallest worth the page pinning of
+ * MSG_ZEROCOPY. */
+#define NET_SEND_MAX (1024*1024)
+#define NET_ZC_MIN (16*1024)
+/* Reconnect backoff. */
+#define NET_RETRY_MIN_MS 500
+#define NET_RETRY_MAX_MS 30000
+/* Time limit on connecting, and on a peer that stops acknowledging. */
+#define NET_CONNECT_TIMEOUT_S 2
+#define NET_USER_TIMEOUT_MS 10000
+#define NET_POLL_MS 100
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int split_addr(const char *addr, char *host, size_t hlen, char *port,
+                      size_t plen)
+{
+  const char *colon;
+
+  if (addr[0] == '[') {
+    const char *end = strchr(addr, ']');
+    if (!end || end[1] != ':')
+      return -1;
+    snprintf(host, hlen, "%.*s", (int)(end - addr - 1), addr + 1);
+    colon = end + 1;
+  } else {
+    if (!(colon = strrchr(addr, ':')) || colon == addr)
+      return -1;
+    snprintf(host, hlen, "%.*s", (int)(colon - addr), addr);
+  }
+  if (!colon[1])
+    return -1;
+  snprintf(port, plen, "%s", colon + 1);
+  return 0;
+}
+
+static int connect_to(struct net_sink *s)
+{
+  struct addrinfo hints, *res, *ai;
+  int fd = -1, err = EHOSTUNREACH;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(s->host, s->port, &hints, &res) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  for (ai = res; ai; ai = ai->ai_next) {
+    struct timeval tv = { NET_CONNECT_TIMEOUT_S, 0 };
+    int one = 1, size = NET_SNDBUF, timeout = NET_USER_TIMEOUT_MS;
+
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                     ai->ai_protocol)) < 0)
+      continue;
+    /* Also bounds connect(). Sends are non-blocking anyway. */
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0)
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+    s->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                             sizeof(one)) == 0;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    err = errno;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0)
+    errno = err;
+  return fd;
+}
+
+static int send_hello(struct net_sink *s)
+{
+  const uint8_t *p = (const uint8_t *)&s->hello;
+  size_t left = sizeof(s->hello);
+
+  while (left) {
+    ssize_t n = send(s->fd, p, left, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    p += n;
+    left -= n;
+  }
+  return 0;
+}
+
+/* Size of the frame at backlog byte count at, whose header is queued. */
+static uint64_t frame_size_at(struct net_sink *s, uint64_t at)
+{
+  struct net_frame f;
+  const uint8_t *p;
+  size_t got = 0;
+
+  /* The header may wrap around the end of the ring. */
+  while (got < sizeof(f)) {
+    size_t n = spsc_ring_read_peek_at(&s->backlog,
+                                      at + got - s->backlog.tail, &p);
+    if (n > sizeof(f) - got)
+      n = sizeof(f) - got;
+    memcpy((uint8_t *)&f + got, p, n);
+    got += n;
+  }
+  return sizeof(f) + f.length;
+}
+
+/* Move the send position on by n bytes, keeping track of frames. */
+static void advance(struct net_sink *s, size_t n)
+{
+  s->pos += n;
+  while (s->pos >= s->frame_end) {
+    s->frame_start = s->frame_end;
+    if (s->pos == s->frame_end)
+      break;
+    s->frame_end = s->frame_start + frame_size_at(s, s->frame_start);
+  }
+}
+
+/* Take the next MSG_ZEROCOPY completion, sends first to last, from fd's
+ * error queue. Returns 0 once there are no more.
+ */
+static int next_completion(int fd, uint32_t *first, uint32_t *last,
+                           int *copied)
+{
+  char control[128];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      return 0;
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err *serr = (void *)CMSG_DATA(cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      *first = serr->ee_info;
+      *last = serr->ee_data;
+      *copied = !!(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+      return 1;
+    }
+  }
+}
+
+/* Collect MSG_ZEROCOPY completions from the error queue. */
+static void reap_zerocopy(struct net_sink *s)
+{
+  uint32_t first, last;
+  int copied;
+
+  while (next_completion(s->fd, &first, &last, &copied)) {
+    for (uint32_t id = first; id != last + 1; id++)
+      s->zc_complete[id % NET_ZC_INFLIGHT] = 1;
+    /* The kernel copied after all (loopback does), so pinning pages only
+     * costs. */
+    if (copied)
+      s->zerocopy = 0;
+  }
+  /* Completions can come out of order; release in order. */
+  while (s->zc_done != s->zc_sent &&
+         s->zc_complete[s->zc_done % NET_ZC_INFLIGHT]) {
+    s->zc_complete[s->zc_done % NET_ZC_INFLIGHT] = 0;
+    s->zc_done++;
+  }
+}
+
+/* Close the lost connections whose zerocopy sends have all completed. A
+ * dead one gets there once TCP gives up on it and drops its send queue.
+ */
+static void reap_retired(struct net_sink *s)
+{
+  for (int i = 0; i < s->num_retired; ) {
+    uint32_t first, last;
+    int copied;
+    while (next_completion(s->retired[i].fd, &first, &last, &copied))
+      s->retired[i].pending -= last - first + 1;
+    if (s->retired[i].pending) {
+      i++;
+      continue;
+    }
+    close(s->retired[i].fd);
+    s->retired[i] = s->retired[--s->num_retired];
+  }
+}
+
+/* Give back backlog space the kernel is done with, but never past the
+ * start of a frame that may have to be sent again, nor past what the
+ * receiver has acknowledged if it does.
+ */
+static void commit(struct net_sink *s)
+{
+  uint64_t upto = s->pos;
+
+  if (s->zc_done != s->zc_sent)
+    upto = s->zc_start[s->zc_done % NET_ZC_INFLIGHT];
+  for (int i = 0; i < s->num_retired; i++)
+    if (upto > s->retired[i].hold)
+      upto = s->retired[i].hold;
+  if (upto > s->frame_start)
+    upto = s->frame_start;
+  if (s->acking && upto > s->acked)
+    upto = s->acked;
+  if (upto > s->backlog.tail)
+    spsc_ring_read_commit(&s->backlog, upto - s->backlog.tail);
+}
+
+/* Returns bytes sent, 0 if none could be, or -1 if the connection failed. */
+static ssize_t send_some(struct net_sink *s)
+{
+  const uint8_t *p;
+  size_t n = spsc_ring_read_peek_at(&s->backlog, s->pos - s->backlog.tail,
+                                    &p);
+  ssize_t sent;
+  int zc;
+
+  if (n == 0)
+    return 0;
+  if (n > NET_SEND_MAX)
+    n = NET_SEND_MAX;
+  zc = s->zerocopy && n >= NET_ZC_MIN &&
+       s->zc_sent - s->zc_done < NET_ZC_INFLIGHT;
+  sent = send(s->fd, p, n, MSG_DONTWAIT | MSG_NOSIGNAL |
+                           (zc ? MSG_ZEROCOPY : 0));
+  if (sent < 0) {
+    /* Out of option memory for pinned pages: carry on copying. */
+    if (zc && errno == ENOBUFS)
+      s->zerocopy = 0;
+    return errno == EAGAIN || errno == EINTR || errno == ENOBUFS ? 0 : -1;
+  }
+  if (zc) {
+    s->zc_start[s->zc_sent % NET_ZC_INFLIGHT] = s->pos;
+    s->zc_sent++;
+    s->stats.zerocopy_sends++;
+  }
+  s->stats.bytes_sent += sent;
+  advance(s, sent);
+  return sent;
+}
+
+/* Drop the connection and go back to the first frame the receiver hasn't
+ * acknowledged, or without acknowledgements the one being sent.
+ */
+static void disconnect(struct net_sink *s)
+{
+  /* The kernel may still read the backlog for sends in flight, and only
+   * says when it's done on the socket's error queue, so keep that open
+   * meanwhile. With no room to, wait for the oldest. */
+  reap_zerocopy(s);
+  if (s->zc_done != s->zc_sent) {
+    if (s->num_retired == NET_ZC_RETIRED) {
+      struct pollfd pfd = { s->retired[0].fd, 0, 0 };
+      while (s->retired[0].pending && poll(&pfd, 1, NET_POLL_MS) >= 0)
+        reap_retired(s);
+      reap_retired(s);
+    }
+    s->retired[s->num_retired].fd = s->fd;
+    s->retired[s->num_retired].pending = s->zc_sent - s->zc_done;
+    s->retired[s->num_retired].hold = s->zc_start[s->zc_done %
+                                                  NET_ZC_INFLIGHT];
+    s->num_retired++;
+    shutdown(s->fd, SHUT_RDWR);
+  } else {
+    close(s->fd);
+  }
+  s->fd = -1;
+  s->zc_sent = s->zc_done = 0;
+  memset(s->zc_complete, 0, sizeof(s->zc_complete));
+  if (s->acking && s->acked >= s->backlog.tail)
+    s->pos = s->acked;
+  else
+    s->pos = s->frame_start;
+  s->frame_start = s->frame_end = s->pos;
+  s->acking = 0;
+}
+
+/* Take in acknowledgements. Returns -1 with errno set if the connection is
+ * gone.
+ */
+static int read_acks(struct net_sink *s)
+{
+  while (1) {
+    ssize_t n = recv(s->fd, s->ack_buf + s->ack_fill,
+                     sizeof(s->ack_buf) - s->ack_fill, MSG_DONTWAIT);
+    struct net_ack ack;
+
+    if (n < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    if (n == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    if ((s->ack_fill += n) < sizeof(ack))
+      continue;
+    memcpy(&ack, s->ack_buf, sizeof(ack));
+    s->ack_fill = 0;
+    if (ack.magic != NET_ACK_MAGIC ||
+        ack.bytes > s->pos - s->conn_start) {
+      errno = EPROTO;
+      return -1;
+    }
+    s->acking = 1;
+    s->acked = s->conn_start + ack.bytes;
+  }
+}
+
+/* Wait for room to send or, with nothing to send, for a new frame, and for
+ * anything from the peer. Returns -1 with errno set if the connection is
+ * gone.
+ */
+static int wait_socket(struct net_sink *s, int pending)
+{
+  struct pollfd fds[2] = {
+    { s->fd, POLLIN | (pending ? POLLOUT : 0), 0 },
+    { s->wake_fd, POLLIN, 0 },
+  };
+  struct pollfd pfd;
+  int err = 0, ret;
+  socklen_t len = sizeof(err);
+
+  if (!pending) {
+    __atomic_store_n(&s->idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* A frame queued before idle was seen wouldn't wake us. */
+    if (s->pos - s->backlog.tail != spsc_ring_read_avail(&s->backlog)) {
+      __atomic_store_n(&s->idle, 0, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+  /* The timeout is only there for the flush deadline when stopping. */
+  ret = poll(fds, pending ? 1 : 2, NET_POLL_MS);
+  if (!pending) {
+    eventfd_t count;
+    __atomic_store_n(&s->idle, 0, __ATOMIC_RELAXED);
+    if (fds[1].revents & POLLIN)
+      eventfd_read(s->wake_fd, &count);
+  }
+  if (ret <= 0)
+    return 0;
+  pfd = fds[0];
+  /* POLLERR is also how zerocopy completions are signalled. */
+  if (pfd.revents & POLLERR) {
+    reap_zerocopy(s);
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err) {
+      errno = err;
+      return -1;
+    }
+  }
+  if (pfd.revents & (POLLIN | POLLHUP))
+    return read_acks(s);
+  return 0;
+}
+
+static void *sender(void *arg)
+{
+  struct net_sink *s = arg;
+  int64_t retry_at = 0;
+  int retry_ms = NET_RETRY_MIN_MS, reported = 0;
+
+  while (1) {
+    int64_t now = now_ns();
+    int pending = s->pos - s->backlog.tail !=
+                  spsc_ring_read_avail(&s->backlog);
+    ssize_t n;
+
+    if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE) &&
+        ((!pending && s->zc_done == s->zc_sent &&
+          (!s->acking || s->acked == s->pos)) ||
+         now >= s->flush_deadline_ns))
+      break;
+
+    if (s->fd < 0) {
+      if (now < retry_at) {
+        usleep(NET_POLL_MS * 1000);
+        continue;
+      }
+      if ((s->fd = connect_to(s)) < 0 || send_hello(s) < 0) {
+        if (!reported)
+          fprintf(stderr, "[%s] Can't connect to %s:%s: %s, retrying\n",
+                  s->hello.device, s->host, s->port, strerror(errno));
+        if (s->fd >= 0)
+          disconnect(s);
+        reported = 1;
+        retry_at = now + (int64_t)retry_ms * 1000000;
+        retry_ms = retry_ms * 2 < NET_RETRY_MAX_MS ? retry_ms * 2 :
+                   NET_RETRY_MAX_MS;
+        continue;
+      }
+      s->conn_start = s->acked = s->pos;
+      s->ack_fill = 0;
+      fprintf(stderr, "[%s] Connected to %s:%s%s\n", s->hello.device,
+              s->host, s->port, s->zerocopy ? " (MSG_ZEROCOPY)" : "");
+      s->stats.connects++;
+      reported = 0;
+      retry_ms = NET_RETRY_MIN_MS;
+      continue;
+    }
+
+    if (s->zc_done != s->zc_sent)
+      reap_zerocopy(s);
+    if (s->num_retired)
+      reap_retired(s);
+    if ((n = read_acks(s)) == 0 && (n = send_some(s)) >= 0)
+      commit(s);
+    if (n == 0 && wait_socket(s, pending) < 0)
+      n = -1;
+    if (n < 0) {
+      fprintf(stderr, "[%s] Lost connection to %s:%s: %s, reconnecting\n",
+              s->hello.device, s->host, s->port, strerror(errno));
+      disconnect(s);
+      commit(s);
+      retry_at = now;
+    }
+  }
+
+  if (s->fd >= 0) {
+    shutdown(s->fd, SHUT_WR);
+    close(s->fd);
+  }
+  /* Nothing more goes out of the backlog. */
+  for (int i = 0; i < s->num_retired; i++)
+    close(s->retired[i].fd);
+  s->num_retired = 0;
+  return NULL;
+}
+
+int net_sink_start(struct net_sink *s, const char *addr, const char *device,
+                   size_t backlog_size)
+{
+  struct timespec ts;
+
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  if (split_addr(addr, s->host, sizeof(s->host), s->port,
+                 sizeof(s->port)) < 0) {
+    fprintf(stderr, "Invalid network address %s, use HOST:PORT\n", addr);
+    return -1;
+  }
+  if (spsc_ring_init(&s->backlog, backlog_size) < 0) {
+    fprintf(stderr, "Unable to allocate network backlog\n");
+    return -1;
+  }
+  if ((s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    perror("Unable to start network sender");
+    spsc_ring_destroy(&s->backlog);
+    return -1;
+  }
+
+  memcpy(s->hello.magic, NET_HELLO_MAGIC, sizeof(s->hello.magic));
+  s->hello.version = NET_PROTO_VERSION;
+  s->hello.samples_per_byte = 2;
+  s->hello.pid = getpid();
+  clock_gettime(CLOCK_REALTIME, &ts);
+  s->hello.start_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  gethostname(s->hello.host, sizeof(s->hello.host) - 1);
+  snprintf(s->hello.device, sizeof(s->hello.device), "%s", device);
+
+  if (pthread_create(&s->thread, NULL, sender, s) != 0) {
+    fprintf(stderr, "Unable to start network sender\n");
+    close(s->wake_fd);
+    spsc_ring_destroy(&s->backlog);
+    return -1;
+  }
+  return 0;
+}
+
+int net_sink_push(struct net_sink *s, const uint8_t *data, size_t len,
+                  uint64_t offset, const struct timespec *realtime,
+                  uint32_t flags)
+{
+  struct net_frame f;
+
+  if (spsc_ring_write_space(&s->backlog) < sizeof(f) + len) {
+    if (!s->gap)
+      s->stats.drop_events++;
+    s->stats.bytes_dropped += len;
+    s->gap = 1;
+    return -1;
+  }
+  memset(&f, 0, sizeof(f));
+  f.magic = NET_FRAME_MAGIC;
+  f.flags = flags | (s->gap ? NET_FRAME_GAP : 0);
+  f.seq = s->seq++;
+  f.sample = offset * s->hello.samples_per_byte;
+  f.time_ns = (int64_t)realtime->tv_sec * 1000000000 + realtime->tv_nsec;
+  f.length = len;
+  /* The header goes in whole before any of the payload. */
+  spsc_ring_write(&s->backlog, &f, sizeof(f));
+  if (len)
+    spsc_ring_write(&s->backlog, data, len);
+  s->gap = 0;
+  s->stats.frames++;
+  /* Pairs with the fence in wait_socket: either the sender sees the frame
+   * or we see it idle. Only then is there a syscall. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&s->idle, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&s->idle, 0, __ATOMIC_ACQ_REL))
+    eventfd_write(s->wake_fd, 1);
+  return 0;
+}
+
+void net_sink_stop(struct net_sink *s, uint64_t offset, int flush_ms)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  net_sink_push(s, NULL, 0, offset, &ts, NET_FRAME_END);
+  s->flush_deadline_ns = now_ns() + (int64_t)flush_ms * 1000000;
+  __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(s->thread, NULL);
+  close(s->wake_fd);
+  spsc_ring_destroy(&s->backlog);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __NET_SINK_H
+#define __NET_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "spsc_ring.h"
+#include "net_frame.h"
+
+/* Sends the sample stream to a TCP receiver in the net_frame.h format.
+ *
+ * The producer (the USB callback) frames each buffer into a backlog ring
+ * and never waits; a sender thread streams the ring to the socket,
+ * reconnecting with backoff whenever the connection is lost. While the
+ * receiver is away or slow the backlog fills up, and then new data is
+ * dropped and the gap marked on the next frame.
+ *
+ * With MSG_ZEROCOPY the kernel sends straight from the backlog, which is
+ * then only reused after the completion notification for each send. With a
+ * receiver that acknowledges, frames stay in the backlog until it has them,
+ * and after a reconnect sending resumes from the first one it hasn't.
+ */
+
+#define NET_ZC_INFLIGHT 256
+#define NET_ZC_RETIRED 4
+
+struct net_sink_stats {
+  /* Producer side. */
+  uint64_t frames;
+  uint64_t bytes_dropped;
+  uint64_t drop_events;
+  /* Sender side. */
+  uint64_t bytes_sent;       /* Including frame headers and resends. */
+  uint64_t connects;
+  uint64_t zerocopy_sends;
+};
+
+struct net_sink {
+  char host[256];
+  char port[16];
+  struct spsc_ring backlog;
+  struct net_hello hello;
+  pthread_t thread;
+  int stop;
+  int64_t flush_deadline_ns; /* CLOCK_MONOTONIC, once stopping. */
+
+  /* Producer side. */
+  uint64_t seq;
+  int gap;
+  /* The sender sets idle while it waits for frames, and the producer then
+   * wakes it through wake_fd, an eventfd. */
+  int wake_fd;
+  int idle;
+
+  /* Sender side, in backlog byte counts: the next byte to send and the
+   * frame it is in ([frame_start, frame_end), empty at a frame boundary).
+   */
+  int fd;
+  uint64_t pos, frame_start, frame_end;
+  int zerocopy;
+  /* MSG_ZEROCOPY sends on this connection, completed in order, and where
+   * each started. */
+  uint32_t zc_sent, zc_done;
+  uint64_t zc_start[NET_ZC_INFLIGHT];
+  uint8_t zc_complete[NET_ZC_INFLIGHT];
+  /* Lost connections kept open until the kernel is done with the backlog
+   * pages their MSG_ZEROCOPY sends pinned, from hold on. */
+  struct {
+    int fd;
+    uint32_t pending;
+    uint64_t hold;
+  } retired[NET_ZC_RETIRED];
+  int num_retired;
+  /* Where this connection started in the backlog, and how far the
+   * receiver has acknowledged, once it has started to. */
+  uint64_t conn_start, acked;
+  int acking;
+  uint8_t ack_buf[sizeof(struct net_ack)];
+  size_t ack_fill;
+
+  struct net_sink_stats stats;
+};
+
+/* Start sending to addr (HOST:PORT, or [V6ADDR]:PORT) as device, through a
+ * backlog of backlog_size bytes. Connecting happens in the background.
+ * Returns 0, or -1 with a message printed.
+ */
+int net_sink_start(struct net_sink *s, const char *addr, const char *device,
+                   size_t backlog_size);
+
+/* Queue len bytes starting at stream byte offset with flags (NET_FRAME_*),
+ * from the USB completion at realtime. Returns 0, or -1 if the backlog was
+ * full and the data dropped.
+ */
+int net_sink_push(struct net_sink *s, const uint8_t *data, size_t len,
+                  uint64_t offset, const struct timespec *realtime,
+                  uint32_t flags);
+
+/* Queue the end frame, give the sender up to flush_ms to get the backlog
+ * out, then disconnect and free the backlog.
+ */
+void net_sink_stop(struct net_sink *s, uint64_t offset, int flush_ms);
+
+#endif
@@ -0,0 +1,888 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "piksi_ingestd.c"
+ *
+ *   Purpose : Receive the streams of many sample_grabber --net instances at
+ *             once and store each in its own (optionally rotated) file set,
+ *             using a few epoll worker threads.
+ *
+ *   Usage :   ./piksi_ingestd [-l [HOST:]PORT] [-d DIR] [-j THREADS]
+ *                             [-r INTERVAL] [--rotate-samples N]
+ *                             [--io BACKEND] [--stats SECONDS] [-v]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "net_frame.h"
+#include "file_output.h"
+#include "file_rotation.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+#define DEFAULT_PORT "5100"
+#define MAX_THREADS 64
+/* Receive buffer per connection, which also bounds the frame size. */
+#define CONN_BUF (1024*1024)
+/* Acknowledge after this many bytes of frames, and most acknowledgements
+ * waiting on the output at once. */
+#define ACK_BYTES (256*1024)
+#define ACK_MARKS 64
+/* Output write chunk and buffers for --io direct/uring. */
+#define IO_CHUNK (1024*1024)
+#define IO_BUFFERS 4
+/* Streams whose grabber has been away this long are closed and
+ * forgotten. */
+#define STREAM_IDLE_S 300
+#define EPOLL_EVENTS 64
+#define EPOLL_TIMEOUT_MS 200
+
+struct conn;
+
+/* One capture from one device, which may come over several connections
+ * in turn.
+ */
+struct stream {
+  struct stream *next;
+  int refs;                  /* Connections pointing here, under table. */
+
+  /* Identity, from the hello. */
+  char host[64];
+  char device[32];
+  int32_t pid;
+  int64_t start_ns;
+
+  pthread_mutex_t lock;      /* Everything below. */
+  struct conn *owner;
+  time_t last_seen;
+  int ended;
+  int closed;                /* Files closed, kept to spot late resends. */
+
+  int have_seq;
+  uint64_t last_seq;
+  uint64_t next_sample;
+
+  struct file_output out;
+  struct file_rotation rotation;
+  int opened;                /* The first file is open, and rotation set up. */
+  char filename[ROTATION_PATH_MAX];
+  FILE *gapFile;
+  uint64_t written;          /* Bytes written in total. */
+  uint64_t file_start;       /* Bytes written before the current file. */
+  int64_t file_start_ns;
+  uint64_t rotate_at;        /* With --rotate-samples. */
+  int64_t prev_ns, next_boundary_ns;  /* With -r. */
+  int next_requested;
+
+  uint64_t frames, dups, gaps, gap_bytes, fifo_frames, connects;
+  uint64_t reported;         /* written at the last report. */
+};
+
+/* Frame bytes on a connection that can be acknowledged once the stream's
+ * output has reached the kernel up to written. */
+struct ack_mark {
+  uint64_t bytes;
+  uint64_t written;
+};
+
+struct conn {
+  struct conn *next, *prev;
+  int fd;
+  struct stream *stream;
+  uint8_t *buf;
+  size_t fill;
+  uint64_t bytes;            /* Frame bytes consumed on this connection. */
+  uint64_t acked;
+  struct ack_mark marks[ACK_MARKS];
+  unsigned mark_head, mark_tail;
+};
+
+struct worker {
+  pthread_t thread;
+  int epfd;
+  struct conn conns;         /* List head. */
+};
+
+static volatile int stop = 0;
+static int listen_fd = -1;
+static struct worker workers[MAX_THREADS];
+static int num_workers = 4;
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stream *streams;
+
+static const char *out_dir = ".";
+static enum output_backend output_backend = OUTPUT_STDIO;
+static int rotate_interval = 0;
+static uint64_t rotate_span = 0;   /* Bytes per file with --rotate-samples. */
+static int verbose = 0;
+
+enum {
+  OPT_ROTATE_SAMPLES = 256,
+  OPT_IO,
+  OPT_STATS,
+};
+
+static void sigintHandler(int signum)
+{
+  stop = 1;
+}
+
+static void print_usage(void)
+{
+  printf(
+  "Usage: ./piksi_ingestd [-l [HOST:]PORT] [-d DIR] [-j THREADS] [-r INTERVAL]\n"
+  "                       [--rotate-samples N] [--io BACKEND] [--stats S] [-v]\n"
+  "Options:\n"
+  "  [--listen -l [HOST:]PORT]\n"
+  "                  Address to take sample_grabber --net connections on.\n"
+  "                  Default is port 5100 on all addresses.\n"
+  "  [--dir -d DIR]  Where to store the streams, each as\n"
+  "                  HOST-DEVICE-STARTTIME.dat (with -r, one file per\n"
+  "                  interval named by its start). Default is the current\n"
+  "                  directory.\n"
+  "  [--threads -j N] Worker threads. Default is 4.\n"
+  "  [--rotate -r INTERVAL]\n"
+  "                  Rotate each stream's file every INTERVAL seconds of the\n"
+  "                  grabber's clock, split at the interpolated sample.\n"
+  "  [--rotate-samples N]\n"
+  "                  Rotate each stream's file every N samples exactly\n"
+  "                  (suffixes k, M, G).\n"
+  "  [--io BACKEND]  stdio (default), direct or uring, as for sample_grabber.\n"
+  "  [--stats SECONDS]\n"
+  "                  Print per-stream rates and gaps every SECONDS (default\n"
+  "                  10, 0 for never).\n"
+  "  [--verbose -v]  Print more verbose output.\n"
+  "Each stream also gets a .gaps file listing data that never arrived, and\n"
+  "which file and offset in it the data would have been at.\n"
+  );
+  exit(1);
+}
+
+static long long int parse_count(const char *s)
+{
+  char *end;
+  long long int val = strtoll(s, &end, 10);
+
+  switch (*end) {
+    case 'k': case 'K': val *= 1000; end++; break;
+    case 'M': val *= 1000000; end++; break;
+    case 'G': val *= 1000000000; end++; break;
+  }
+  return *end || val <= 0 ? -1 : val;
+}
+
+/* Make sure a name from the network is safe to put in a path. */
+static void sanitize(char *s, size_t len)
+{
+  s[len - 1] = 0;
+  for (; *s; s++)
+    if (!isalnum((unsigned char)*s) && *s != '-' && *s != '_' && *s != '.')
+      *s = '_';
+}
+
+/* Open the stream's first file, starting at t on the grabber's clock, and
+ * set up rotation if asked for.
+ */
+static int open_files(struct stream *st, time_t t)
+{
+  char start[32], base[ROTATION_PATH_MAX];
+  struct tm tm;
+
+  /* Files rotated by time are told apart by their names already. A stream
+   * we pick up again after a restart gets new files next to the old ones,
+   * which its .gaps file then says start part way in. */
+  strftime(start, sizeof(start), "-%Y%m%d-%H%M%S", localtime_r(&t, &tm));
+  for (int n = 0; ; n++) {
+    char suffix[16] = "";
+    if (n)
+      snprintf(suffix, sizeof(suffix), ".%d", n);
+    snprintf(base, sizeof(base), "%s/%s-%s%s%s.dat", out_dir, st->host,
+             st->device, rotate_interval ? "" : start, suffix);
+    if (rotate_interval || rotate_span) {
+      struct rotation_point first = { t, 0 };
+      if (file_rotation_init(&st->rotation, base, output_backend, 0,
+                             rotate_span != 0) < 0) {
+        fprintf(stderr, "Unable to start file rotation thread\n");
+        return -1;
+      }
+      file_rotation_name(&st->rotation, first, st->filename,
+                         sizeof(st->filename));
+    } else {
+      snprintf(st->filename, sizeof(st->filename), "%s", base);
+    }
+    if (access(st->filename, F_OK) != 0)
+      break;
+    if (rotate_interval || rotate_span)
+      file_rotation_destroy(&st->rotation);
+  }
+  st->rotate_at = rotate_span;
+  if (file_output_open(&st->out, st->filename) < 0) {
+    fprintf(stderr, "Can't open output file %s, Error %s\n", st->filename,
+            strerror(errno));
+    if (rotate_interval || rotate_span)
+      file_rotation_destroy(&st->rotation);
+    return -1;
+  }
+  st->opened = 1;
+  printf("%s/%s: new stream from pid %d, writing %s\n", st->host,
+         st->device, st->pid, st->filename);
+  return 0;
+}
+
+static int stream_open(struct stream *st)
+{
+  if (file_output_init(&st->out, output_backend, IO_CHUNK, IO_BUFFERS) < 0) {
+    fprintf(stderr, "Unable to allocate file write buffers\n");
+    return -1;
+  }
+  /* With -r the first file is named by the grabber's clock like the rest,
+   * so it is opened at the first frame. */
+  if (rotate_interval)
+    return 0;
+  if (open_files(st, st->start_ns / 1000000000) < 0) {
+    file_output_destroy(&st->out);
+    return -1;
+  }
+  return 0;
+}
+
+static void write_gap(struct stream *st, uint64_t stream_offset,
+                      uint64_t length, const char *reason)
+{
+  st->gaps++;
+  st->gap_bytes += length;
+  if (!st->gapFile) {
+    char name[ROTATION_PATH_MAX + 8];
+    snprintf(name, sizeof(name), "%s.gaps", st->rotation.filename[0] ?
+             st->rotation.filename : st->filename);
+    if (!(st->gapFile = fopen(name, "w"))) {
+      fprintf(stderr, "Can't open gap file %s, Error %s\n", name,
+              strerror(errno));
+      return;
+    }
+    fprintf(st->gapFile, "# stream_offset file_offset length reason file\n");
+  }
+  /* Where the data would have been in the file being written. */
+  const char *file = strrchr(st->filename, '/');
+  fprintf(st->gapFile, "%llu %llu %llu %s %s\n",
+          (unsigned long long)stream_offset,
+          (unsigned long long)(st->written - st->file_start),
+          (unsigned long long)length, reason, file ? file + 1 : st->filename);
+  fflush(st->gapFile);
+}
+
+/* Switch the stream to the file starting at start. */
+static int rotate(struct stream *st, struct rotation_point start)
+{
+  struct output_file next, old;
+  FILE *tidx;
+
+  if (file_rotation_take(&st->rotation, start, &next, &tidx, st->filename,
+                         sizeof(st->filename)) < 0) {
+    fprintf(stderr, "Can't open output file %s, Error %s\n", st->filename,
+            strerror(errno));
+    return -1;
+  }
+  if (verbose)
+    printf("%s/%s: rotating to new file %s\n", st->host, st->device,
+           st->filename);
+  if (file_output_swap(&st->out, &next, &old) < 0)
+    perror("Write error");
+  file_rotation_retire(&st->rotation, &old, tidx);
+  st->file_start = st->written;
+  st->next_requested = 0;
+  return 0;
+}
+
+static int write_out(struct stream *st, const uint8_t *p, size_t len)
+{
+  while (len) {
+    size_t n = len;
+    if (rotate_span) {
+      /* Files are named by sample, and the time left at 0 so the one
+       * requested below is the one taken here. */
+      if (st->written == st->rotate_at) {
+        struct rotation_point start = { 0, st->rotate_at * 2 };
+        if (rotate(st, start) < 0)
+          return -1;
+        st->rotate_at += rotate_span;
+      }
+      if (!st->next_requested &&
+          st->written - st->file_start >= rotate_span / 2) {
+        struct rotation_point start = { 0, st->rotate_at * 2 };
+        file_rotation_request(&st->rotation, start, rotate_span);
+        st->next_requested = 1;
+      }
+      if (n > st->rotate_at - st->written)
+        n = st->rotate_at - st->written;
+    }
+    if (file_output_write(&st->out, p, n) < 0)
+      return -1;
+    st->written += n;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Write a frame's payload, which ends at time_ns on the grabber's clock.
+ * With -r, files are split where the clock passes each interval, going by
+ * the times of this frame and the last.
+ */
+static int stream_write(struct stream *st, const uint8_t *p, size_t len,
+                        int64_t time_ns)
+{
+  int64_t interval = rotate_interval * 1000000000LL;
+
+  if (rotate_interval) {
+    if (!st->next_boundary_ns) {
+      st->next_boundary_ns = (time_ns / interval + 1) * interval;
+      st->file_start_ns = time_ns;
+    }
+    if (!st->next_requested && time_ns > st->file_start_ns &&
+        time_ns >= st->next_boundary_ns - interval / 2) {
+      struct rotation_point start = { st->next_boundary_ns / 1000000000, 0 };
+      uint64_t rate = (st->written - st->file_start) * 1000000000 /
+                      (time_ns - st->file_start_ns);
+      file_rotation_request(&st->rotation, start,
+                            rate * rotate_interval / 8 * 9);
+      st->next_requested = 1;
+    }
+    while (time_ns >= st->next_boundary_ns) {
+      struct rotation_point start = { st->next_boundary_ns / 1000000000, 0 };
+      size_t cut = 0;
+      if (st->prev_ns && time_ns > st->prev_ns)
+        cut = (double)(st->next_boundary_ns - st->prev_ns) /
+              (time_ns - st->prev_ns) * len;
+      if (cut > len)
+        cut = len;
+      if (write_out(st, p, cut) < 0 || rotate(st, start) < 0)
+        return -1;
+      p += cut;
+      len -= cut;
+      st->prev_ns = st->file_start_ns = st->next_boundary_ns;
+      st->next_boundary_ns += interval;
+    }
+    st->prev_ns = time_ns;
+  }
+  return write_out(st, p, len);
+}
+
+static int process_frame(struct stream *st, const struct net_frame *f,
+                         const uint8_t *payload)
+{
+  st->frames++;
+  if (st->have_seq && f->seq <= st->last_seq) {
+    st->dups++;
+    return 0;
+  }
+  st->have_seq = 1;
+  st->last_seq = f->seq;
+  if (st->closed)
+    return 0;
+  if (f->flags & NET_FRAME_END) {
+    st->ended = 1;
+    return 0;
+  }
+  if (!st->opened && open_files(st, f->time_ns / 1000000000) < 0)
+    return -1;
+  if (f->sample > st->next_sample)
+    write_gap(st, st->next_sample / 2, (f->sample - st->next_sample) / 2,
+              f->flags & NET_FRAME_GAP ? "dropped" : "network");
+  if (f->flags & NET_FRAME_FIFO)
+    st->fifo_frames++;
+  st->next_sample = f->sample + (uint64_t)f->length * 2;
+  return stream_write(st, payload, f->length, f->time_ns);
+}
+
+static void stream_close(struct stream *st)
+{
+  st->closed = 1;
+  if (file_output_close(&st->out) < 0)
+    perror("Write error");
+  file_output_destroy(&st->out);
+  if (st->opened && (rotate_interval || rotate_span))
+    file_rotation_destroy(&st->rotation);
+  if (st->gapFile)
+    fclose(st->gapFile);
+  printf("%s/%s: stream %s, %llu bytes, %llu gaps (%llu bytes), "
+         "%llu connections\n", st->host, st->device,
+         st->ended ? "ended" : "closed", (unsigned long long)st->written,
+         (unsigned long long)st->gaps, (unsigned long long)st->gap_bytes,
+         (unsigned long long)st->connects);
+}
+
+/* Drop a reference to st, closing its files once it has ended, or freeing
+ * it altogether with force. Called with table_lock held.
+ */
+static void stream_put(struct stream *st, int force)
+{
+  struct stream **pp;
+
+  if (--st->refs > 0)
+    return;
+  if ((st->ended || force) && !st->closed)
+    stream_close(st);
+  if (!force)
+    return;
+  for (pp = &streams; *pp != st; pp = &(*pp)->next)
+    ;
+  *pp = st->next;
+  pthread_mutex_destroy(&st->lock);
+  free(st);
+}
+
+/* Find or start the stream a hello is for, and make c its connection. */
+static struct stream *stream_claim(struct conn *c, struct net_hello *h)
+{
+  struct stream *st;
+
+  sanitize(h->host, sizeof(h->host));
+  sanitize(h->device, sizeof(h->device));
+  pthread_mutex_lock(&table_lock);
+  for (st = streams; st; st = st->next)
+    if (st->pid == h->pid && st->start_ns == h->start_ns &&
+        !strcmp(st->host, h->host) && !strcmp(st->device, h->device))
+      break;
+  if (!st) {
+    if (!(st = calloc(1, sizeof(*st)))) {
+      pthread_mutex_unlock(&table_lock);
+      return NULL;
+    }
+    memcpy(st->host, h->host, sizeof(st->host));
+    memcpy(st->device, h->device, sizeof(st->device));
+    st->pid = h->pid;
+    st->start_ns = h->start_ns;
+    pthread_mutex_init(&st->lock, NULL);
+    if (stream_open(st) < 0) {
+      pthread_mutex_destroy(&st->lock);
+      free(st);
+      pthread_mutex_unlock(&table_lock);
+      return NULL;
+    }
+    st->next = streams;
+    streams = st;
+  }
+  st->refs++;
+  pthread_mutex_unlock(&table_lock);
+
+  /* A grabber only reconnects once it has given up on the old connection,
+   * so that one just hasn't noticed yet. */
+  pthread_mutex_lock(&st->lock);
+  st->owner = c;
+  st->connects++;
+  st->last_seen = time(NULL);
+  pthread_mutex_unlock(&st->lock);
+  return st;
+}
+
+static int send_ack(struct conn *c, uint64_t bytes)
+{
+  struct net_ack ack = { NET_ACK_MAGIC, 0, bytes };
+
+  if (send(c->fd, &ack, sizeof(ack), MSG_DONTWAIT | MSG_NOSIGNAL) !=
+      sizeof(ack))
+    return -1;
+  c->acked = bytes;
+  return 0;
+}
+
+/* Bytes of the stream handed to the kernel, which a kill can't lose. */
+static uint64_t stream_stored(struct stream *st)
+{
+  if (st->closed)
+    return st->written;
+  return st->file_start + file_output_written(&st->out);
+}
+
+/* Note the frames taken in so far for acknowledgement, and return how many
+ * bytes of them can be acknowledged now. Called with st->lock held.
+ */
+static uint64_t ack_point(struct conn *c, struct stream *st)
+{
+  uint64_t stored, ack = c->acked, marked = c->acked;
+
+  if (c->mark_head != c->mark_tail)
+    marked = c->marks[(c->mark_tail - 1) % ACK_MARKS].bytes;
+  /* A full list only makes the next acknowledgement come later. */
+  if (c->bytes > marked &&
+      (c->bytes - marked >= ACK_BYTES || st->ended) &&
+      c->mark_tail - c->mark_head < ACK_MARKS) {
+    c->marks[c->mark_tail % ACK_MARKS] =
+      (struct ack_mark){ c->bytes, st->written };
+    c->mark_tail++;
+  }
+  stored = stream_stored(st);
+  while (c->mark_head != c->mark_tail &&
+         c->marks[c->mark_head % ACK_MARKS].written <= stored) {
+    ack = c->marks[c->mark_head % ACK_MARKS].bytes;
+    c->mark_head++;
+  }
+  return ack;
+}
+
+static void conn_close(struct worker *w, struct conn *c)
+{
+  epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->prev->next = c->next;
+  c->next->prev = c->prev;
+  if (c->stream) {
+    pthread_mutex_lock(&c->stream->lock);
+    if (c->stream->owner == c)
+      c->stream->owner = NULL;
+    c->stream->last_seen = time(NULL);
+    pthread_mutex_unlock(&c->stream->lock);
+    pthread_mutex_lock(&table_lock);
+    stream_put(c->stream, 0);
+    pthread_mutex_unlock(&table_lock);
+  }
+  free(c->buf);
+  free(c);
+}
+
+/* Take in what has arrived on c. Returns -1 if c should be closed. */
+static int conn_read(struct conn *c)
+{
+  struct stream *st;
+  size_t off = 0;
+  uint64_t ack;
+  ssize_t n;
+  int ret = 0;
+
+  n = recv(c->fd, c->buf + c->fill, CONN_BUF - c->fill, MSG_DONTWAIT);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+    return -1;
+  if (n > 0)
+    c->fill += n;
+
+  if (!c->stream) {
+    struct net_hello h;
+    if (c->fill < sizeof(h))
+      return 0;
+    memcpy(&h, c->buf, sizeof(h));
+    if (memcmp(h.magic, NET_HELLO_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != NET_PROTO_VERSION || h.samples_per_byte != 2) {
+      fprintf(stderr, "Dropping connection with a bad hello\n");
+      return -1;
+    }
+    if (!(c->stream = stream_claim(c, &h)))
+      return -1;
+    off = sizeof(h);
+    /* Tell the grabber we acknowledge, so it keeps frames until we do. */
+    if (send_ack(c, 0) < 0)
+      return -1;
+  }
+
+  st = c->stream;
+  pthread_mutex_lock(&st->lock);
+  if (st->owner != c) {
+    pthread_mutex_unlock(&st->lock);
+    return -1;
+  }
+  while (c->fill - off >= sizeof(struct net_frame)) {
+    struct net_frame f;
+    memcpy(&f, c->buf + off, sizeof(f));
+    if (f.magic != NET_FRAME_MAGIC ||
+        f.length > CONN_BUF - sizeof(f)) {
+      fprintf(stderr, "%s/%s: bad frame, dropping connection\n", st->host,
+              st->device);
+      ret = -1;
+      break;
+    }
+    if (c->fill - off < sizeof(f) + f.length)
+      break;
+    if (process_frame(st, &f, c->buf + off + sizeof(f)) < 0) {
+      fprintf(stderr, "%s/%s: write error: %s\n", st->host, st->device,
+              strerror(errno));
+      ret = -1;
+      break;
+    }
+    off += sizeof(f) + f.length;
+    c->bytes += sizeof(f) + f.length;
+  }
+  st->last_seen = time(NULL);
+  /* The sender waits for the end to be acknowledged, so get everything out
+   * now rather than when the last connection goes. */
+  if (st->ended && !st->closed)
+    stream_close(st);
+  ack = ack_point(c, st);
+  pthread_mutex_unlock(&st->lock);
+
+  memmove(c->buf, c->buf + off, c->fill - off);
+  c->fill -= off;
+  if (ret == 0 && ack > c->acked && send_ack(c, ack) < 0)
+    ret = -1;
+  return ret;
+}
+
+static void accept_conns(struct worker *w)
+{
+  while (1) {
+    struct epoll_event ev;
+    struct conn *c;
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0)
+      return;
+    if (!(c = calloc(1, sizeof(*c))) || !(c->buf = malloc(CONN_BUF))) {
+      free(c);
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->next = w->conns.next;
+    c->prev = &w->conns;
+    c->next->prev = c;
+    w->conns.next = c;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      conn_close(w, c);
+  }
+}
+
+static void *worker_thread(void *arg)
+{
+  struct worker *w = arg;
+  struct epoll_event events[EPOLL_EVENTS];
+
+  while (!stop) {
+    int n = epoll_wait(w->epfd, events, EPOLL_EVENTS, EPOLL_TIMEOUT_MS);
+    for (int i = 0; i < n; i++) {
+      if (!events[i].data.ptr)
+        accept_conns(w);
+      else if (conn_read(events[i].data.ptr) < 0)
+        conn_close(w, events[i].data.ptr);
+    }
+  }
+  while (w->conns.next != &w->conns)
+    conn_close(w, w->conns.next);
+  return NULL;
+}
+
+static int open_listener(const char *addr)
+{
+  char host[256] = "", port[16] = DEFAULT_PORT;
+  const char *colon = addr ? strrchr(addr, ':') : NULL;
+  struct addrinfo hints, *res, *ai;
+  int fd = -1, one = 1;
+
+  if (addr && colon) {
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+    snprintf(port, sizeof(port), "%s", colon + 1);
+  } else if (addr) {
+    snprintf(port, sizeof(port), "%s", addr);
+  }
+  /* [V6ADDR]:PORT */
+  if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+    memmove(host, host + 1, strlen(host));
+    host[strlen(host) - 1] = 0;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0) {
+    fprintf(stderr, "Invalid listen address %s\n", addr);
+    return -1;
+  }
+  for (ai = res; ai; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+                     SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0)
+    fprintf(stderr, "Can't listen on %s:%s: %s\n", host, port,
+            strerror(errno));
+  return fd;
+}
+
+/* Print rates and gaps of each stream, and close streams whose grabber
+ * has been away too long.
+ */
+static void report(double seconds)
+{
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&table_lock);
+  for (struct stream *st = streams, *next; st; st = next) {
+    int idle;
+    next = st->next;
+    pthread_mutex_lock(&st->lock);
+    if (seconds > 0 && !st->closed)
+      printf("%s/%s: %6.2f MB/s, %llu MB, %llu gaps (%llu bytes), "
+             "%llu duplicate frames, %llu FIFO error frames%s\n", st->host,
+             st->device, (st->written - st->reported) / seconds / 1e6,
+             (unsigned long long)(st->written / 1000000),
+             (unsigned long long)st->gaps,
+             (unsigned long long)st->gap_bytes,
+             (unsigned long long)st->dups,
+             (unsigned long long)st->fifo_frames,
+             st->owner ? "" : ", disconnected");
+    st->reported = st->written;
+    idle = !st->owner && now - st->last_seen > STREAM_IDLE_S;
+    pthread_mutex_unlock(&st->lock);
+    if (idle && st->refs == 0) {
+      st->refs++;
+      stream_put(st, 1);
+    }
+  }
+  pthread_mutex_unlock(&table_lock);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+  const char *listen_addr = NULL;
+  int stats_interval = 10;
+  double since = 0;
+
+  struct option long_options[] = {
+    {"listen",   required_argument, NULL, 'l'},
+    {"dir",      required_argument, NULL, 'd'},
+    {"threads",  required_argument, NULL, 'j'},
+    {"rotate",   required_argument, NULL, 'r'},
+    {"rotate-samples", required_argument, NULL, OPT_ROTATE_SAMPLES},
+    {"io",       required_argument, NULL, OPT_IO},
+    {"stats",    required_argument, NULL, OPT_STATS},
+    {"verbose",  no_argument,       NULL, 'v'},
+    {"help",     no_argument,       NULL, 'h'},
+    {NULL,       no_argument,       NULL, 0}
+  };
+  int c;
+
+  while ((c = getopt_long(argc, argv, "l:d:j:r:vh", long_options,
+                          NULL)) != -1) {
+    switch (c) {
+      case 'l':
+        listen_addr = optarg;
+        break;
+      case 'd':
+        out_dir = optarg;
+        break;
+      case 'j':
+        num_workers = atoi(optarg);
+        if (num_workers < 1 || num_workers > MAX_THREADS) {
+          fprintf(stderr, "Invalid thread count.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'r':
+        rotate_interval = atoi(optarg);
+        if (rotate_interval <= 0) {
+          fprintf(stderr, "Invalid rotation interval.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_ROTATE_SAMPLES: {
+        long long int samples = parse_count(optarg);
+        if (samples <= 0 || samples % 2) {
+          fprintf(stderr, "--rotate-samples must be a positive multiple "
+                  "of 2.\n");
+          return EXIT_FAILURE;
+        }
+        rotate_span = samples / 2;
+        break;
+      }
+      case OPT_IO:
+        if (parse_output_backend(optarg, &output_backend) < 0) {
+          fprintf(stderr, "Invalid I/O backend.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_STATS:
+        stats_interval = atoi(optarg);
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        print_usage();
+    }
+  }
+  if (optind < argc || (rotate_interval && rotate_span)) {
+    if (rotate_interval && rotate_span)
+      fprintf(stderr, "Use only one of -r and --rotate-samples.\n");
+    print_usage();
+  }
+
+  if ((listen_fd = open_listener(listen_addr)) < 0)
+    return EXIT_FAILURE;
+  signal(SIGINT, sigintHandler);
+  signal(SIGTERM, sigintHandler);
+  signal(SIGPIPE, SIG_IGN);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  /* Every worker waits on the listener; EPOLLEXCLUSIVE wakes just one. */
+  for (int i = 0; i < num_workers; i++) {
+    struct worker *w = &workers[i];
+    struct epoll_event ev = { EPOLLIN | EPOLLEXCLUSIVE, { .ptr = NULL } };
+    w->conns.next = w->conns.prev = &w->conns;
+    if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0 ||
+        pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+      perror("Can't start worker");
+      return EXIT_FAILURE;
+    }
+  }
+  if (verbose)
+    printf("Listening with %d worker threads, storing in %s\n", num_workers,
+           out_dir);
+
+  while (!stop) {
+    sleep(1);
+    since += 1;
+    if (stats_interval > 0 && since >= stats_interval) {
+      report(since);
+      since = 0;
+    } else if (stats_interval <= 0) {
+      report(0);
+    }
+  }
+
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    close(workers[i].epfd);
+  }
+  close(listen_fd);
+  /* Streams left over are from grabbers that are away. */
+  pthread_mutex_lock(&table_lock);
+  while (streams) {
+    streams->refs++;
+    stream_put(streams, 1);
+  }
+  pthread_mutex_unlock(&table_lock);
+  return 0;
+}
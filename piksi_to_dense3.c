@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dense3.h"
+
+#define CHUNK_N 8192  // number of 3-byte dense3 groups
+
+/* Piksi bytes on stdin to dense3 on stdout, or back with -u. */
+int main(int argc, char **argv) {
+  static uint8_t piksi[CHUNK_N * 4];
+  static uint8_t dense[CHUNK_N * 3];
+  int unpack = argc == 2 && !strcmp(argv[1], "-u");
+  size_t n;
+
+  if (argc > 1 && !unpack) {
+    fprintf(stderr, "Usage: %s [-u] < in > out\n", argv[0]);
+    return 1;
+  }
+  if (unpack) {
+    while ((n = fread(dense, 3, CHUNK_N, stdin)))
+      fwrite(piksi, 1, dense3_unpack(dense, n * 3, piksi), stdout);
+  } else {
+    while ((n = fread(piksi, 4, CHUNK_N, stdin)))
+      fwrite(dense, 1, dense3_pack(piksi, n * 4, dense), stdout);
+  }
+  return 0;
+}
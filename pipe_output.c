@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "pipe_output.c"
+ *
+ *   Purpose : Stream samples to stdout with vmsplice/splice, so they go
+ *             from the capture buffer to the next process or the file
+ *             without being copied in user space.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "pipe_output.h"
+
+/* Pipes are 64 KiB unless told otherwise. */
+#define PIPE_DEFAULT_SIZE (64*1024)
+
+/* Grow the pipe to size bytes, or as far as an unprivileged process may.
+ * Returns the size it ended up with.
+ */
+static size_t grow_pipe(int fd, size_t size)
+{
+  int got;
+
+  if (fcntl(fd, F_SETPIPE_SZ, (int)size) < 0 && errno == EPERM) {
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    unsigned long max;
+    if (f && fscanf(f, "%lu", &max) == 1 && max < size)
+      fcntl(fd, F_SETPIPE_SZ, (int)max);
+    if (f)
+      fclose(f);
+  }
+  got = fcntl(fd, F_GETPIPE_SZ);
+  return got > 0 ? (size_t)got : PIPE_DEFAULT_SIZE;
+}
+
+int pipe_output_open(struct pipe_output *o, int fd, size_t pipe_size,
+                     int zero_copy)
+{
+  struct stat st;
+
+  o->fd = fd;
+  o->pipe[0] = o->pipe[1] = -1;
+  o->queued = 0;
+  o->pipe_size = PIPE_DEFAULT_SIZE;
+  if (fstat(fd, &st) < 0)
+    return -1;
+
+  if (S_ISFIFO(st.st_mode)) {
+    o->mode = zero_copy ? PIPE_VMSPLICE : PIPE_COPY;
+    o->pipe_size = grow_pipe(fd, pipe_size);
+  } else if (S_ISREG(st.st_mode) && zero_copy &&
+             !(fcntl(fd, F_GETFL) & O_APPEND)) {
+    /* splice() won't write to O_APPEND files. */
+    if (pipe2(o->pipe, O_CLOEXEC) < 0)
+      return -1;
+    o->mode = PIPE_SPLICE;
+    o->pipe_size = grow_pipe(o->pipe[1], pipe_size);
+  } else {
+    o->mode = PIPE_COPY;
+  }
+  return 0;
+}
+
+/* Move n bytes from our own pipe to the file. */
+static int drain_pipe(struct pipe_output *o, size_t n)
+{
+  while (n) {
+    ssize_t moved = splice(o->pipe[0], NULL, o->fd, NULL, n, SPLICE_F_MOVE);
+    if (moved < 0 && errno == EINTR)
+      continue;
+    if (moved <= 0) {
+      if (moved == 0)
+        errno = EIO;
+      return -1;
+    }
+    n -= moved;
+  }
+  return 0;
+}
+
+ssize_t pipe_output_write(struct pipe_output *o, const void *data,
+                          size_t len, int timeout_ms)
+{
+  struct iovec iov = { (void *)data, len };
+  struct pollfd pfd = { o->fd, POLLOUT, 0 };
+  ssize_t n;
+
+  /* More than the pipe holds would never fit at once. */
+  if (iov.iov_len > o->pipe_size)
+    iov.iov_len = o->pipe_size;
+
+  /* Our own pipe is always empty here; anything else may be full. */
+  if (o->mode != PIPE_SPLICE) {
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0 && errno != EINTR)
+      return -1;
+    if (ready <= 0)
+      return 0;
+    if (pfd.revents & (POLLERR | POLLHUP)) {
+      errno = EPIPE;
+      return -1;
+    }
+  }
+
+  switch (o->mode) {
+  case PIPE_VMSPLICE:
+    n = vmsplice(o->fd, &iov, 1, SPLICE_F_NONBLOCK);
+    break;
+  case PIPE_SPLICE:
+    /* Non-blocking as a span that isn't page aligned needs one more page
+     * slot than its size suggests, which would wait on ourselves. */
+    n = vmsplice(o->pipe[1], &iov, 1, SPLICE_F_NONBLOCK);
+    if (n > 0 && drain_pipe(o, n) < 0)
+      return -1;
+    break;
+  default:
+    n = write(o->fd, iov.iov_base, iov.iov_len);
+    break;
+  }
+  if (n < 0)
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  o->queued += n;
+  return n;
+}
+
+uint64_t pipe_output_released(struct pipe_output *o)
+{
+  int unread;
+
+  if (o->mode != PIPE_VMSPLICE)
+    return o->queued;
+  /* What is still in the pipe still points at our pages. A reader that
+   * splices them on to a socket can take them out of the pipe before the
+   * socket is done with them; that is the one case this can't see. */
+  if (ioctl(o->fd, FIONREAD, &unread) < 0)
+    return o->queued > o->pipe_size ? o->queued - o->pipe_size : 0;
+  return o->queued - unread;
+}
+
+int pipe_output_close(struct pipe_output *o)
+{
+  int ret = close(o->fd);
+
+  if (o->pipe[0] >= 0) {
+    close(o->pipe[0]);
+    close(o->pipe[1]);
+  }
+  o->fd = -1;
+  return ret;
+}
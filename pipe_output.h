@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __PIPE_OUTPUT_H
+#define __PIPE_OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Streaming to an inherited descriptor (stdout) without copying in user
+ * space.
+ *
+ * With a pipe, the caller's pages are mapped into it with vmsplice(). The
+ * reader then sees whatever is in that memory when it reads, so the caller
+ * has to leave it alone until pipe_output_released() has gone past it. With
+ * a regular file the data goes through a pipe of our own and is spliced on
+ * to the file; it has been copied out by the time the write returns.
+ */
+
+enum pipe_mode {
+  PIPE_VMSPLICE,  /* fd is a pipe. */
+  PIPE_SPLICE,    /* fd is a regular file, through pipe[]. */
+  PIPE_COPY,      /* Plain write(), for anything else or on request. */
+};
+
+struct pipe_output {
+  int fd;
+  enum pipe_mode mode;
+  int pipe[2];
+  size_t pipe_size;  /* Bytes the pipe can hold. */
+  uint64_t queued;   /* Bytes handed over so far. */
+};
+
+/* Set up streaming to fd, growing the pipe to pipe_size bytes if the system
+ * allows (or as far as it does). With zero_copy 0, always copy, for callers
+ * whose data doesn't stay put. Returns 0, or -1 with errno set.
+ */
+int pipe_output_open(struct pipe_output *o, int fd, size_t pipe_size,
+                     int zero_copy);
+
+/* Hand over up to len bytes, waiting at most timeout_ms for the reader to
+ * make room. Returns the number of bytes taken, 0 if there was no room, or
+ * -1 with errno set (EPIPE once the reader has gone).
+ */
+ssize_t pipe_output_write(struct pipe_output *o, const void *data,
+                          size_t len, int timeout_ms);
+
+/* Total bytes handed over whose memory the kernel no longer refers to. */
+uint64_t pipe_output_released(struct pipe_output *o);
+
+/* Close fd, which the reader sees as the end of the stream. Returns 0 or
+ * -1 on error.
+ */
+int pipe_output_close(struct pipe_output *o);
+
+#endif
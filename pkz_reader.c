@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "pkz_reader.c"
+ *
+ *   Purpose : Open block containers, find blocks by sample number, byte
+ *             offset or time through the index, and read them back with
+ *             their CRCs checked.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pkz_reader.h"
+#include "crc32c.h"
+
+/* Load the index and footer, if the file was finished and they are
+ * intact. */
+static int read_index(struct pkz_reader *r)
+{
+  struct pkz_footer foot;
+  off_t end;
+
+  if (fseeko(r->f, 0, SEEK_END) != 0 || (end = ftello(r->f)) < 0 ||
+      end < (off_t)(r->header.header_size + sizeof(foot)) ||
+      fseeko(r->f, -(off_t)sizeof(foot), SEEK_END) != 0 ||
+      fread(&foot, sizeof(foot), 1, r->f) != 1 ||
+      memcmp(foot.magic, PKZ_FOOTER_MAGIC, sizeof(foot.magic)) != 0 ||
+      foot.index_offset + foot.blocks * sizeof(*r->index) + sizeof(foot) !=
+      (uint64_t)end)
+    return -1;
+  if (!(r->index = malloc(foot.blocks * sizeof(*r->index) + 1)))
+    return -1;
+  if (fseeko(r->f, foot.index_offset, SEEK_SET) != 0 ||
+      fread(r->index, sizeof(*r->index), foot.blocks, r->f) != foot.blocks ||
+      crc32c(0, r->index, foot.blocks * sizeof(*r->index)) !=
+      foot.index_crc) {
+    free(r->index);
+    r->index = NULL;
+    return -1;
+  }
+  r->blocks = foot.blocks;
+  r->raw_length = foot.raw_length;
+  r->samples = foot.samples;
+  r->finished = 1;
+  return 0;
+}
+
+/* Without an index, find the blocks from the start, up to the first that
+ * is cut short or isn't where it should be. */
+static int walk_blocks(struct pkz_reader *r)
+{
+  const struct pkz_header *h = &r->header;
+  uint64_t offset = h->header_size, cap = 0;
+  struct pkz_block b;
+  off_t end;
+
+  if (fseeko(r->f, 0, SEEK_END) != 0 || (end = ftello(r->f)) < 0)
+    return -1;
+  r->blocks = r->raw_length = r->samples = 0;
+  while (offset + sizeof(b) <= (uint64_t)end) {
+    struct pkz_index_entry *e;
+    if (fseeko(r->f, offset, SEEK_SET) != 0 ||
+        fread(&b, sizeof(b), 1, r->f) != 1 || b.magic != PKZ_BLOCK_MAGIC ||
+        b.raw_len == 0 || b.raw_len > h->block_size ||
+        b.raw_len % h->group_bytes || b.comp_len > b.raw_len ||
+        b.sample != h->base_sample + r->samples ||
+        offset + sizeof(b) + b.comp_len > (uint64_t)end)
+      break;
+    if (r->blocks == cap) {
+      uint64_t n = cap ? cap * 2 : 1024;
+      struct pkz_index_entry *index = realloc(r->index, n * sizeof(*index));
+      if (!index)
+        return -1;
+      r->index = index;
+      cap = n;
+    }
+    e = &r->index[r->blocks++];
+    e->file_offset = offset;
+    e->sample = b.sample;
+    e->time_ns = b.time_ns;
+    e->flags = b.flags;
+    e->crc = b.crc;
+    r->raw_length += b.raw_len;
+    r->samples += b.raw_len / h->group_bytes * h->group_samples;
+    offset += sizeof(b) + b.comp_len;
+    /* Only the last block may be short. */
+    if (b.raw_len != h->block_size)
+      break;
+  }
+  return 0;
+}
+
+int pkz_open(struct pkz_reader *r, const char *path)
+{
+  struct pkz_header *h = &r->header;
+
+  memset(r, 0, sizeof(*r));
+  if (!(r->f = fopen(path, "r")))
+    return -1;
+  if (fread(h, sizeof(*h), 1, r->f) != 1 ||
+      memcmp(h->magic, PKZ_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != PKZ_VERSION || h->header_size < sizeof(*h) ||
+      h->group_bytes == 0 || h->group_samples == 0 || h->block_size == 0 ||
+      h->block_size % h->group_bytes) {
+    pkz_close(r);
+    errno = EINVAL;
+    return -1;
+  }
+  if (!(r->comp = malloc(h->block_size)) ||
+      (read_index(r) < 0 && walk_blocks(r) < 0)) {
+    int err = errno;
+    pkz_close(r);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+void pkz_close(struct pkz_reader *r)
+{
+  if (r->f)
+    fclose(r->f);
+  free(r->index);
+  free(r->comp);
+  r->f = NULL;
+  r->index = NULL;
+  r->comp = NULL;
+}
+
+int64_t pkz_find_sample(const struct pkz_reader *r, uint64_t sample)
+{
+  uint64_t k;
+
+  if (sample < r->header.base_sample)
+    return -1;
+  k = (sample - r->header.base_sample) / samples_per_block(&r->header);
+  return k < r->blocks ? (int64_t)k : -1;
+}
+
+int64_t pkz_find_offset(const struct pkz_reader *r, uint64_t offset)
+{
+  uint64_t k = offset / r->header.block_size;
+
+  return k < r->blocks ? (int64_t)k : -1;
+}
+
+int pkz_sample_at(const struct pkz_reader *r, int64_t ns, uint64_t *sample)
+{
+  const struct pkz_index_entry *a, *b;
+  uint64_t lo = 0, hi = r->blocks - 1;
+  double s;
+
+  /* Blocks before the first clock reading have no time. */
+  while (lo < r->blocks && r->index[lo].time_ns == 0)
+    lo++;
+  if (r->blocks < 2 || lo >= hi)
+    return -1;
+  /* The pair of blocks around ns, or the first or last pair to extrapolate
+   * from if it is outside them. */
+  while (hi - lo > 1) {
+    uint64_t mid = (lo + hi) / 2;
+    if (r->index[mid].time_ns <= ns)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  a = &r->index[lo];
+  b = &r->index[hi];
+  if (b->time_ns == a->time_ns)
+    return -1;
+  s = a->sample + (double)(ns - a->time_ns) * (b->sample - a->sample) /
+      (b->time_ns - a->time_ns);
+  *sample = s < 0 ? 0 : (uint64_t)s;
+  return 0;
+}
+
+ssize_t pkz_read_block(struct pkz_reader *r, uint64_t k, struct pkz_block *b,
+                       void *out)
+{
+  if (k >= r->blocks) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (fseeko(r->f, r->index[k].file_offset, SEEK_SET) != 0 ||
+      fread(b, sizeof(*b), 1, r->f) != 1 || b->magic != PKZ_BLOCK_MAGIC ||
+      b->raw_len > r->header.block_size || b->comp_len > b->raw_len ||
+      fread(r->comp, 1, b->comp_len, r->f) != b->comp_len) {
+    errno = ferror(r->f) ? EIO : EBADMSG;
+    return -1;
+  }
+  if (b->crc != r->index[k].crc || block_crc(b, r->comp) != b->crc) {
+    errno = EBADMSG;
+    return -1;
+  }
+  if (!out)
+    return b->raw_len;
+  if (block_decompress(b, r->comp, out) < 0) {
+    errno = b->codec == PKZ_STORED ? EBADMSG : EINVAL;
+    return -1;
+  }
+  return b->raw_len;
+}
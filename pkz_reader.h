@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __PKZ_READER_H
+#define __PKZ_READER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "block_compress.h"
+
+/* Reading the block containers sample_grabber writes with --container or
+ * --compress, see block_compress.h for the format.
+ */
+struct pkz_reader {
+  FILE *f;
+  struct pkz_header header;
+  /* One entry per block, from the file's index or, if it was never
+   * finished, found by walking the blocks. */
+  struct pkz_index_entry *index;
+  uint64_t blocks;
+  uint64_t raw_length;       /* Bytes in all blocks. */
+  uint64_t samples;          /* Samples in all blocks. */
+  int finished;              /* The file had a good index and footer. */
+  uint8_t *comp;             /* A block read from the file. */
+};
+
+/* Open a container. Returns 0, or -1 with errno set (EINVAL if it isn't
+ * one this reader knows).
+ */
+int pkz_open(struct pkz_reader *r, const char *path);
+void pkz_close(struct pkz_reader *r);
+
+/* Block holding stream sample number sample, or -1 if it isn't in the
+ * file. */
+int64_t pkz_find_sample(const struct pkz_reader *r, uint64_t sample);
+
+/* Block holding byte offset (counted from the first block) of the samples,
+ * or -1 if it is past the end. */
+int64_t pkz_find_offset(const struct pkz_reader *r, uint64_t offset);
+
+/* Stream sample number read at CLOCK_REALTIME ns, interpolated between the
+ * times of the blocks around it (or extrapolated from the nearest two).
+ * Returns 0, or -1 if the file has too few timed blocks.
+ */
+int pkz_sample_at(const struct pkz_reader *r, int64_t ns, uint64_t *sample);
+
+/* Read block k, checking its CRC, into b and its samples into out (with
+ * room for header.block_size bytes). out may be NULL to only check it.
+ * Returns raw_len, or -1 with errno EIO if it can't be read, EBADMSG if it
+ * is corrupt or EINVAL if the codec wasn't built in.
+ */
+ssize_t pkz_read_block(struct pkz_reader *r, uint64_t k, struct pkz_block *b,
+                       void *out);
+
+#endif
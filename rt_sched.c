@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "rt_sched.c"
+ *
+ *   Purpose : Pin capture threads to CPUs, give them real-time priority and
+ *             keep their memory resident, so other load on the host can't
+ *             delay reading the FPGA FIFO.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "rt_sched.h"
+
+static const char *policy_name(int policy)
+{
+  switch (policy) {
+    case SCHED_FIFO:
+      return "SCHED_FIFO";
+    case SCHED_RR:
+      return "SCHED_RR";
+    case SCHED_OTHER:
+      return "SCHED_OTHER";
+    default:
+      return "unknown";
+  }
+}
+
+int rt_parse_policy(const char *arg, int *policy)
+{
+  if (strcmp(arg, "fifo") == 0)
+    *policy = SCHED_FIFO;
+  else if (strcmp(arg, "rr") == 0)
+    *policy = SCHED_RR;
+  else if (strcmp(arg, "other") == 0)
+    *policy = SCHED_OTHER;
+  else
+    return -1;
+  return 0;
+}
+
+int rt_requested(const struct rt_config *cfg)
+{
+  return cfg->cpu >= 0 || cfg->policy != SCHED_OTHER || cfg->priority;
+}
+
+static void report(const char *name)
+{
+  struct sched_param param;
+  cpu_set_t cpus;
+  int policy;
+  char list[256] = "";
+  size_t len = 0;
+
+  if (pthread_getschedparam(pthread_self(), &policy, &param) != 0) {
+    policy = -1;
+    param.sched_priority = 0;
+  }
+  if (pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0) {
+    for (int i = 0; i < CPU_SETSIZE && len < sizeof(list) - 8; i++)
+      if (CPU_ISSET(i, &cpus))
+        len += snprintf(list + len, sizeof(list) - len, "%s%d",
+                        len ? "," : "", i);
+  }
+  printf("%s thread: %s priority %d, CPUs %s\n", name, policy_name(policy),
+         param.sched_priority, list);
+}
+
+int rt_apply(const char *name, const struct rt_config *cfg)
+{
+  int ret = 0, err;
+
+  if (cfg->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cfg->cpu, &cpus);
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))) {
+      fprintf(stderr, "%s thread: can't pin to CPU %d: %s\n", name, cfg->cpu,
+              strerror(err));
+      ret = -1;
+    }
+  }
+
+  if (cfg->policy != SCHED_OTHER || cfg->priority) {
+    struct sched_param param = { .sched_priority = cfg->priority };
+    if ((err = pthread_setschedparam(pthread_self(), cfg->policy, &param))) {
+      fprintf(stderr, "%s thread: can't set %s priority %d: %s\n", name,
+              policy_name(cfg->policy), cfg->priority, strerror(err));
+      ret = -1;
+    }
+  }
+
+  report(name);
+  return ret;
+}
+
+int rt_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+  struct sched_param param = { .sched_priority = 0 };
+  long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  pthread_attr_t attr;
+  cpu_set_t cpus;
+  int err;
+
+  CPU_ZERO(&cpus);
+  for (long i = 0; i < ncpus && i < CPU_SETSIZE; i++)
+    CPU_SET(i, &cpus);
+  if ((err = pthread_attr_init(&attr)))
+    return err;
+  if (!(err = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED)) &&
+      !(err = pthread_attr_setschedpolicy(&attr, SCHED_OTHER)) &&
+      !(err = pthread_attr_setschedparam(&attr, &param)) &&
+      !(err = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus)))
+    err = pthread_create(thread, &attr, fn, arg);
+  pthread_attr_destroy(&attr);
+  return err;
+}
+
+int rt_lock_memory(void)
+{
+  struct rlimit rl;
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+    printf("Memory locked\n");
+    return 0;
+  }
+
+  fprintf(stderr, "Can't lock memory: %s", strerror(errno));
+  if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    fprintf(stderr, " (RLIMIT_MEMLOCK is %llu bytes)",
+            (unsigned long long)rl.rlim_cur);
+  fprintf(stderr, "\n");
+  return -1;
+}
+
+void rt_prefault(void *p, size_t len)
+{
+  volatile uint8_t *b = p;
+  long page = sysconf(_SC_PAGESIZE);
+
+  /* Write rather than read so copy-on-write zero pages are replaced too. */
+  for (size_t i = 0; i < len; i += page)
+    b[i] = 0;
+  if (len)
+    b[len - 1] = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __RT_SCHED_H
+#define __RT_SCHED_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Scheduling requested for one thread. */
+struct rt_config {
+  int cpu;       /* CPU to pin to, or -1 to leave affinity alone. */
+  int policy;    /* SCHED_OTHER, SCHED_FIFO or SCHED_RR. */
+  int priority;  /* Real-time priority, 0 for SCHED_OTHER. */
+};
+
+#define RT_CONFIG_DEFAULT { -1, 0, 0 }
+
+/* Returns non-zero if cfg asks for anything beyond the defaults. */
+int rt_requested(const struct rt_config *cfg);
+
+/* Apply cfg to the calling thread, then print what was actually granted,
+ * labelled with name. Failures are reported but not fatal.
+ * Returns 0 if everything requested was granted, -1 otherwise.
+ */
+int rt_apply(const char *name, const struct rt_config *cfg);
+
+/* Start a helper thread of one that may have been given a CPU or a
+ * real-time priority, with neither: ordinary scheduling on any CPU, so
+ * helpers don't share the one CPU or starve it. Returns 0 or an error
+ * number, as pthread_create does.
+ */
+int rt_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg);
+
+/* Lock all current and future memory of the process, reporting the
+ * outcome. Returns 0 on success, -1 on failure.
+ */
+int rt_lock_memory(void);
+
+/* Touch every page of [p, p + len) so no page faults happen later. */
+void rt_prefault(void *p, size_t len);
+
+/* Parse "fifo", "rr" or "other". Returns 0 on success, -1 on error. */
+int rt_parse_policy(const char *arg, int *policy);
+
+#endif
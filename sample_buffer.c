@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "sample_buffer.c"
+ *
+ *   Purpose : Bounded buffering between the USB callback and the file
+ *             writer, with a choice of what to do when the disk falls behind
+ *             and counters describing how often that happened.
+ *
+ *             With the spill policy, data that does not fit in memory is
+ *             appended to a file on a secondary disk. Ordering is kept by
+ *             never putting data in memory while the spill file holds
+ *             anything: the consumer drains memory first (all older than the
+ *             spill file), then the spill file, and only when it has read
+ *             the spill file to the end does the producer go back to memory.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "sample_buffer.h"
+
+/* Size of the queue of gap records between producer and consumer. */
+#define GAP_QUEUE_SIZE (64*1024)
+/* How long a blocked producer sleeps between checks for room. */
+#define BLOCK_POLL_NS 100000
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+int parse_overflow_policy(const char *arg, enum overflow_policy *policy)
+{
+  if (strcmp(arg, "stop") == 0)
+    *policy = OVERFLOW_STOP;
+  else if (strcmp(arg, "block") == 0)
+    *policy = OVERFLOW_BLOCK;
+  else if (strcmp(arg, "drop") == 0)
+    *policy = OVERFLOW_DROP;
+  else if (strcmp(arg, "spill") == 0)
+    *policy = OVERFLOW_SPILL;
+  else
+    return -1;
+  return 0;
+}
+
+const char *gap_reason_name(enum gap_reason reason)
+{
+  switch (reason) {
+    case GAP_DROPPED:
+      return "dropped";
+    case GAP_FIFO:
+      return "fifo";
+    default:
+      return "unknown";
+  }
+}
+
+int sample_buffer_init(struct sample_buffer *sb, size_t size, size_t granule,
+                       enum overflow_policy policy, const char *spill_dir,
+                       size_t chunk, volatile int *stop)
+{
+  memset(sb, 0, sizeof(*sb));
+  sb->policy = policy;
+  sb->granule = granule ? granule : 1;
+  sb->spill_fd = -1;
+  sb->stop = stop;
+
+  if (sb->granule > sizeof(sb->carry))
+    return -1;
+  if (spsc_ring_init(&sb->ring, size) < 0)
+    return -1;
+  if (spsc_ring_init(&sb->gaps, GAP_QUEUE_SIZE) < 0) {
+    spsc_ring_destroy(&sb->ring);
+    return -1;
+  }
+
+  if (policy == OVERFLOW_SPILL) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/sample_grabber-spill-XXXXXX",
+             spill_dir ? spill_dir : ".");
+    if ((sb->spill_fd = mkstemp(path)) < 0) {
+      fprintf(stderr, "Can't create spill file %s, Error %s\n", path,
+              strerror(errno));
+      sample_buffer_destroy(sb);
+      return -1;
+    }
+    /* Nobody else needs to see it and it should vanish with us. */
+    unlink(path);
+    sb->bounce_size = chunk;
+    if (!(sb->bounce = malloc(chunk))) {
+      sample_buffer_destroy(sb);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void sample_buffer_destroy(struct sample_buffer *sb)
+{
+  spsc_ring_destroy(&sb->ring);
+  spsc_ring_destroy(&sb->gaps);
+  if (sb->spill_fd >= 0)
+    close(sb->spill_fd);
+  sb->spill_fd = -1;
+  free(sb->bounce);
+  sb->bounce = NULL;
+}
+
+static void queue_gap(struct sample_buffer *sb, const struct sample_gap *gap)
+{
+  if (spsc_ring_write(&sb->gaps, gap, sizeof(*gap)) != 0)
+    sb->stats.gaps_lost++;
+}
+
+static void flush_pending_gap(struct sample_buffer *sb)
+{
+  if (sb->pending_gap.length) {
+    queue_gap(sb, &sb->pending_gap);
+    sb->pending_gap.length = 0;
+  }
+}
+
+void sample_buffer_add_gap(struct sample_buffer *sb, uint64_t stream_offset,
+                           uint64_t output_offset, uint64_t length,
+                           enum gap_reason reason)
+{
+  struct sample_gap gap = { stream_offset, output_offset, length, reason };
+
+  flush_pending_gap(sb);
+  queue_gap(sb, &gap);
+}
+
+/* Drop a chunk, merging it with the previous drop if they are adjacent. */
+static void drop(struct sample_buffer *sb, uint64_t stream_offset, size_t len)
+{
+  struct sample_gap *g = &sb->pending_gap;
+
+  sb->stats.bytes_dropped += len;
+  if (g->length && g->stream_offset + g->length == stream_offset) {
+    g->length += len;
+    return;
+  }
+  flush_pending_gap(sb);
+  sb->stats.drop_events++;
+  g->stream_offset = stream_offset;
+  g->output_offset = sb->output_bytes;
+  g->length = len;
+  g->reason = GAP_DROPPED;
+}
+
+/* Append to the spill file in whole granules, holding back any remainder
+ * in carry so the consumer can always drain the spill file completely.
+ */
+static int spill_append(struct sample_buffer *sb, const uint8_t *data,
+                        size_t len)
+{
+  size_t total = sb->carry_len + len;
+  size_t aligned = total - total % sb->granule;
+  size_t from_data;
+  uint64_t backlog;
+
+  if (aligned == 0) {
+    memcpy(sb->carry + sb->carry_len, data, len);
+    sb->carry_len += len;
+    return 0;
+  }
+
+  from_data = aligned - sb->carry_len;
+  struct iovec iov[2] = {
+    { sb->carry, sb->carry_len },
+    { (void *)data, from_data },
+  };
+  int iovcnt = 2;
+  struct iovec *v = iov;
+  uint64_t off = sb->spill_written;
+  if (sb->carry_len == 0) {
+    v++;
+    iovcnt--;
+  }
+  while (iovcnt > 0) {
+    ssize_t n = pwritev(sb->spill_fd, v, iovcnt, off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Spill file write error: %s\n", strerror(errno));
+      return -1;
+    }
+    off += n;
+    while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+      n -= v->iov_len;
+      v++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      v->iov_base = (uint8_t *)v->iov_base + n;
+      v->iov_len -= n;
+    }
+  }
+
+  sb->carry_len = len - from_data;
+  memcpy(sb->carry, data + from_data, sb->carry_len);
+  __atomic_store_n(&sb->spill_written, sb->spill_written + aligned,
+                   __ATOMIC_RELEASE);
+
+  sb->stats.bytes_spilled += aligned;
+  backlog = sb->spill_written - __atomic_load_n(&sb->spill_read,
+                                                __ATOMIC_ACQUIRE);
+  if (backlog > sb->stats.spill_high_water)
+    sb->stats.spill_high_water = backlog;
+  return 0;
+}
+
+static int push_overflow(struct sample_buffer *sb, const uint8_t *data,
+                         size_t len, uint64_t stream_offset)
+{
+  switch (sb->policy) {
+    case OVERFLOW_STOP:
+      return -1;
+
+    case OVERFLOW_BLOCK: {
+      double t0 = now_s(), dt;
+      struct timespec ts = { 0, BLOCK_POLL_NS };
+      if (len > sb->ring.size)
+        return -1;
+      while (spsc_ring_write(&sb->ring, data, len) != 0) {
+        if (*sb->stop)
+          return -1;
+        nanosleep(&ts, NULL);
+      }
+      dt = now_s() - t0;
+      sb->stats.stalls++;
+      sb->stats.stall_total += dt;
+      if (dt > sb->stats.stall_max)
+        sb->stats.stall_max = dt;
+      return 0;
+    }
+
+    case OVERFLOW_DROP:
+      drop(sb, stream_offset, len);
+      return 1;
+
+    case OVERFLOW_SPILL: {
+      /* Fill memory up to a granule boundary so the consumer never waits
+       * on a partial granule in memory while the rest is in the spill file.
+       * The ring always has at least that much room.
+       */
+      size_t k = (sb->granule - sb->ring.head % sb->granule) % sb->granule;
+      if (k > len || (k && spsc_ring_write(&sb->ring, data, k) != 0))
+        return -1;
+      sb->spilling = 1;
+      sb->stats.spill_events++;
+      return spill_append(sb, data + k, len - k);
+    }
+  }
+  return -1;
+}
+
+int sample_buffer_push(struct sample_buffer *sb, const uint8_t *data,
+                       size_t len)
+{
+  uint64_t stream_offset = sb->stream_bytes;
+  size_t fill;
+  int ret = 0;
+
+  sb->stream_bytes += len;
+
+  if (sb->spilling) {
+    /* Go back to memory once the consumer has read everything we spilled,
+     * carried bytes first.
+     */
+    if (__atomic_load_n(&sb->spill_read, __ATOMIC_ACQUIRE) ==
+        sb->spill_written &&
+        spsc_ring_write_space(&sb->ring) >= sb->carry_len + len) {
+      spsc_ring_write(&sb->ring, sb->carry, sb->carry_len);
+      sb->carry_len = 0;
+      sb->spilling = 0;
+    } else {
+      ret = spill_append(sb, data, len);
+      if (ret == 0)
+        sb->output_bytes += len;
+      return ret;
+    }
+  }
+
+  if (spsc_ring_write(&sb->ring, data, len) != 0)
+    ret = push_overflow(sb, data, len, stream_offset);
+  if (ret < 0)
+    return ret;
+  if (ret == 0) {
+    flush_pending_gap(sb);
+    sb->output_bytes += len;
+  }
+
+  fill = sb->ring.size - spsc_ring_write_space(&sb->ring);
+  if (fill > sb->stats.high_water)
+    sb->stats.high_water = fill;
+  return 0;
+}
+
+void sample_buffer_finish(struct sample_buffer *sb)
+{
+  flush_pending_gap(sb);
+}
+
+ssize_t sample_buffer_peek(struct sample_buffer *sb, const uint8_t **p)
+{
+  uint64_t written;
+  size_t n;
+  ssize_t got;
+
+  /* Finish what is left of the last spill file read first. */
+  if (sb->bounce_off < sb->bounce_len) {
+    *p = sb->bounce + sb->bounce_off;
+    return sb->bounce_len - sb->bounce_off;
+  }
+
+  n = spsc_ring_read_peek(&sb->ring, p);
+  if (n || sb->spill_fd < 0)
+    return n;
+
+  written = __atomic_load_n(&sb->spill_written, __ATOMIC_ACQUIRE);
+  if (written == sb->spill_read)
+    return 0;
+
+  n = written - sb->spill_read < sb->bounce_size ?
+      written - sb->spill_read : sb->bounce_size;
+  do {
+    got = pread(sb->spill_fd, sb->bounce, n, sb->spill_read);
+  } while (got < 0 && errno == EINTR);
+  if (got <= 0)
+    return -1;
+
+  sb->bounce_off = 0;
+  sb->bounce_len = got;
+  *p = sb->bounce;
+  return got;
+}
+
+size_t sample_buffer_peek_ahead(struct sample_buffer *sb, size_t skip,
+                                const uint8_t **p)
+{
+  return spsc_ring_read_peek_at(&sb->ring, skip, p);
+}
+
+void sample_buffer_commit(struct sample_buffer *sb, size_t n)
+{
+  uint64_t punch_end;
+
+  if (sb->bounce_off >= sb->bounce_len) {
+    spsc_ring_read_commit(&sb->ring, n);
+    return;
+  }
+
+  sb->bounce_off += n;
+  if (sb->bounce_off >= sb->bounce_len)
+    sb->bounce_off = sb->bounce_len = 0;
+  __atomic_store_n(&sb->spill_read, sb->spill_read + n, __ATOMIC_RELEASE);
+
+  /* Give the disk space back as the spill file is consumed. */
+  punch_end = sb->spill_read & ~(uint64_t)(1024*1024 - 1);
+  if (punch_end > sb->spill_punched) {
+    fallocate(sb->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              sb->spill_punched, punch_end - sb->spill_punched);
+    sb->spill_punched = punch_end;
+  }
+}
+
+uint64_t sample_buffer_pending(struct sample_buffer *sb)
+{
+  uint64_t pending = spsc_ring_read_avail(&sb->ring);
+
+  if (sb->spill_fd >= 0)
+    pending += __atomic_load_n(&sb->spill_written, __ATOMIC_ACQUIRE) -
+               __atomic_load_n(&sb->spill_read, __ATOMIC_ACQUIRE);
+  return pending;
+}
+
+int sample_buffer_pop_gap(struct sample_buffer *sb, struct sample_gap *gap)
+{
+  const uint8_t *p;
+
+  /* struct sample_gap is 32 bytes, so a peek never splits one. */
+  if (spsc_ring_read_peek(&sb->gaps, &p) < sizeof(*gap))
+    return 0;
+  memcpy(gap, p, sizeof(*gap));
+  spsc_ring_read_commit(&sb->gaps, sizeof(*gap));
+  return 1;
+}
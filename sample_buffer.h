@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __SAMPLE_BUFFER_H
+#define __SAMPLE_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "spsc_ring.h"
+
+/* What to do when the memory buffer is full. */
+enum overflow_policy {
+  OVERFLOW_STOP,   /* Report the overflow and stop capturing. */
+  OVERFLOW_BLOCK,  /* Wait for the consumer to make room. */
+  OVERFLOW_DROP,   /* Drop the new data and record a gap. */
+  OVERFLOW_SPILL,  /* Append to a spill file until the consumer catches up. */
+};
+
+enum gap_reason {
+  GAP_DROPPED,     /* Dropped because the buffer was full. */
+  GAP_FIFO,        /* Bytes flagged by the FPGA FIFO error flag. */
+};
+
+/* A region of the received stream that is missing or damaged in the data
+ * handed to the consumer.
+ */
+struct sample_gap {
+  uint64_t stream_offset;  /* Byte offset in the received stream. */
+  uint64_t output_offset;  /* Byte offset in the consumer's data. */
+  uint64_t length;         /* Length in bytes. */
+  uint64_t reason;         /* enum gap_reason. */
+};
+
+/* Producer side counters. Only written by the producer; other threads may
+ * read them at any time for reporting.
+ */
+struct sample_buffer_stats {
+  uint64_t high_water;       /* Largest number of bytes buffered in memory. */
+  uint64_t bytes_dropped;
+  uint64_t drop_events;
+  uint64_t stalls;           /* Times the producer had to wait for room. */
+  double stall_total;        /* Seconds spent waiting in total. */
+  double stall_max;          /* Longest single wait in seconds. */
+  uint64_t bytes_spilled;
+  uint64_t spill_events;
+  uint64_t spill_high_water; /* Most bytes waiting in the spill file. */
+  uint64_t gaps_lost;        /* Gap records dropped as the queue was full. */
+};
+
+/* Bounded buffer between the USB callback (producer) and the file writer
+ * (consumer), built on an spsc_ring plus an optional spill file.
+ */
+struct sample_buffer {
+  struct spsc_ring ring;
+  struct spsc_ring gaps;
+  enum overflow_policy policy;
+  size_t granule;
+
+  /* Spill file. spill_written is only stored by the producer, spill_read
+   * only by the consumer.
+   */
+  int spill_fd;
+  uint64_t spill_written;
+  uint64_t spill_read;
+  int spilling;
+  uint8_t carry[8];
+  size_t carry_len;
+  uint64_t spill_punched;
+  uint8_t *bounce;
+  size_t bounce_size, bounce_off, bounce_len;
+  struct sample_gap pending_gap;
+
+  /* Producer position in the stream and in the consumer's data. */
+  uint64_t stream_bytes;
+  uint64_t output_bytes;
+
+  volatile int *stop;
+  struct sample_buffer_stats stats;
+};
+
+/* Set up a buffer holding size bytes in memory. The consumer always reads
+ * whole multiples of granule bytes (at most 8). spill_dir is only used with
+ * OVERFLOW_SPILL; chunk is the largest read the consumer will make. While
+ * blocked, the producer gives up if *stop becomes non-zero.
+ * Returns 0 on success, -1 on error.
+ */
+int sample_buffer_init(struct sample_buffer *sb, size_t size, size_t granule,
+                       enum overflow_policy policy, const char *spill_dir,
+                       size_t chunk, volatile int *stop);
+void sample_buffer_destroy(struct sample_buffer *sb);
+
+/* Queue len bytes from the producer, applying the overflow policy if they
+ * do not fit. Returns 0 if the data was queued or handled by the policy,
+ * -1 if capture should stop.
+ */
+int sample_buffer_push(struct sample_buffer *sb, const uint8_t *data,
+                       size_t len);
+
+/* Called by the producer after its last push, to flush a pending gap. */
+void sample_buffer_finish(struct sample_buffer *sb);
+
+/* Record a gap found by the producer, e.g. a damaged region of the stream
+ * that is still passed through.
+ */
+void sample_buffer_add_gap(struct sample_buffer *sb, uint64_t stream_offset,
+                           uint64_t output_offset, uint64_t length,
+                           enum gap_reason reason);
+
+/* Point *p at the next data to consume and return its length, or 0 if
+ * there is nothing to read. Returns -1 on a spill file read error.
+ */
+ssize_t sample_buffer_peek(struct sample_buffer *sb, const uint8_t **p);
+/* Like sample_buffer_peek, but for the data skip bytes on, so the consumer
+ * can keep earlier data in use before committing it. Only for buffers
+ * without a spill file, where data stays put in memory until committed.
+ */
+size_t sample_buffer_peek_ahead(struct sample_buffer *sb, size_t skip,
+                                const uint8_t **p);
+/* Release n bytes returned by the last peek. */
+void sample_buffer_commit(struct sample_buffer *sb, size_t n);
+/* Bytes waiting for the consumer, in memory and in the spill file. */
+uint64_t sample_buffer_pending(struct sample_buffer *sb);
+
+/* Pop the next gap record. Returns 1 if one was returned, 0 if none. */
+int sample_buffer_pop_gap(struct sample_buffer *sb, struct sample_gap *gap);
+
+const char *gap_reason_name(enum gap_reason reason);
+int parse_overflow_policy(const char *arg, enum overflow_policy *policy);
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __SAMPLE_FORMAT_H
+#define __SAMPLE_FORMAT_H
+
+/* Formats sample_grabber can write samples in, as recorded in the headers
+ * of its containers.
+ */
+enum sample_format {
+  /* As the Piksi sends them: two 3-bit samples per byte in bits [7:5] and
+   * [4:2], bit 0 the FPGA FIFO error flag (active low). */
+  FORMAT_PIKSI = 0,
+  /* --onebit: sign bits only, 8 samples per byte, first sample in the
+   * MSB. */
+  FORMAT_1BIT = 1,
+  /* --dense3: the 3-bit samples back to back, 8 in every 3 bytes, first
+   * sample in the top bits of the first byte. */
+  FORMAT_DENSE3 = 2,
+};
+
+#endif
@@ -53,9 +53,28 @@
 #include <errno.h>
 #include <time.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "ftdi.h"
-#include "pipe/pipe.h"
+#include "libusb.h"
+#include "fifo_check.h"
+#include "sample_buffer.h"
+#include "usb_stream.h"
+#include "usb_autotune.h"
+#include "rt_sched.h"
+#include "ts_index.h"
+#include "usb_devices.h"
+#include "telemetry.h"
+#include "file_output.h"
+#include "file_rotation.h"
+#include "stripe_output.h"
+#include "pipe_output.h"
+#include "shm_ring.h"
+#include "net_sink.h"
+#include "block_compress.h"
+#include "dense3.h"
+#include "trigger.h"
 
 /* TODO: add verbose option back in. */
 
@@ -67,44 +86,295 @@
 #define NUM_FLUSH_BYTES 50000
 /* Number of samples in each byte received from the device. */
 #define SAMPLES_PER_BYTE 2
-/* Maximum number of elements in pipe - 0 means size is unconstrained. */
-#define PIPE_SIZE 0 //(512*1024*1024)
+/* Samples per second from the device. */
+#define SAMPLE_RATE 16368000
+/* Default size of the sample buffer between readCallback and file_writer. */
+#define RING_SIZE (512*1024*1024)
+/* How long file_writer sleeps when the sample buffer is empty. */
+#define WRITER_IDLE_US 1000
+/* Default number of write buffers for --io direct. */
+#define IO_BUFFERS 4
+/* Default USB queue: packets per bulk transfer and transfers kept in flight. */
+#define PACKETS_PER_TRANSFER 8
+#define NUM_TRANSFERS 256
+/* Default FTDI latency timer in ms. A value of 1 results in many skipped
+ * blocks. */
+#define LATENCY_TIMER 2
+/* Default number of samples between --timestamps index records. */
+#define TS_INTERVAL (1000*1000)
+/* Size of the queue of timestamp records for file_writer. */
+#define TS_QUEUE_SIZE (64*1024)
+/* Default --stripe-size. */
+#define STRIPE_SIZE (16*1024*1024)
+/* Size of the queue of --rotate-align boundaries for file_writer. */
+#define ROTATE_QUEUE_SIZE (4*1024)
+/* Size to grow the stdout pipe to, about a second of samples. */
+#define PIPE_SIZE (16*1024*1024)
+/* How long the stdout writer waits at a time for the reader. */
+#define PIPE_TIMEOUT_MS 100
+/* Default --shm-size, a few seconds of samples. */
+#define SHM_SIZE (64*1024*1024)
+/* Default --net-backlog, about 15 seconds of samples. */
+#define NET_BACKLOG (256*1024*1024)
+/* How long to keep trying to send the backlog at the end of a capture. */
+#define NET_FLUSH_MS 5000
+/* Uncompressed bytes per --compress block, the unit of random access. */
+#define COMPRESS_BLOCK (1024*1024)
+/* Default --compress-threads. */
+#define COMPRESS_THREADS 2
+/* Default --posttrigger, seconds. */
+#define POSTTRIGGER_SECONDS 10
+/* Bytes per --trigger-power measurement, about 16 ms of samples. */
+#define TRIGGER_POWER_WINDOW (128*1024)
+/* Default --drain-timeout, seconds to wait for the writer at the end. */
+#define DRAIN_TIMEOUT 60
+/* How often main checks on the draining writer. */
+#define DRAIN_POLL_US 100000
+/* Default number of seconds to run each --autotune combination for. */
+#define AUTOTUNE_SECONDS 5
+/* Most devices one sample_grabber captures from. */
+#define MAX_DEVICES 16
 
-/* FPGA FIFO Error Flag is 0th bit, active low. */
-#define FPGA_FIFO_ERROR_CHECK(byte) (!(byte & 0x01))
-
-static uint64_t total_unflushed_bytes = 0;
 static long long int bytes_wanted = 0; /* 0 means uninitialized. */
 
-static FILE *outputFile = NULL;
 const char *output_filename;
 
-static int exitRequested = 0;
+static volatile int exitRequested = 0;
+
+/* Where readCallback saw the wall clock pass a --rotate-align boundary. */
+struct rotate_mark {
+  uint64_t offset;  /* Sample buffer offset of the first byte after it. */
+  int64_t time;     /* The boundary, in seconds since the epoch. */
+};
+
+/* FPGA FIFO overflows seen with --continue. */
+struct overflow_stats {
+  uint64_t events;
+  uint64_t bytes;
+  uint64_t longest;
+  uint64_t dropped_bytes;  /* Flagged, in data the sample buffer dropped. */
+};
+
+/* Everything about the capture from one device. The USB callback for the
+ * device and its file_writer thread only ever touch their own capture.
+ */
+struct capture {
+  struct usb_device_id id;
+  struct ftdi_context *ftdi;
+  struct usb_stream *stream;
+  /* Counters for this device in the telemetry block. */
+  struct telemetry_device *tm;
+  /* Short name of the device, and the prefix for messages about it (empty
+   * with a single device). */
+  char name[24];
+  char tag[32];
+  /* output_filename, with the device added if there are several. */
+  char *output_filename;
+  /* The --shm ring and its name, likewise. */
+  struct shm_ring_header *shm;
+  char *shm_name;
+  /* --net sender. */
+  struct net_sink *net;
+  /* Set to stop capturing from this device alone. */
+  volatile int done;
+  /* Shutdown: producer_closed is set once nothing more will be pushed into
+   * the sample buffer, and the writer then exits when it has written all
+   * of it. abort_writer makes it exit at once, after an error or when
+   * draining takes too long. writer_exited is set as it returns. */
+  int producer_closed;
+  volatile int abort_writer;
+  int writer_exited;
+  /* Bytes in the sample buffer when the producer closed. */
+  uint64_t drain_pending;
+  /* --pretrigger event log, opened on the first event. */
+  FILE *eventsFile;
+
+  uint64_t total_num_bytes_received;
+  uint64_t total_unflushed_bytes;
+
+  struct overflow_stats overflow;
+  /* Overflow region currently open, it may span several USB transfers. */
+  int overflow_in_run;
+  uint64_t overflow_run_start, overflow_run_output, overflow_run_len;
 
-int pid = USB_CUSTOM_PID;
+  /* Sample buffer between the USB callback and the file writing thread. */
+  struct sample_buffer sample_buf;
+  pthread_t file_writing_thread;
+  int writer_started;
+  struct file_output out;
+  /* Used instead of out with --stripe. */
+  struct stripe_output stripes;
+  /* With --compress, in front of out or stripes. */
+  struct block_compress compress;
+  /* Sidecar listing gaps in the saved samples, opened on the first gap. */
+  FILE *gapFile;
+  /* Timestamp records from readCallback and the current file's index. */
+  struct spsc_ring ts_ring;
+  FILE *tsFile;
+  /* The current file's .durable record, and the length it last gave. */
+  FILE *durableFile;
+  uint64_t durable_recorded;
+  uint64_t next_ts_sample;
+  /* --rotate-align boundaries from readCallback, and the sample buffer
+   * offset up to which they have been queued. */
+  struct spsc_ring rotate_ring;
+  uint64_t marked_bytes;
+  int64_t next_boundary_ns, last_push_ns;
+  uint64_t last_push_bytes;
+};
+
+static struct capture captures[MAX_DEVICES];
+static int num_captures = 0;
+
+/* Devices whose transfers are handled by one USB event thread, all opened
+ * in that thread's libusb context.
+ */
+struct usb_group {
+  struct libusb_context *ctx;
+  struct usb_stream *streams[MAX_DEVICES];
+  void *userdata[MAX_DEVICES];
+  int num_streams;
+  pthread_barrier_t *start;
+  pthread_t thread;
+  int result;
+};
+
+/* Product IDs to capture from, see --id and --all. */
+int pids[MAX_DEVICES] = { USB_CUSTOM_PID };
+int num_pids = 1;
+int all_devices = 0;
+/* Number of USB event threads, see --usb-threads. */
+int usb_threads = 1;
+/* Live counters and where to publish them, see --metrics-*. */
+static struct telemetry *telemetry;
+struct telemetry_export metrics = { NULL, NULL, 1000, 0 };
+const char *metrics_shm = NULL;
+/* How file_writer writes, see --io. */
+enum output_backend output_backend = OUTPUT_STDIO;
+int io_buffers = IO_BUFFERS;
+uint64_t io_sync = 0;
+/* Most unsynced output, see --durable-size and --durable-time. */
+uint64_t durable_size = 0;
+int durable_time = 0;
 int pack_1bit = 0;
+int pack_dense3 = 0;
+/* With -1 or --dense3, output is written in groups of pack_out bytes made
+ * from pack_in bytes of samples. */
+size_t pack_in = 1, pack_out = 1;
 int verbose = 0;
 int rotate_interval = 0;
+/* Rotation by sample count or output size, see --rotate-samples and
+ * --rotate-size, as sample buffer bytes per file. */
+long long int rotate_samples = 0, rotate_size = 0;
+uint64_t rotate_span = 0;
+int rotate_align = 0;
+/* Directories to stripe the output over, see --stripe. */
+char *stripe_dirs[STRIPE_MAX_FILES];
+int num_stripe_dirs = 0;
+uint64_t stripe_size = STRIPE_SIZE;
+/* Where samples go with filename - (stdout is pointed at stderr). */
+int stdout_fd = -1;
+/* Shared memory ring to publish the stream in, see --shm. */
+const char *shm_name;
+size_t shm_size = SHM_SIZE;
+/* Receiver to stream to, see --net. */
+const char *net_addr;
+size_t net_backlog = NET_BACKLOG;
+/* Write the output as a block container, see --container and --compress. */
+int container = 0;
+/* Codec to compress the output with, see --compress. */
+enum pkz_codec compress_codec = PKZ_STORED;
+int compress_level = 0;
+int compress_threads = COMPRESS_THREADS;
+int continue_on_overflow = 0;
+/* Pre-trigger capture, see --pretrigger, with its windows in sample buffer
+ * bytes. */
+uint64_t pretrigger_bytes = 0, posttrigger_bytes = 0;
+const char *trigger_socket = NULL;
+int trigger_power = 0;
+double trigger_power_db = 0;
+static struct trigger triggers;
+/* Seconds to let the writer drain the sample buffer at the end. */
+int drain_timeout = DRAIN_TIMEOUT;
 
-/* Number of bytes to read out of pipe and write to disk at a time. */
+/* Number of bytes to read out of the sample buffer and write to disk at a
+ * time. */
 size_t write_chunk = 1024*1024;
+/* Capacity of the sample buffer in bytes, rounded up to a power of two. */
+size_t ring_size = RING_SIZE;
+/* What to do when the sample buffer is full, see --overflow. */
+enum overflow_policy overflow_policy = OVERFLOW_STOP;
+const char *spill_dir = NULL;
+/* Scheduling of the USB event and file writing threads. */
+struct rt_config usb_rt = RT_CONFIG_DEFAULT;
+struct rt_config writer_rt = RT_CONFIG_DEFAULT;
+int lock_memory = 0;
+/* Samples between timestamp index records, 0 for no index. */
+long long int ts_interval = 0;
+/* USB queue settings, see --packets, --transfers and --latency. */
+int packets_per_transfer = PACKETS_PER_TRANSFER;
+int num_transfers = NUM_TRANSFERS;
+int latency_timer = LATENCY_TIMER;
+int autotune_seconds = 0;
 
-  
-/* Pipe structs and pointers. */
-static pipe_t *sample_pipe;
-static pthread_t file_writing_thread;
-static pipe_producer_t* pipe_writer;
-static pipe_consumer_t* pipe_reader;
+/* Long options without a short equivalent. */
+enum {
+  OPT_SPILL_DIR = 256,
+  OPT_USB_CPU,
+  OPT_WRITER_CPU,
+  OPT_USB_PRIORITY,
+  OPT_WRITER_PRIORITY,
+  OPT_SCHED,
+  OPT_MLOCK,
+  OPT_TIMESTAMPS,
+  OPT_ALL_DEVICES,
+  OPT_USB_THREADS,
+  OPT_METRICS_FILE,
+  OPT_METRICS_SOCKET,
+  OPT_METRICS_SHM,
+  OPT_IO,
+  OPT_IO_BUFFERS,
+  OPT_IO_SYNC,
+  OPT_DURABLE_SIZE,
+  OPT_DURABLE_TIME,
+  OPT_ROTATE_SAMPLES,
+  OPT_ROTATE_SIZE,
+  OPT_ROTATE_ALIGN,
+  OPT_STRIPE,
+  OPT_STRIPE_SIZE,
+  OPT_SHM,
+  OPT_SHM_SIZE,
+  OPT_NET,
+  OPT_NET_BACKLOG,
+  OPT_COMPRESS,
+  OPT_COMPRESS_THREADS,
+  OPT_DENSE3,
+  OPT_CONTAINER,
+  OPT_DRAIN_TIMEOUT,
+  OPT_PRETRIGGER,
+  OPT_POSTTRIGGER,
+  OPT_TRIGGER_SOCKET,
+  OPT_TRIGGER_POWER,
+};
 
 static void sigintHandler(int signum)
 {
-  exitRequested = 1;
+  /* Counted, so a second one can cut short draining the writers. */
+  exitRequested++;
+  for (int i = 0; i < num_captures; i++)
+    captures[i].done = 1;
+}
+
+static void sigusr1Handler(int signum)
+{
+  trigger_fire(&triggers, TRIGGER_SIGNAL);
 }
 
 static void print_usage(void)
 {
   printf(
-  "Usage: ./sample_grabber [-s num] [-i pid] [-h] [-1] [-r] [-c SIZE] [filename]\n"
+  "Usage: ./sample_grabber [-s num] [-i pid] [-h] [-1] [-r] [-c SIZE] [-b SIZE]\n"
+  "                        [-o POLICY] [-k] [-p N] [-t N] [-l MS] [-a] [filename]\n"
   "Options:\n"
   "  [--verbose -v]  Print more verbose output.\n"
   "  [--size -s]     Number of samples to collect before exiting.\n"
@@ -114,15 +384,154 @@ static void print_usage(void)
   "  [--id -i]       Product ID of Piksi to take samples from.\n"
   "                    Default is 0x8398.\n"
   "                    Valid range 0x0001 to 0xFFFF.\n"
+  "                  A comma separated list captures from several Piksies at\n"
+  "                  once, each to filename with -PID added before the\n"
+  "                  extension.\n"
+  "  [--all]         Capture from every Piksi with the product ID(s) above,\n"
+  "                  not just the first one found.\n"
+  "  [--usb-threads N]\n"
+  "                  Spread the devices over N USB event threads. Default 1.\n"
   "  [--help -h]     Print usage information and exit.\n"
   "  [--onebit -1]   Convert samples to packed 1-bit format (MSB first)\n"
+  "  [--dense3]      Pack the 3-bit samples back to back, 8 in every 3 bytes\n"
+  "                  (see dense3.h), dropping only the FIFO error flag.\n"
+  "                  piksi_to_dense3 -u turns them back into Piksi bytes.\n"
   "  [--rotate -r INTERVAL]\n"
   "                  Rotate files every INTERVAL seconds for long-term archive\n"
   "                  The system date and time will be appended to the filename.\n"
+  "  [--rotate-align] With -r, split files at the exact sample where the wall\n"
+  "                  clock passes each INTERVAL, going by the host clock at\n"
+  "                  USB completion.\n"
+  "  [--rotate-samples N] [--rotate-size SIZE]\n"
+  "                  Rotate files every N samples or SIZE bytes of output\n"
+  "                  exactly (suffixes as above), naming each file after its\n"
+  "                  first sample number.\n"
   "  [--chunk -c SIZE]\n"
   "                  Write file in chunks of SIZE (suffixes as above)\n"
+  "  [--buffer -b SIZE]\n"
+  "                  Buffer up to SIZE bytes between USB and disk (suffixes as\n"
+  "                  above). Default is 512M.\n"
+  "  [--overflow -o POLICY]\n"
+  "                  What to do when the buffer is full:\n"
+  "                    stop  - end the capture (default)\n"
+  "                    block - wait for the disk, stalling USB\n"
+  "                    drop  - discard new samples, listing each gap in\n"
+  "                            filename.gaps\n"
+  "                    spill - write to a spill file until the disk catches up\n"
+  "  [--spill-dir DIR]\n"
+  "                  Directory for the spill file, ideally on another fast\n"
+  "                  disk. Default is the current directory.\n"
+  "  [--continue -k] Keep capturing through FPGA FIFO overflows instead of\n"
+  "                  stopping. Each overflow region is listed in filename.gaps\n"
+  "                  and the flagged bytes are kept in the file.\n"
+  "  [--io BACKEND]  How to write files:\n"
+  "                    stdio  - buffered writes through the page cache\n"
+  "                             (default)\n"
+  "                    direct - O_DIRECT writes from aligned buffers by a\n"
+  "                             separate I/O thread, for flat write latency\n"
+  "                    uring  - O_DIRECT writes from registered buffers with\n"
+  "                             up to N-1 in flight through io_uring; falls\n"
+  "                             back to direct without kernel support\n"
+  "  [--io-buffers N] Write buffers of --chunk SIZE for --io direct/uring.\n"
+  "                  Default is 4.\n"
+  "  [--io-sync SIZE] With --io uring, sync the file every SIZE bytes with\n"
+  "                  an fdatasync linked behind the write that crosses it\n"
+  "                  (suffixes as above). Default is no syncs.\n"
+  "  [--durable-size SIZE] [--durable-time SECONDS]\n"
+  "                  With --io stdio or direct, leave at most about SIZE\n"
+  "                  bytes (suffixes as above) or SECONDS of output unsynced,\n"
+  "                  writing it back steadily with sync_file_range and\n"
+  "                  keeping it out of the page cache once on disk. How much\n"
+  "                  of the file is safe, in bytes and as the stream sample\n"
+  "                  number it ends at, is kept in filename.durable.\n"
+  "  [--stripe DIRS] Stripe the output round-robin over a comma separated\n"
+  "                  list of directories, ideally on different disks, with a\n"
+  "                  writer thread each. filename.stripes lists the layout;\n"
+  "                  unstripe puts the stream back together.\n"
+  "  [--stripe-size SIZE]\n"
+  "                  Bytes per stripe (suffixes as above). Default is 16M.\n"
+  "  [--shm NAME]    Also publish the stream in POSIX shared memory ring\n"
+  "                  NAME (e.g. /piksi), for any number of local readers\n"
+  "                  such as shm_cat. Works without a filename too.\n"
+  "  [--shm-size SIZE]\n"
+  "                  Bytes in the shared memory ring (suffixes as above).\n"
+  "                  Default is 64M.\n"
+  "  [--net HOST:PORT]\n"
+  "                  Also stream to a receiver (e.g. piksi_ingestd) over TCP\n"
+  "                  in sequence-numbered frames, see net_frame.h,\n"
+  "                  reconnecting whenever the connection is lost. Works\n"
+  "                  without a filename too.\n"
+  "  [--net-backlog SIZE]\n"
+  "                  Bytes to hold while the receiver is slow or away\n"
+  "                  (suffixes as above). Default is 256M.\n"
+  "  [--container]   Write each output file as a container of 1M blocks\n"
+  "                  with a header saying what was captured where and when,\n"
+  "                  the sample number, time, gap flags and CRC-32C of each\n"
+  "                  block and a block index for seeking (see\n"
+  "                  block_compress.h and pkz_reader.h). unpkz reads it.\n"
+  "  [--compress CODEC]\n"
+  "                  Like --container, with the blocks compressed:\n"
+  "                    lz4         - fast\n"
+  "                    zstd[:LEVEL] - smaller, LEVEL 1 to 19 (default 1)\n"
+  "  [--compress-threads N]\n"
+  "                  Threads compressing blocks. Default is 2.\n"
+  "  [--pretrigger SECONDS]\n"
+  "                  Write nothing until triggered, keeping the last SECONDS\n"
+  "                  of samples in memory. On a trigger, write them and the\n"
+  "                  samples up to --posttrigger SECONDS after the last\n"
+  "                  trigger to a file named after its first sample, e.g.\n"
+  "                  out-000163680000.dat, and log it in filename.events.\n"
+  "                  SIGUSR1 triggers.\n"
+  "  [--posttrigger SECONDS]\n"
+  "                  Seconds to record after a trigger. Default is 10.\n"
+  "  [--trigger-socket PATH]\n"
+  "                  Also trigger on a line \"trigger\" sent to Unix socket\n"
+  "                  PATH (\"status\" just gives the trigger count).\n"
+  "  [--trigger-power DB]\n"
+  "                  Also trigger when the mean I^2 + Q^2 over 16 ms\n"
+  "                  reaches DB, from 0 (no I magnitude bits set) to 7\n"
+  "                  (all set).\n"
+  "  [--drain-timeout SECONDS]\n"
+  "                  At the end of a capture (including ^C), wait up to\n"
+  "                  SECONDS for everything buffered to be written.\n"
+  "                  Default is 60. A second ^C stops waiting.\n"
+  "  [--timestamps[=N]]\n"
+  "                  Write a binary timestamp index filename.tidx next to each\n"
+  "                  output file, with the host clocks at USB completion every\n"
+  "                  N samples (suffixes as above, default 1M).\n"
+  "  [--usb-cpu N] [--writer-cpu N]\n"
+  "                  Pin the USB event thread / file writing thread to CPU N.\n"
+  "                  With --usb-threads, USB thread i goes on CPU N + i.\n"
+  "  [--usb-priority P] [--writer-priority P]\n"
+  "                  Real-time priority (1 to 99) of the USB event thread /\n"
+  "                  file writing thread. Its compression, I/O and rotation\n"
+  "                  helpers run unpinned at normal priority.\n"
+  "  [--sched POLICY] Real-time policy for both threads, fifo (default) or rr.\n"
+  "  [--mlock]       Lock all memory and pre-fault the capture buffers.\n"
+  "  [--metrics-file FILE]\n"
+  "                  Keep capture counters in FILE in Prometheus text format,\n"
+  "                  rewritten every second.\n"
+  "  [--metrics-socket PATH]\n"
+  "                  Answer each connection to Unix socket PATH with the\n"
+  "                  counters as JSON.\n"
+  "  [--metrics-shm NAME]\n"
+  "                  Keep the counters in POSIX shared memory object NAME\n"
+  "                  (e.g. /sample_grabber), see telemetry.h for the layout.\n"
+  "  [--packets -p N] USB packets per bulk transfer. Default is 8.\n"
+  "  [--transfers -t N]\n"
+  "                  USB bulk transfers kept in flight. Default is 256.\n"
+  "  [--latency -l MS]\n"
+  "                  FTDI latency timer in ms, 1 to 255. Default is 2.\n"
+  "  [--autotune -a SECONDS]\n"
+  "                  Try combinations of the three settings above for SECONDS\n"
+  "                  each (default 5), report rate, callback jitter and FIFO\n"
+  "                  errors, and pick the best. Capture then continues with\n"
+  "                  the best settings if a filename is given.\n"
   "  [filename]      A filename to save samples to. If none is\n"
-  "                  supplied then samples will not be saved.\n"
+  "                  supplied then samples will not be saved, unless\n"
+  "                  stdout is a pipe. - (or a pipe) streams the samples to\n"
+  "                  stdout with vmsplice, without copying them; messages\n"
+  "                  then go to stderr.\n"
   "Note : set_fifo_mode must be run before sample_grabber to configure the FT232H\n"
   "       on the device for FIFO mode. Run set_uart_mode after sample_grabber\n"
   "       to set the FT232H back to UART mode for normal operation.\n"
@@ -211,20 +620,152 @@ long long int parse_size(char * s)
   }
 }
 
-static int readCallback(uint8_t *buffer, int length, FTDIProgressInfo *progress, void *userdata)
+static void end_overflow_run(struct capture *cap)
 {
+  if (!cap->overflow_in_run)
+    return;
+  if (output_filename)
+    sample_buffer_add_gap(&cap->sample_buf, cap->overflow_run_start,
+                          cap->overflow_run_output, cap->overflow_run_len,
+                          GAP_FIFO);
+  cap->overflow.bytes += cap->overflow_run_len;
+  if (cap->overflow_run_len > cap->overflow.longest)
+    cap->overflow.longest = cap->overflow_run_len;
+  cap->overflow_in_run = 0;
+}
+
+/* Find the regions of buffer flagged by the FPGA FIFO error flag. base is
+ * the stream offset of buffer. If it was queued for file_writer, at
+ * output_base in its data, each region is recorded as a gap; if the sample
+ * buffer dropped it, the flagged bytes are only counted, as that gap covers
+ * them. Returns 1 if any byte was flagged.
+ */
+static int track_overflows(struct capture *cap, const uint8_t *buffer,
+                           size_t length, uint64_t base, uint64_t output_base,
+                           int queued)
+{
+  size_t i = 0;
+  int flagged = 0;
+
+  /* A run can't go on across data that never reached the output. */
+  if (!queued)
+    end_overflow_run(cap);
+  while (i < length) {
+    if (!cap->overflow_in_run) {
+      i += fifo_error_scan(buffer + i, length - i);
+      if (i == length)
+        break;
+      telemetry_add(&cap->tm->fifo_errors, 1);
+      if (verbose)
+        fprintf(stderr, "%sFPGA FIFO Error Flag at byte %llu, continuing\n",
+                cap->tag, (unsigned long long)(base + i));
+      if (queued) {
+        cap->overflow_in_run = 1;
+        cap->overflow_run_start = base + i;
+        cap->overflow_run_output = output_base + i;
+        cap->overflow_run_len = 0;
+        cap->overflow.events++;
+      }
+    }
+    size_t n = fifo_error_run_length(buffer + i, length - i);
+    if (queued)
+      cap->overflow_run_len += n;
+    else
+      cap->overflow.dropped_bytes += n;
+    flagged |= n != 0;
+    i += n;
+    if (i < length)
+      end_overflow_run(cap);
+  }
+  return flagged;
+}
+
+static int64_t timespec_ns(const struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Queue a timestamp record for the end of the data just pushed, if it
+ * crossed the next index interval. --container times its blocks from these
+ * too, every TS_INTERVAL samples without --timestamps.
+ */
+static void record_timestamp(struct capture *cap, const struct usb_buffer *b)
+{
+  uint64_t end = cap->sample_buf.output_bytes * SAMPLES_PER_BYTE;
+  uint64_t interval = ts_interval ? ts_interval : TS_INTERVAL;
+  struct ts_record rec;
+
+  if (end < cap->next_ts_sample)
+    return;
+  rec.sample = end;
+  rec.ns[TS_REALTIME] = timespec_ns(&b->realtime);
+  rec.ns[TS_MONOTONIC] = timespec_ns(&b->monotonic);
+  rec.ns[TS_TAI] = timespec_ns(&b->tai);
+  /* If file_writer is that far behind, the index just gets sparser. */
+  spsc_ring_write(&cap->ts_ring, &rec, sizeof(rec));
+  cap->next_ts_sample = (end / interval + 1) * interval;
+}
+
+/* Queue the sample buffer offsets at which the wall clock passed rotation
+ * boundaries, interpolated between the completion times of the last
+ * transfer and this one, then let file_writer write up to the new end.
+ */
+static void record_boundaries(struct capture *cap, const struct usb_buffer *b)
+{
+  uint64_t end = cap->sample_buf.output_bytes;
+  int64_t now = timespec_ns(&b->realtime);
+  int64_t interval = rotate_interval * 1000000000LL;
+  uint64_t group = pack_in;
+
+  if (!cap->next_boundary_ns)
+    cap->next_boundary_ns = (now / interval + 1) * interval;
+  while (now >= cap->next_boundary_ns) {
+    struct rotate_mark mark;
+    double f = (double)(cap->next_boundary_ns - cap->last_push_ns) /
+               (now - cap->last_push_ns);
+    mark.offset = cap->last_push_bytes +
+                  (uint64_t)(f * (end - cap->last_push_bytes));
+    mark.offset -= mark.offset % group;
+    mark.time = cap->next_boundary_ns / 1000000000LL;
+    spsc_ring_write(&cap->rotate_ring, &mark, sizeof(mark));
+    cap->next_boundary_ns += interval;
+  }
+  cap->last_push_ns = now;
+  cap->last_push_bytes = end;
+  __atomic_store_n(&cap->marked_bytes, end, __ATOMIC_RELEASE);
+}
+
+static int readCallback(struct usb_buffer *usb_buffer,
+                        struct usb_stream_progress *progress, void *userdata)
+{
+  struct capture *cap = userdata;
+  uint8_t *buffer = usb_buffer ? usb_buffer->data : NULL;
+  size_t length = usb_buffer ? usb_buffer->length : 0;
+  struct timespec completed, now;
+
+  if (exitRequested)
+    cap->done = 1;
+
   /*
    * Keep track of number of bytes read - don't record samples until we have
    * read a large number of bytes. We do this in order to flush out the FIFOs
    * in the FT232H and FPGA to ensure that the samples we receive are
    * continuous.
    */
-  static uint64_t total_num_bytes_received = 0;
+  if (usb_buffer)
+    completed = usb_buffer->monotonic;
 
-  /* Array for packing received samples into. */
   if (length){
-    if (total_num_bytes_received >= NUM_FLUSH_BYTES){
-      if (outputFile) {
+    telemetry_add(&cap->tm->bytes_received, length);
+    if (cap->total_num_bytes_received >= NUM_FLUSH_BYTES){
+      /* Pass on exactly the samples asked for, not the whole transfer. */
+      if (bytes_wanted != 0) {
+        uint64_t left = cap->total_unflushed_bytes < (uint64_t)bytes_wanted ?
+                        bytes_wanted - cap->total_unflushed_bytes : 0;
+        if (length > left)
+          length = left;
+      }
+      if (output_filename || shm_name || net_addr) {
         /*
          * Check each byte to see if a FIFO error occurred, and if not, write
          * samples to disk.
@@ -238,161 +779,1324 @@ static int readCallback(uint8_t *buffer, int length, FTDIProgressInfo *progress,
          * Note that sample_grabber doesn't know anything about the MAX2769's
          * output bit configuration - it just writes the received bits to disk.
          */
-        if (exitRequested != 1) {
+        uint64_t output_base = cap->sample_buf.output_bytes;
+        int queued = 1, flagged = 0;
+        if (!cap->done && !continue_on_overflow) {
           /* Check each byte to see if a FIFO error occured. */
-          for (uint64_t ci = 0; ci < length; ci++)
-            if (FPGA_FIFO_ERROR_CHECK(buffer[ci])) {
-              if (verbose)
-                fprintf(stderr,"FPGA FIFO Error Flag at sample number %lld\n",
-                       (long long int)(total_unflushed_bytes+ci));
-              exitRequested = 1;
-              break;
-            }
-          /* Push values into the pipe. */
-          pipe_push(pipe_writer,(void *)buffer,length);
+          size_t ci = fifo_error_scan(buffer, length);
+          if (ci < length) {
+            if (verbose)
+              fprintf(stderr,"%sFPGA FIFO Error Flag at sample number %lld\n",
+                      cap->tag,
+                      (long long int)(cap->total_unflushed_bytes+ci));
+            telemetry_add(&cap->tm->fifo_errors, 1);
+            cap->done = 1;
+          }
+        }
+        /* Readers of the ring see the stream as it arrives, whatever the
+         * disk is doing. */
+        if (!cap->done && cap->shm)
+          shm_ring_write(cap->shm, buffer, length);
+        if (!cap->done && output_filename) {
+          /* Copy samples into the buffer for file_writer. */
+          if (sample_buffer_push(&cap->sample_buf, buffer, length) != 0) {
+            fprintf(stderr, "%sSample buffer overflow at byte %lld\n",
+                    cap->tag, (long long int)cap->total_unflushed_bytes);
+            cap->done = 1;
+          } else {
+            /* The overflow policy may have dropped it instead. */
+            queued = cap->sample_buf.output_bytes - output_base == length;
+            telemetry_add(&cap->tm->bytes_buffered, length);
+            if (ts_interval || container)
+              record_timestamp(cap, usb_buffer);
+            if (rotate_align)
+              record_boundaries(cap, usb_buffer);
+          }
         }
+        /* Only now is it known where the data went in the output. */
+        if (!cap->done && continue_on_overflow)
+          flagged = track_overflows(cap, buffer, length,
+                                    cap->total_unflushed_bytes, output_base,
+                                    queued);
+        if (!cap->done && cap->net)
+          net_sink_push(cap->net, buffer, length, cap->total_unflushed_bytes,
+                        &usb_buffer->realtime, flagged ? NET_FRAME_FIFO : 0);
       }
-      total_unflushed_bytes += length;
+      cap->total_unflushed_bytes += length;
     }
-    total_num_bytes_received += length;
+    cap->total_num_bytes_received += length;
   }
-
   /* bytes_wanted = 0 means program was not run with a size argument. */
-  if (bytes_wanted != 0 && total_unflushed_bytes >= bytes_wanted){
-    exitRequested = 1;
+  if (bytes_wanted != 0 && cap->total_unflushed_bytes >= bytes_wanted){
+    cap->done = 1;
+  }
+
+  /* Progress is printed by the telemetry reporter, off this thread. */
+  if (usb_buffer) {
+    usb_stream_release(usb_buffer);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    telemetry_hist_add(&cap->tm->callback,
+                       timespec_ns(&now) - timespec_ns(&completed));
+  }
+
+  return cap->done ? 1 : 0;
+}
+
+/* Append any gaps reported by the producer to the gap sidecar. Its
+ * kept_offset is the gap's offset in the bytes that were kept, before
+ * packing and across rotated files, not a position in any one file.
+ */
+static void write_gaps(struct capture *cap)
+{
+  struct sample_gap gap;
+
+  while (sample_buffer_pop_gap(&cap->sample_buf, &gap)) {
+    /* Flag the container blocks the gap is in or, if dropped, before. */
+    if (container) {
+      uint64_t start = gap.output_offset * SAMPLES_PER_BYTE;
+      if (gap.reason == GAP_FIFO)
+        block_compress_mark(&cap->compress, start,
+                            start + gap.length * SAMPLES_PER_BYTE,
+                            PKZ_BLOCK_FIFO);
+      else
+        block_compress_mark(&cap->compress, start, start, PKZ_BLOCK_GAP);
+    }
+    if (!cap->gapFile && stdout_fd >= 0) {
+      cap->gapFile = stderr;
+      fprintf(cap->gapFile, "# stream_offset kept_offset length reason\n");
+    } else if (!cap->gapFile) {
+      char name[2222];
+      snprintf(name, sizeof(name), "%s.gaps", cap->output_filename);
+      if (!(cap->gapFile = fopen(name, "w"))) {
+        fprintf(stderr, "Can't open gap file %s, Error %s\n", name,
+                strerror(errno));
+        return;
+      }
+      fprintf(cap->gapFile, "# stream_offset kept_offset length reason\n");
+    }
+    fprintf(cap->gapFile, "%llu %llu %llu %s\n",
+            (unsigned long long)gap.stream_offset,
+            (unsigned long long)gap.output_offset,
+            (unsigned long long)gap.length, gap_reason_name(gap.reason));
+    fflush(cap->gapFile);
+  }
+}
+
+/* Start a timestamp index for a new output file whose first sample is
+ * base_sample in the stream.
+ */
+static void open_ts_index(struct capture *cap, const char *filename,
+                          uint64_t base_sample)
+{
+  char name[ROTATION_PATH_MAX + 8];
+
+  if (cap->tsFile)
+    fclose(cap->tsFile);
+  snprintf(name, sizeof(name), "%s.tidx", filename);
+  if (!(cap->tsFile = ts_index_create(name, base_sample)))
+    fprintf(stderr, "Can't open timestamp index %s, Error %s\n", name,
+            strerror(errno));
+}
+
+/* Rewrite the .durable record of the file being written, which starts at
+ * sample buffer offset file_start, once more of it is synced: how many
+ * bytes of it are on disk and the stream sample number they end at. The
+ * record is only written after the sync, so it never claims too much.
+ */
+static void record_durable(struct capture *cap, const char *filename,
+                           uint64_t file_start)
+{
+  uint64_t bytes = file_output_durable(&cap->out), sample;
+
+  if (bytes == cap->durable_recorded)
+    return;
+  if (!cap->durableFile) {
+    char name[ROTATION_PATH_MAX + 16];
+    snprintf(name, sizeof(name), "%s.durable", filename);
+    if (!(cap->durableFile = fopen(name, "w"))) {
+      fprintf(stderr, "Can't open %s, Error %s\n", name, strerror(errno));
+      cap->durable_recorded = bytes;
+      return;
+    }
   }
+  /* Containers hold whole blocks of samples, the rest is linear. */
+  sample = container ? block_compress_sample_at(&cap->compress, bytes) :
+           (file_start + bytes / pack_out * pack_in) * SAMPLES_PER_BYTE;
+  /* The record is fixed width and rewritten in place, within one sector.
+   * It is only worth having if it is on disk as well as the data. */
+  rewind(cap->durableFile);
+  fprintf(cap->durableFile, "%20llu %20llu\n", (unsigned long long)bytes,
+          (unsigned long long)sample);
+  if (fflush(cap->durableFile) != 0 ||
+      fdatasync(fileno(cap->durableFile)) < 0)
+    fprintf(stderr, "Can't sync %s.durable, Error %s\n", filename,
+            strerror(errno));
+  cap->durable_recorded = bytes;
+}
 
-  /* Print progress : time elapsed, bytes transferred, transfer rate. */
-  if (progress){
-    if (verbose)
-      printf("%10.02fs total time %9.3f MiB captured %7.1f kB/s curr %7.1f kB/s total\n",
-              progress->totalTime,
-              progress->current.totalBytes / (1024.0 * 1024.0),
-              progress->currentRate / 1024.0,
-              progress->totalRate / 1024.0);
+/* Append queued timestamp records for samples up to written (a stream sample
+ * number) to the index of the file that starts at file_base.
+ */
+static void write_timestamps(struct capture *cap, uint64_t file_base,
+                             uint64_t written)
+{
+  const uint8_t *p;
+  struct ts_record rec;
+
+  /* ts_ring only carries 32 byte ts_records, each read in one piece. */
+  while (spsc_ring_read_peek(&cap->ts_ring, &p) >= sizeof(rec)) {
+    memcpy(&rec, p, sizeof(rec));
+    if (rec.sample > written)
+      break;
+    spsc_ring_read_commit(&cap->ts_ring, sizeof(rec));
+    if (container)
+      block_compress_time(&cap->compress, rec.sample, rec.ns[TS_REALTIME]);
+    if (!cap->tsFile || rec.sample < file_base)
+      continue;
+    rec.sample -= file_base;
+    if (ts_index_append(cap->tsFile, &rec) < 0) {
+      fprintf(stderr, "%sTimestamp index write error\n", cap->tag);
+      fclose(cap->tsFile);
+      cap->tsFile = NULL;
+    }
   }
+}
+
+/* Take the next --rotate-align boundary queued by readCallback. */
+static int pop_rotate_mark(struct capture *cap, struct rotate_mark *mark)
+{
+  const uint8_t *p;
 
-  return exitRequested ? 1 : 0;
+  if (spsc_ring_read_peek(&cap->rotate_ring, &p) < sizeof(*mark))
+    return 0;
+  memcpy(mark, p, sizeof(*mark));
+  spsc_ring_read_commit(&cap->rotate_ring, sizeof(*mark));
+  return 1;
 }
 
-static void* file_writer(void* pc_ptr){
-  pipe_consumer_t* reader = pc_ptr;
-  uint8_t *pipebuf, *filebuf;
-  size_t pipe_chunk = pack_1bit ? write_chunk * 4 : write_chunk;
+/* Pack n bytes from the Piksi (a multiple of 4) into out and return the
+ * packed length: with --dense3 all three sample bits, in n / 4 * 3 bytes,
+ * otherwise (-1) only the sign bits, in n / 4 bytes.
+ */
+static size_t pack_samples(const uint8_t *p, size_t n, uint8_t *out)
+{
+  if (pack_dense3)
+    return dense3_pack(p, n, out);
+  for (size_t i = 0; i < n / 4; i++) {
+    uint8_t pack = 0;
+    for (int j = 0; j < 4; j++) {
+      pack <<= 2;  // Will end up with first sample in MSB of packed output
+      pack |= ((*p) & 0x80) >> 6;  // First sample sign in MSB of byte from piksi
+      pack |= ((*p) & 0x10) >> 4;  // Second sample sign in bit 4
+      p++;
+    }
+    out[i] = pack;
+  }
+  return n / 4;
+}
 
-  const char *filename_ext;
-  char filename[2222], timestr[22];
-  ssize_t basename_len = 0;
+/* For a writer with nothing to write: whether to exit, because it has been
+ * told to give up or the producer has closed and everything but a partial
+ * packing group has been written.
+ */
+static int writer_finished(struct capture *cap)
+{
+  return cap->abort_writer ||
+         (__atomic_load_n(&cap->producer_closed, __ATOMIC_ACQUIRE) &&
+          sample_buffer_pending(&cap->sample_buf) < pack_in);
+}
 
-  time_t t_prev = 0;
-  
-  pipebuf = filebuf = malloc(write_chunk);
-  if (pack_1bit)
-    pipebuf = malloc(pipe_chunk);
+/* Writer for filename -: stream to stdout_fd. Unless the data has to be
+ * packed or may come back from the spill file, buffer pages go into the
+ * pipe as they are, and are only given back to the sample buffer once the
+ * reader has taken them out.
+ */
+static void* stdout_writer(void* cap_ptr){
+  struct capture *cap = cap_ptr;
+  struct sample_buffer *sb = &cap->sample_buf;
+  size_t ring_chunk = write_chunk / pack_out * pack_in;
+  int zero_copy = pack_in == 1 && overflow_policy != OVERFLOW_SPILL;
+  struct pipe_output po;
+  uint8_t *filebuf = NULL;
+  /* Bytes in the pipe, not yet committed, and released so far. */
+  uint64_t in_pipe = 0, released = 0;
+  struct timespec write_start, write_end;
+  int err = 0;
+
+  if (rt_requested(&writer_rt))
+    rt_apply("Writer", &writer_rt);
 
-  if (!pipebuf || !filebuf) {
+  if (pack_in > 1 && !(filebuf = malloc(write_chunk))) {
     fprintf(stderr, "Unable to allocate file write buffers\n");
-    exitRequested = 1;
+    cap->done = 1;
     return NULL;
   }
+  if (pipe_output_open(&po, stdout_fd, PIPE_SIZE, zero_copy) < 0) {
+    perror("Can't stream to stdout");
+    free(filebuf);
+    cap->done = 1;
+    return NULL;
+  }
+  if (verbose)
+    printf("%sStreaming to stdout %s, %zu byte pipe\n", cap->tag,
+           po.mode == PIPE_VMSPLICE ? "with vmsplice" :
+           po.mode == PIPE_SPLICE ? "with splice" : "with write",
+           po.pipe_size);
 
-  if (rotate_interval) {
-    filename_ext = strrchr(output_filename, '.');
-    if (filename_ext) {
-      basename_len = filename_ext - output_filename;
-    } else {
-      basename_len = strlen(output_filename);
-      filename_ext = "";
-    }
-    if (sizeof(filename) - basename_len < 22)
-        basename_len = sizeof(filename) - 22; /* leave room for the date */
-    strncpy(filename, output_filename, basename_len);
-    filename[basename_len] = 0;
-    t_prev = time(NULL);
-    strftime(timestr, sizeof(timestr), "%Y%m%d-%H%M%S",
-             localtime(&t_prev));
-    sprintf(&filename[basename_len], "-%s%s", timestr, filename_ext);
-    if (verbose)
-      printf("Rotating files every %d seconds, starting with %s\n",
-             rotate_interval, filename);
+  while (!cap->abort_writer) {
+    const uint8_t *ringbuf, *outbuf;
+    ssize_t bytes_read, n = 0;
+    size_t bytes_to_write;
+    uint64_t r;
+
+    write_gaps(cap);
+    if (zero_copy) {
+      bytes_read = sample_buffer_peek_ahead(sb, in_pipe, &ringbuf);
+      if (bytes_read > ring_chunk)
+        bytes_read = ring_chunk;
+      if (bytes_read) {
+        clock_gettime(CLOCK_MONOTONIC, &write_start);
+        n = pipe_output_write(&po, ringbuf, bytes_read, PIPE_TIMEOUT_MS);
+        clock_gettime(CLOCK_MONOTONIC, &write_end);
+        telemetry_hist_add(&cap->tm->write, timespec_ns(&write_end) -
+                                            timespec_ns(&write_start));
+        if (n < 0) {
+          err = errno;
+          break;
+        }
+        in_pipe += n;
+      }
+      r = pipe_output_released(&po) - released;
+      if (r) {
+        sample_buffer_commit(sb, r);
+        telemetry_add(&cap->tm->bytes_written, r);
+        released += r;
+        in_pipe -= r;
+      } else if (!bytes_read) {
+        /* Done once the reader has taken everything out of the pipe. */
+        if (writer_finished(cap))
+          break;
+        usleep(WRITER_IDLE_US);
+      }
+      continue;
+    }
+
+    bytes_read = sample_buffer_peek(sb, &ringbuf);
+    if (bytes_read < 0) {
+      perror("Spill file read error");
+      cap->done = 1;
+      break;
+    }
+    if (bytes_read > ring_chunk)
+      bytes_read = ring_chunk;
+    if (pack_in > 1)
+      bytes_read &= ~(size_t)3;
+    if (bytes_read == 0) {
+      if (writer_finished(cap))
+        break;
+      usleep(WRITER_IDLE_US);
+      continue;
+    }
+    outbuf = ringbuf;
+    bytes_to_write = bytes_read;
+    if (pack_in > 1) {
+      bytes_to_write = pack_samples(ringbuf, bytes_read, filebuf);
+      outbuf = filebuf;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &write_start);
+    for (size_t done = 0;
+         done < bytes_to_write && n >= 0 && !cap->abort_writer; done += n)
+      n = pipe_output_write(&po, outbuf + done, bytes_to_write - done,
+                            PIPE_TIMEOUT_MS);
+    clock_gettime(CLOCK_MONOTONIC, &write_end);
+    telemetry_hist_add(&cap->tm->write,
+                       timespec_ns(&write_end) - timespec_ns(&write_start));
+    if (n < 0) {
+      err = errno;
+      break;
+    }
+    sample_buffer_commit(sb, bytes_read);
+    telemetry_add(&cap->tm->bytes_written, bytes_read);
+  }
+  if (err == EPIPE)
+    fprintf(stderr, "%sReader closed stdout, stopping\n", cap->tag);
+  else if (err)
+    fprintf(stderr, "Write error: %s\n", strerror(err));
+  cap->done = 1;
+
+  if (pipe_output_close(&po) < 0)
+    perror("Write error");
+  write_gaps(cap);
+  cap->gapFile = NULL;
+  free(filebuf);
+  return NULL;
+}
+
+/* Write to the current file, or stripes, behind --compress if on. */
+static int write_output(void *cap_ptr, const void *data, size_t len)
+{
+  struct capture *cap = cap_ptr;
+
+  return num_stripe_dirs ? stripe_output_write(&cap->stripes, data, len) :
+         file_output_write(&cap->out, data, len);
+}
+
+static void* file_writer(void* cap_ptr){
+  struct capture *cap = cap_ptr;
+  struct sample_buffer *sb = &cap->sample_buf;
+  uint8_t *filebuf = NULL;
+  size_t ring_chunk = write_chunk / pack_out * pack_in;
+
+  char filename[ROTATION_PATH_MAX];
+  struct file_rotation rotation;
+
+  /* With rotation by time, when the current file started and when the next
+   * is due. With sample-exact rotation, the sample buffer offset the next
+   * file starts at, if known yet, and its start. */
+  time_t t_prev = 0, t_next = 0;
+  uint64_t rotate_at = UINT64_MAX;
+  struct rotation_point rotate_start = { 0, 0 };
+  int next_requested = 0;
+  /* Bytes taken from the sample buffer in total, and at the start of the
+   * current file. */
+  uint64_t consumed = 0, file_start = 0;
+  /* Bytes written to the current file. */
+  uint64_t file_bytes = 0;
+
+  if (rt_requested(&writer_rt))
+    rt_apply("Writer", &writer_rt);
+
+  if ((pack_in > 1 && !(filebuf = malloc(write_chunk))) ||
+      (!num_stripe_dirs &&
+       file_output_init(&cap->out, output_backend, write_chunk,
+                        io_buffers) < 0)) {
+    fprintf(stderr, "Unable to allocate file write buffers\n");
+    free(filebuf);
+    cap->done = 1;
+    return NULL;
+  }
+  file_output_set_sync(&cap->out, io_sync);
+  file_output_set_durability(&cap->out, durable_size,
+                             durable_time * 1000000000LL);
+  if (container &&
+      block_compress_init(&cap->compress, compress_codec, compress_level,
+                          COMPRESS_BLOCK / pack_out * pack_out,
+                          compress_threads,
+                          pack_dense3 ? FORMAT_DENSE3 :
+                          pack_1bit ? FORMAT_1BIT : FORMAT_PIKSI,
+                          write_output, cap) < 0) {
+    file_output_destroy(&cap->out);
+    free(filebuf);
+    cap->done = 1;
+    return NULL;
+  }
+  if (container) {
+    char host[64] = "";
+    struct timespec now;
+    gethostname(host, sizeof(host) - 1);
+    clock_gettime(CLOCK_REALTIME, &now);
+    block_compress_describe(&cap->compress, host, cap->name, cap->id.pid,
+                            timespec_ns(&now));
+  }
+
+  if (rotate_interval || rotate_span) {
+    struct rotation_point start = { time(NULL), 0 };
+    if (file_rotation_init(&rotation, cap->output_filename, output_backend,
+                           ts_interval != 0, rotate_span != 0) < 0) {
+      fprintf(stderr, "Unable to start file rotation thread\n");
+      if (container)
+        block_compress_destroy(&cap->compress);
+      file_output_destroy(&cap->out);
+      free(filebuf);
+      cap->done = 1;
+      return NULL;
+    }
+    t_prev = start.time;
+    if (rotate_interval)
+      t_next = (t_prev / rotate_interval + 1) * rotate_interval;
+    if (rotate_span) {
+      rotate_at = rotate_span;
+      rotate_start.sample = rotate_at * SAMPLES_PER_BYTE;
+    }
+    file_rotation_name(&rotation, start, filename, sizeof(filename));
+    if (verbose && rotate_span)
+      printf("%sRotating files every %llu samples, starting with %s\n",
+             cap->tag, (unsigned long long)(rotate_span * SAMPLES_PER_BYTE),
+             filename);
+    else if (verbose)
+      printf("%sRotating files every %d seconds, starting with %s\n",
+             cap->tag, rotate_interval, filename);
   } else {
-    strncpy(filename, output_filename, sizeof(filename));
+    snprintf(filename, sizeof(filename), "%s", cap->output_filename);
   }
 
-  if ((outputFile = fopen(filename, "w")) == 0) {
+  if (num_stripe_dirs) {
+    if (stripe_output_open(&cap->stripes, filename, stripe_dirs,
+                           num_stripe_dirs, stripe_size, output_backend,
+                           write_chunk, io_buffers) < 0) {
+      if (container)
+        block_compress_destroy(&cap->compress);
+      free(filebuf);
+      cap->done = 1;
+      return NULL;
+    }
+  } else if (file_output_open(&cap->out, filename) < 0) {
       fprintf(stderr,"Can't open output file %s, Error %s\n", filename,
               strerror(errno));
-      exitRequested = 1;
+      if (rotate_interval || rotate_span)
+        file_rotation_destroy(&rotation);
+      if (container)
+        block_compress_destroy(&cap->compress);
+      file_output_destroy(&cap->out);
+      free(filebuf);
+      cap->done = 1;
       return NULL;
   }
-                                      
-  size_t bytes_read, bytes_to_write;
-  while (!exitRequested){
-    if (rotate_interval) {
+  if (ts_interval)
+    open_ts_index(cap, filename, 0);
+
+  const uint8_t *ringbuf, *outbuf;
+  struct timespec write_start, write_end;
+  ssize_t bytes_read;
+  size_t bytes_to_write;
+  while (!cap->abort_writer){
+    /* Boundaries up to here are queued, read before looking for them. */
+    uint64_t marked = rotate_align ?
+                      __atomic_load_n(&cap->marked_bytes, __ATOMIC_ACQUIRE) :
+                      UINT64_MAX;
+    if (rotate_interval || rotate_span) {
       time_t t = time(NULL);
-      if (t / rotate_interval != t_prev / rotate_interval) {
-        t_prev = t;
-        strftime(timestr, sizeof(timestr), "%Y%m%d-%H%M%S",
-             localtime(&t));
-        sprintf(&filename[basename_len], "-%s%s", timestr, filename_ext);
-        if (verbose)
-          printf("Rotating to new file %s\n", filename);
-        fclose(outputFile);
-        if ((outputFile = fopen(filename, "w")) == 0) {
+      struct rotate_mark mark;
+      int due;
+      if (rotate_align && rotate_at == UINT64_MAX &&
+          pop_rotate_mark(cap, &mark)) {
+        rotate_at = mark.offset;
+        rotate_start.time = mark.time;
+      }
+      due = rotate_interval && !rotate_align ? t >= t_next :
+            consumed >= rotate_at;
+      /* Have the next file made halfway to the switch: with rotation by
+       * time sized from the rate so far with some headroom. Its name and
+       * everything else that touches the filesystem is left to the
+       * rotation thread. */
+      if (!next_requested && rotate_span &&
+          consumed - file_start >= rotate_span / 2) {
+        file_rotation_request(&rotation, rotate_start,
+                              rotate_span / pack_in * pack_out);
+        next_requested = 1;
+      } else if (!next_requested && rotate_interval && t > t_prev &&
+                 t >= t_prev + (t_next - t_prev) / 2) {
+        struct rotation_point start = { t_next, 0 };
+        uint64_t rate = file_bytes / (t - t_prev);
+        file_rotation_request(&rotation, start,
+                              rate * rotate_interval / 8 * 9);
+        next_requested = 1;
+      }
+      if (due) {
+        struct output_file next, old;
+        FILE *next_tidx;
+        if (rotate_interval && !rotate_align)
+          rotate_start.time = t_next;
+        if (file_rotation_take(&rotation, rotate_start, &next, &next_tidx,
+                               filename, sizeof(filename)) < 0) {
           fprintf(stderr,"Can't open output file %s, Error %s\n", filename,
                   strerror(errno));
-          exitRequested = 1;
-          return NULL;
+          cap->done = 1;
+          break;
+        }
+        if (verbose)
+          printf("%sRotating to new file %s\n", cap->tag, filename);
+        telemetry_add(&cap->tm->rotations, 1);
+        /* Each file is a complete container. */
+        if (container && block_compress_finish(&cap->compress) < 0)
+          perror("Write error");
+        if (file_output_swap(&cap->out, &next, &old) < 0)
+          perror("Write error");
+        file_rotation_retire(&rotation, &old, cap->tsFile);
+        cap->tsFile = next_tidx;
+        /* The old file is fsynced whole as it is retired. */
+        if (cap->durableFile)
+          fclose(cap->durableFile);
+        cap->durableFile = NULL;
+        cap->durable_recorded = 0;
+        t_prev = t;
+        if (rotate_align)
+          t_next = rotate_start.time + rotate_interval;
+        else if (rotate_interval)
+          t_next = (t / rotate_interval + 1) * rotate_interval;
+        file_start = consumed;
+        file_bytes = 0;
+        next_requested = 0;
+        if (rotate_span) {
+          rotate_at += rotate_span;
+          rotate_start.sample = rotate_at * SAMPLES_PER_BYTE;
+        } else {
+          rotate_at = UINT64_MAX;
+        }
+        if (cap->tsFile &&
+            ts_index_start(cap->tsFile, file_start * SAMPLES_PER_BYTE) < 0) {
+          fprintf(stderr, "%sTimestamp index write error\n", cap->tag);
+          fclose(cap->tsFile);
+          cap->tsFile = NULL;
         }
       }
     }
-    bytes_read = pipe_pop(reader, pipebuf, pipe_chunk);
-    if (bytes_read > 0) {
-      if (pack_1bit) {
-	const uint8_t *p = pipebuf;
-        bytes_to_write = bytes_read / 4;
-	for (size_t i = 0; i < bytes_to_write; i++) {
-	  uint8_t pack = 0;
-	  for (int j = 0; j < 4; j++) {
-	    pack <<= 2;  // Will end up with first sample in MSB of packed output
-	    pack |= ((*p) & 0x80) >> 6;  // First sample sign in MSB of byte from piksi
-	    pack |= ((*p) & 0x10) >> 4;  // Second sample sign in bit 4
-	    p++;
-	  }
-	  filebuf[i] = pack;
-	}
-      } else {
-        bytes_to_write = bytes_read;
+    write_gaps(cap);
+    /* Write straight out of the buffer, one contiguous span at a time. */
+    bytes_read = sample_buffer_peek(sb, &ringbuf);
+    if (bytes_read < 0) {
+      perror("Spill file read error");
+      cap->done = 1;
+      break;
+    }
+    if (bytes_read > ring_chunk)
+      bytes_read = ring_chunk;
+    /* Split chunks exactly at the next file, and don't get ahead of the
+     * boundaries readCallback has worked out. */
+    if (bytes_read > rotate_at - consumed)
+      bytes_read = rotate_at - consumed;
+    if (bytes_read > marked - consumed)
+      bytes_read = marked - consumed;
+    if (pack_in > 1)
+      bytes_read &= ~(size_t)3;  /* Leave partial groups for the next pass. */
+    if (bytes_read == 0) {
+      if (writer_finished(cap))
+        break;
+      usleep(WRITER_IDLE_US);
+      continue;
+    }
+    outbuf = ringbuf;
+    if (pack_in > 1) {
+      bytes_to_write = pack_samples(ringbuf, bytes_read, filebuf);
+      outbuf = filebuf;
+    } else {
+      bytes_to_write = bytes_read;
+    }
+    /* Clock readings first, for the times of the blocks this completes. */
+    if (ts_interval || container)
+      write_timestamps(cap, file_start * SAMPLES_PER_BYTE,
+                       (consumed + bytes_read) * SAMPLES_PER_BYTE);
+    clock_gettime(CLOCK_MONOTONIC, &write_start);
+    if ((container ?
+         block_compress_write(&cap->compress, outbuf, bytes_to_write) :
+         write_output(cap, outbuf, bytes_to_write)) < 0){
+      perror("Write error");
+      cap->done = 1;
+      cap->abort_writer = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &write_end);
+    telemetry_hist_add(&cap->tm->write,
+                       timespec_ns(&write_end) - timespec_ns(&write_start));
+    sample_buffer_commit(sb, bytes_read);
+    telemetry_add(&cap->tm->bytes_written, bytes_read);
+    consumed += bytes_read;
+    file_bytes += bytes_to_write;
+    if (durable_size || durable_time)
+      record_durable(cap, filename, file_start);
+  }
+
+  if (container && block_compress_finish(&cap->compress) < 0)
+    perror("Write error");
+  if (num_stripe_dirs) {
+    stripe_output_close(&cap->stripes);
+  } else {
+    if (file_output_close(&cap->out) < 0)
+      perror("Write error");
+    if (durable_size || durable_time)
+      record_durable(cap, filename, file_start);
+    file_output_destroy(&cap->out);
+  }
+  if (cap->durableFile)
+    fclose(cap->durableFile);
+  cap->durableFile = NULL;
+  if (container)
+    block_compress_destroy(&cap->compress);
+  if (rotate_interval || rotate_span)
+    file_rotation_destroy(&rotation);
+  if (cap->tsFile)
+    fclose(cap->tsFile);
+  cap->tsFile = NULL;
+  write_gaps(cap);
+  if (cap->gapFile)
+    fclose(cap->gapFile);
+  cap->gapFile = NULL;
+  free(filebuf);
+  return NULL;
+}
+
+/* A --pretrigger recording: the file and what it holds, in sample buffer
+ * offsets. */
+struct trigger_event {
+  char filename[ROTATION_PATH_MAX];
+  uint64_t start, trigger, end;
+  enum trigger_reason reason;
+  int triggers;
+};
+
+/* Take buffered samples up to offset without writing them. */
+static void discard_until(struct capture *cap, uint64_t *consumed,
+                          uint64_t offset)
+{
+  const uint8_t *p;
+
+  while (*consumed < offset) {
+    ssize_t n = sample_buffer_peek(&cap->sample_buf, &p);
+    if (n <= 0)
+      break;
+    if ((uint64_t)n > offset - *consumed)
+      n = offset - *consumed;
+    sample_buffer_commit(&cap->sample_buf, n);
+    telemetry_add(&cap->tm->bytes_written, n);
+    *consumed += n;
+  }
+}
+
+/* Close an event's file, leaving the rotation helper to finish it, and log
+ * the event, ending at end. */
+static void end_event(struct capture *cap, struct file_rotation *naming,
+                      struct trigger_event *ev, uint64_t end)
+{
+  struct output_file old;
+
+  if (file_output_detach(&cap->out, &old) < 0)
+    perror("Write error");
+  file_rotation_retire(naming, &old, NULL);
+  if (verbose)
+    printf("%sWrote %s, %.1f s of samples\n", cap->tag, ev->filename,
+           (double)(end - ev->start) * SAMPLES_PER_BYTE / SAMPLE_RATE);
+  if (!cap->eventsFile) {
+    char name[2222];
+    snprintf(name, sizeof(name), "%s.events", cap->output_filename);
+    if (!(cap->eventsFile = fopen(name, "w"))) {
+      fprintf(stderr, "Can't open event log %s, Error %s\n", name,
+              strerror(errno));
+      return;
+    }
+    fprintf(cap->eventsFile, "# first_sample trigger_sample end_sample "
+            "reason triggers file\n");
+  }
+  fprintf(cap->eventsFile, "%llu %llu %llu %s %d %s\n",
+          (unsigned long long)(ev->start * SAMPLES_PER_BYTE),
+          (unsigned long long)(ev->trigger * SAMPLES_PER_BYTE),
+          (unsigned long long)(end * SAMPLES_PER_BYTE),
+          trigger_reason_name(ev->reason), ev->triggers, ev->filename);
+  fflush(cap->eventsFile);
+}
+
+/* Writer for --pretrigger. Until a trigger, it only keeps the sample buffer
+ * down to the last pretrigger_bytes, so they are there to write when one
+ * comes. It then writes them and everything up to posttrigger_bytes after
+ * the last trigger to a file of the event's own, and goes back to waiting.
+ * Power is measured as data arrives, ahead of the writing.
+ */
+static void* trigger_writer(void* cap_ptr){
+  struct capture *cap = cap_ptr;
+  struct sample_buffer *sb = &cap->sample_buf;
+  size_t ring_chunk = write_chunk / pack_out * pack_in;
+  struct file_rotation naming;
+  struct power_detector power;
+  struct trigger_event ev;
+  uint8_t *filebuf = NULL;
+  /* Bytes taken from the sample buffer, and measured for power. */
+  uint64_t consumed = 0, scanned = 0;
+  uint64_t seen = trigger_count(&triggers, NULL);
+  int recording = 0;
+
+  if (rt_requested(&writer_rt))
+    rt_apply("Writer", &writer_rt);
+
+  if ((pack_in > 1 && !(filebuf = malloc(write_chunk))) ||
+      file_output_init(&cap->out, output_backend, write_chunk,
+                       io_buffers) < 0) {
+    fprintf(stderr, "Unable to allocate file write buffers\n");
+    free(filebuf);
+    cap->done = 1;
+    return NULL;
+  }
+  file_output_set_sync(&cap->out, io_sync);
+  /* Events are named by sample number and made and finished off this
+   * thread, like rotated files. */
+  if (file_rotation_init(&naming, cap->output_filename, output_backend, 0,
+                         1) < 0) {
+    fprintf(stderr, "Unable to start file rotation thread\n");
+    file_output_destroy(&cap->out);
+    free(filebuf);
+    cap->done = 1;
+    return NULL;
+  }
+  if (trigger_power)
+    power_detector_init(&power, trigger_power_db, TRIGGER_POWER_WINDOW);
+  if (verbose)
+    printf("%sWaiting for triggers, keeping %.1f s of samples\n", cap->tag,
+           (double)pretrigger_bytes * SAMPLES_PER_BYTE / SAMPLE_RATE);
+
+  while (!cap->abort_writer) {
+    uint64_t head = consumed + sample_buffer_pending(sb), at = 0, count;
+    enum trigger_reason reason;
+    const uint8_t *ringbuf, *outbuf;
+    ssize_t bytes_read;
+    size_t bytes_to_write;
+    int fired = 0;
+
+    write_gaps(cap);
+    /* Data discarded unmeasured, after a trigger stopped the scan. */
+    if (scanned < consumed)
+      scanned = consumed;
+    while (trigger_power && scanned < head && !fired) {
+      const uint8_t *p;
+      size_t n = sample_buffer_peek_ahead(sb, scanned - consumed, &p);
+      ssize_t hit;
+      if (!n)
+        break;
+      if ((hit = power_detector_feed(&power, p, n)) >= 0) {
+        n = hit;
+        at = scanned + hit;
+        reason = TRIGGER_POWER;
+        fired = 1;
+      }
+      scanned += n;
+    }
+    /* Signals and the socket trigger at the newest data. */
+    if ((count = trigger_count(&triggers, &reason)) != seen) {
+      seen = count;
+      at = head;
+      fired = 1;
+    }
+
+    if (fired) {
+      if (!recording) {
+        struct output_file f;
+        struct rotation_point start = { time(NULL), 0 };
+        ev.start = at > pretrigger_bytes ? at - pretrigger_bytes : 0;
+        if (ev.start < consumed)
+          ev.start = consumed;
+        ev.start -= ev.start % pack_in;
+        discard_until(cap, &consumed, ev.start);
+        start.sample = ev.start * SAMPLES_PER_BYTE;
+        if (file_rotation_take(&naming, start, &f, NULL, ev.filename,
+                               sizeof(ev.filename)) < 0) {
+          fprintf(stderr,"Can't open output file %s, Error %s\n",
+                  ev.filename, strerror(errno));
+          cap->done = 1;
+          break;
+        }
+        file_output_attach(&cap->out, &f);
+        ev.trigger = at;
+        ev.reason = reason;
+        ev.triggers = 0;
+        recording = 1;
+        printf("%sTriggered by %s at sample %llu, writing %s\n", cap->tag,
+               trigger_reason_name(reason),
+               (unsigned long long)(at * SAMPLES_PER_BYTE), ev.filename);
       }
-      if (fwrite(filebuf, bytes_to_write, 1, outputFile) != 1){
-        perror("Write error\n");
-        exitRequested = 1;
+      /* Triggers while recording keep it going. */
+      ev.triggers++;
+      ev.end = at + posttrigger_bytes;
+      ev.end += (pack_in - ev.end % pack_in) % pack_in;
+    }
+
+    if (!recording) {
+      if (head - consumed > pretrigger_bytes)
+        discard_until(cap, &consumed,
+                      (head - pretrigger_bytes) / pack_in * pack_in);
+      /* What is still held was never triggered on. */
+      if (__atomic_load_n(&cap->producer_closed, __ATOMIC_ACQUIRE))
+        break;
+      usleep(WRITER_IDLE_US);
+      continue;
+    }
+
+    bytes_read = sample_buffer_peek(sb, &ringbuf);
+    if (bytes_read < 0) {
+      perror("Sample buffer read error");
+      cap->done = 1;
+      break;
+    }
+    if (bytes_read > ring_chunk)
+      bytes_read = ring_chunk;
+    if (bytes_read > ev.end - consumed)
+      bytes_read = ev.end - consumed;
+    if (pack_in > 1)
+      bytes_read &= ~(size_t)3;
+    if (bytes_read == 0) {
+      if (consumed >= ev.end) {
+        end_event(cap, &naming, &ev, consumed);
+        recording = 0;
+      } else if (writer_finished(cap)) {
+        break;
+      } else {
+        usleep(WRITER_IDLE_US);
       }
+      continue;
     }
+    outbuf = ringbuf;
+    bytes_to_write = bytes_read;
+    if (pack_in > 1) {
+      bytes_to_write = pack_samples(ringbuf, bytes_read, filebuf);
+      outbuf = filebuf;
+    }
+    struct timespec write_start, write_end;
+    clock_gettime(CLOCK_MONOTONIC, &write_start);
+    if (file_output_write(&cap->out, outbuf, bytes_to_write) < 0) {
+      perror("Write error");
+      cap->done = 1;
+      cap->abort_writer = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &write_end);
+    telemetry_hist_add(&cap->tm->write,
+                       timespec_ns(&write_end) - timespec_ns(&write_start));
+    sample_buffer_commit(sb, bytes_read);
+    telemetry_add(&cap->tm->bytes_written, bytes_read);
+    consumed += bytes_read;
   }
+
+  /* The capture ended mid-event: keep what there is. */
+  if (recording)
+    end_event(cap, &naming, &ev, consumed);
+  file_rotation_destroy(&naming);
+  file_output_destroy(&cap->out);
+  write_gaps(cap);
+  if (cap->gapFile)
+    fclose(cap->gapFile);
+  cap->gapFile = NULL;
+  if (cap->eventsFile)
+    fclose(cap->eventsFile);
+  cap->eventsFile = NULL;
+  free(filebuf);
+  return NULL;
+}
+
+static void print_overflow_stats(struct capture *cap, double seconds)
+{
+  const struct overflow_stats *overflow = &cap->overflow;
+
+  if (!overflow->events && !overflow->dropped_bytes && !verbose)
+    return;
+  fprintf(stderr, "%sFPGA FIFO overflows: %llu (%.2f per hour), %llu bytes "
+          "flagged, longest %llu bytes\n", cap->tag,
+          (unsigned long long)overflow->events,
+          seconds > 0 ? overflow->events * 3600.0 / seconds : 0.0,
+          (unsigned long long)overflow->bytes,
+          (unsigned long long)overflow->longest);
+  if (overflow->dropped_bytes)
+    fprintf(stderr, "%s%llu more flagged bytes in data dropped from the "
+            "sample buffer\n", cap->tag,
+            (unsigned long long)overflow->dropped_bytes);
+}
+
+static void print_buffer_stats(struct capture *cap)
+{
+  const struct sample_buffer_stats *st = &cap->sample_buf.stats;
+  const char *tag = cap->tag;
+  int trouble = st->bytes_dropped || st->stalls || st->bytes_spilled ||
+                st->gaps_lost;
+
+  if (!verbose && !trouble)
+    return;
+  fprintf(stderr, "%sBuffer high water mark %.1f MiB\n", tag,
+          st->high_water / (1024.0 * 1024.0));
+  if (st->bytes_dropped)
+    fprintf(stderr, "%sDropped %llu bytes in %llu gaps\n", tag,
+            (unsigned long long)st->bytes_dropped,
+            (unsigned long long)st->drop_events);
+  if (st->stalls)
+    fprintf(stderr, "%sStalled %llu times, %.3f s total, %.3f s longest\n",
+            tag, (unsigned long long)st->stalls, st->stall_total,
+            st->stall_max);
+  if (st->bytes_spilled)
+    fprintf(stderr, "%sSpilled %llu bytes in %llu episodes, %.1f MiB at most\n",
+            tag, (unsigned long long)st->bytes_spilled,
+            (unsigned long long)st->spill_events,
+            st->spill_high_water / (1024.0 * 1024.0));
+  if (st->gaps_lost)
+    fprintf(stderr, "%s%llu gap records were lost\n", tag,
+            (unsigned long long)st->gaps_lost);
+}
+
+static void print_net_stats(struct capture *cap)
+{
+  struct net_sink_stats *st = &cap->net->stats;
+
+  if (!verbose && !st->bytes_dropped)
+    return;
+  printf("%sNetwork: %llu frames, %llu bytes sent, %llu connections, "
+         "%llu zerocopy sends\n", cap->tag, (unsigned long long)st->frames,
+         (unsigned long long)st->bytes_sent,
+         (unsigned long long)st->connects,
+         (unsigned long long)st->zerocopy_sends);
+  if (st->bytes_dropped)
+    printf("%sNetwork backlog overflowed %llu times, %llu bytes dropped\n",
+           cap->tag, (unsigned long long)st->drop_events,
+           (unsigned long long)st->bytes_dropped);
+}
+
+static void print_compress_stats(struct capture *cap)
+{
+  struct block_compress *c = &cap->compress;
+
+  if (!verbose || !c->raw_bytes)
+    return;
+  printf("%sCompressed %llu bytes to %llu (%.1f%%)\n", cap->tag,
+         (unsigned long long)c->raw_bytes, (unsigned long long)c->comp_bytes,
+         100.0 * c->comp_bytes / c->raw_bytes);
+}
+
+static void print_capture_stats(struct capture *cap, double seconds)
+{
+  double mib = cap->total_unflushed_bytes / (1024.0 * 1024.0);
+
+  fprintf(stderr, "%sCaptured %.1f MiB, %.1f MiB/s\n", cap->tag, mib,
+          seconds > 0 ? mib / seconds : 0.0);
+}
+
+static struct usb_group groups[MAX_DEVICES];
+static int num_groups = 0;
+
+/* Put suffix in front of the extension of name, like file rotation does.
+ * Returns a malloc'd string.
+ */
+static char *add_suffix(const char *name, const char *suffix)
+{
+  const char *ext = strrchr(name, '.');
+  size_t base_len, len = strlen(name) + strlen(suffix) + 1;
+  char *out;
+
+  if (!ext || strchr(ext, '/'))
+    ext = name + strlen(name);
+  base_len = ext - name;
+  if (!(out = malloc(len)))
+    return NULL;
+  memcpy(out, name, base_len);
+  sprintf(out + base_len, "%s%s", suffix, ext);
+  return out;
+}
+
+/* Give each capture its message tag and output file name. With several
+ * devices these include the PID, and also the bus address if another device
+ * shares that PID.
+ */
+static int name_captures(void)
+{
+  for (int i = 0; i < num_captures; i++) {
+    struct capture *cap = &captures[i];
+    char suffix[24];
+    int shared = 0;
+
+    for (int j = 0; j < num_captures; j++)
+      if (j != i && captures[j].id.pid == cap->id.pid)
+        shared = 1;
+    if (shared)
+      snprintf(suffix, sizeof(suffix), "-%04x-%d.%d", cap->id.pid,
+               cap->id.bus, cap->id.address);
+    else
+      snprintf(suffix, sizeof(suffix), "-%04x", cap->id.pid);
+
+    snprintf(cap->name, sizeof(cap->name), "%s", suffix + 1);
+    if (num_captures > 1)
+      snprintf(cap->tag, sizeof(cap->tag), "[%s] ", cap->name);
+    if (shm_name && !(cap->shm_name = num_captures > 1 ?
+                      add_suffix(shm_name, suffix) : strdup(shm_name)))
+      return -1;
+    if (!output_filename)
+      continue;
+    if (num_captures > 1)
+      cap->output_filename = add_suffix(output_filename, suffix);
+    else
+      cap->output_filename = strdup(output_filename);
+    if (!cap->output_filename)
+      return -1;
+  }
+  return 0;
+}
+
+/* Find the devices asked for and open them, handing them out in turn to
+ * num_groups USB event threads, each with its own libusb context.
+ */
+static int open_devices(void)
+{
+  struct usb_device_id ids[MAX_DEVICES];
+  int n, err;
+
+  if ((err = libusb_init(&groups[0].ctx)) < 0) {
+    fprintf(stderr, "Can't initialise libusb: %s\n", libusb_error_name(err));
+    return -1;
+  }
+  num_groups = 1;
+
+  n = usb_find_devices(groups[0].ctx, USB_CUSTOM_VID, pids, num_pids,
+                       all_devices, ids, MAX_DEVICES);
+  if (n < 0) {
+    fprintf(stderr, "Can't list USB devices: %s\n", libusb_error_name(n));
+    return -1;
+  }
+  for (int p = 0; p < num_pids; p++) {
+    int found = 0;
+    for (int i = 0; i < n; i++)
+      if (ids[i].pid == pids[p])
+        found = 1;
+    if (!found) {
+      fprintf(stderr, "Can't open ftdi device: no device with product ID "
+              "0x%04x\n", pids[p]);
+      return -1;
+    }
+  }
+
+  for (; num_groups < usb_threads && num_groups < n; num_groups++) {
+    if ((err = libusb_init(&groups[num_groups].ctx)) < 0) {
+      fprintf(stderr, "Can't initialise libusb: %s\n", libusb_error_name(err));
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    struct capture *cap = &captures[i];
+    struct usb_group *grp = &groups[i % num_groups];
+
+    cap->id = ids[i];
+    if (!(cap->ftdi = usb_open_ftdi(grp->ctx, USB_CUSTOM_VID, &ids[i])))
+      return -1;
+    num_captures++;
+    grp->userdata[grp->num_streams++] = cap;
+
+    if(ftdi_set_latency_timer(cap->ftdi, latency_timer)){
+      fprintf(stderr,"Can't set latency, Error %s\n",
+              ftdi_get_error_string(cap->ftdi));
+      return -1;
+    }
+    if (ftdi_usb_purge_rx_buffer(cap->ftdi) < 0){
+      fprintf(stderr,"Can't rx purge %s\n",ftdi_get_error_string(cap->ftdi));
+      return -1;
+    }
+  }
+
+  return name_captures();
+}
+
+/* Put every device back out of FIFO mode and close it. */
+static int close_devices(void)
+{
+  int ret = 0;
+
+  for (int i = 0; i < num_captures; i++) {
+    struct capture *cap = &captures[i];
+    if (ftdi_set_bitmode(cap->ftdi, 0xff, BITMODE_RESET) < 0){
+      fprintf(stderr,"%sCan't set synchronous fifo mode, Error %s\n",
+              cap->tag, ftdi_get_error_string(cap->ftdi));
+      ret = -1;
+    }
+    usb_close_ftdi(cap->ftdi);
+    free(cap->output_filename);
+    free(cap->shm_name);
+  }
+  num_captures = 0;
+  for (int g = 0; g < num_groups; g++)
+    libusb_exit(groups[g].ctx);
+  num_groups = 0;
+  return ret;
+}
+
+static void *writer_thread(void *cap_ptr)
+{
+  struct capture *cap = cap_ptr;
+
+  if (stdout_fd >= 0)
+    stdout_writer(cap);
+  else if (pretrigger_bytes)
+    trigger_writer(cap);
+  else
+    file_writer(cap);
+  __atomic_store_n(&cap->writer_exited, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static int start_writer(struct capture *cap)
+{
+  if (sample_buffer_init(&cap->sample_buf, ring_size, pack_in,
+                         overflow_policy, spill_dir,
+                         write_chunk / pack_out * pack_in,
+                         &cap->done) < 0) {
+    fprintf(stderr, "Unable to allocate %zu byte sample buffer\n", ring_size);
+    return -1;
+  }
+  if (lock_memory)
+    rt_prefault(cap->sample_buf.ring.buf, cap->sample_buf.ring.size);
+  if ((ts_interval || container) &&
+      spsc_ring_init(&cap->ts_ring, TS_QUEUE_SIZE) < 0) {
+    fprintf(stderr, "Unable to allocate timestamp queue\n");
+    goto fail;
+  }
+  if (rotate_align &&
+      spsc_ring_init(&cap->rotate_ring, ROTATE_QUEUE_SIZE) < 0) {
+    fprintf(stderr, "Unable to allocate rotation queue\n");
+    goto fail;
+  }
+  if (pthread_create(&cap->file_writing_thread, NULL, &writer_thread,
+                     cap) != 0) {
+    fprintf(stderr, "Unable to start file writing thread\n");
+    goto fail;
+  }
+  cap->writer_started = 1;
+  return 0;
+
+fail:
+  spsc_ring_destroy(&cap->ts_ring);
+  spsc_ring_destroy(&cap->rotate_ring);
+  sample_buffer_destroy(&cap->sample_buf);
+  return -1;
+}
+
+/* After a start-up failure, undo what the first n captures were given:
+ * stop their writers before they write anything, remove their shared
+ * memory rings and drop their network streams. Then stop the trigger
+ * socket and telemetry and close the devices.
+ */
+static void abandon_captures(int n)
+{
+  for (int i = 0; i < n; i++) {
+    struct capture *cap = &captures[i];
+
+    if (cap->writer_started) {
+      cap->abort_writer = 1;
+      __atomic_store_n(&cap->producer_closed, 1, __ATOMIC_RELEASE);
+      pthread_join(cap->file_writing_thread, NULL);
+      cap->writer_started = 0;
+      spsc_ring_destroy(&cap->ts_ring);
+      spsc_ring_destroy(&cap->rotate_ring);
+      sample_buffer_destroy(&cap->sample_buf);
+    }
+    if (cap->shm) {
+      shm_ring_close(cap->shm, cap->shm_name);
+      cap->shm = NULL;
+    }
+    if (cap->net) {
+      net_sink_stop(cap->net, 0, 0);
+      free(cap->net);
+      cap->net = NULL;
+    }
+    usb_stream_free(cap->stream);
+    cap->stream = NULL;
+  }
+  trigger_socket_stop(&triggers);
+  telemetry_destroy(telemetry, metrics_shm);
+  telemetry = NULL;
+  close_devices();
+}
+
+/* Wait for the writer to drain the sample buffer after the producer has
+ * closed, until drain_timeout seconds after start or ^C is hit again, then
+ * make it give up on the rest. start is shared by all captures, as their
+ * writers drain at the same time. Reports how much was drained.
+ */
+static void drain_writer(struct capture *cap, const struct timespec *start)
+{
+  struct timespec now;
+  uint64_t left;
+  double secs;
+  int aborted = 0;
+
+  while (!__atomic_load_n(&cap->writer_exited, __ATOMIC_ACQUIRE)) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!aborted && (now.tv_sec - start->tv_sec >= drain_timeout ||
+                     exitRequested > 1)) {
+      /* It still finishes the write in progress and closes the file. */
+      cap->abort_writer = 1;
+      aborted = 1;
+    }
+    usleep(DRAIN_POLL_US);
+  }
+  pthread_join(cap->file_writing_thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = (timespec_ns(&now) - timespec_ns(start)) / 1e9;
+  left = sample_buffer_pending(&cap->sample_buf);
+  if (aborted)
+    fprintf(stderr, "%sGave up draining the buffer after %.1f s, %llu bytes "
+            "were not written\n", cap->tag, secs, (unsigned long long)left);
+  else if (verbose || cap->drain_pending)
+    printf("%sDrained %llu buffered bytes in %.1f s\n", cap->tag,
+           (unsigned long long)(cap->drain_pending - left), secs);
+}
+
+static void *usb_thread(void *arg)
+{
+  struct usb_group *grp = arg;
+  struct rt_config rt = usb_rt;
+  int g = grp - groups;
+  char name[16] = "USB";
+
+  /* Threads take CPUs from --usb-cpu on, one each. */
+  if (rt.cpu >= 0)
+    rt.cpu += g;
+  if (num_groups > 1)
+    snprintf(name, sizeof(name), "USB %d", g);
+  if (rt_requested(&rt))
+    rt_apply(name, &rt);
+  grp->result = usb_stream_run_group(grp->streams, grp->num_streams,
+                                     readCallback, grp->userdata, grp->start);
   return NULL;
 }
 
 int main(int argc, char **argv){
-  struct ftdi_context *ftdi;
-  int err;
-  char *descstring = NULL;
+  pthread_barrier_t start_barrier;
+  int err = 0;
 
   static const struct option long_opts[] = {
     {"verbose",  no_argument,        NULL, 'v'},
     {"size",     required_argument,  NULL, 's'},
     {"id",       required_argument,  NULL, 'i'},
+    {"all",      no_argument,        NULL, OPT_ALL_DEVICES},
+    {"usb-threads", required_argument, NULL, OPT_USB_THREADS},
     {"help",     no_argument,        NULL, 'h'},
     {"onebit",   no_argument,        NULL, '1'},
+    {"dense3",   no_argument,        NULL, OPT_DENSE3},
     {"rotate",   optional_argument,  NULL, 'r'},
     {"chunk",    required_argument,  NULL, 'c'},
+    {"buffer",   required_argument,  NULL, 'b'},
+    {"overflow", required_argument,  NULL, 'o'},
+    {"continue", no_argument,        NULL, 'k'},
+    {"spill-dir", required_argument, NULL, OPT_SPILL_DIR},
+    {"usb-cpu",  required_argument,  NULL, OPT_USB_CPU},
+    {"writer-cpu", required_argument, NULL, OPT_WRITER_CPU},
+    {"usb-priority", required_argument, NULL, OPT_USB_PRIORITY},
+    {"writer-priority", required_argument, NULL, OPT_WRITER_PRIORITY},
+    {"sched",    required_argument,  NULL, OPT_SCHED},
+    {"mlock",    no_argument,        NULL, OPT_MLOCK},
+    {"timestamps", optional_argument, NULL, OPT_TIMESTAMPS},
+    {"packets",  required_argument,  NULL, 'p'},
+    {"transfers", required_argument, NULL, 't'},
+    {"latency",  required_argument,  NULL, 'l'},
+    {"autotune", optional_argument,  NULL, 'a'},
+    {"metrics-file", required_argument, NULL, OPT_METRICS_FILE},
+    {"metrics-socket", required_argument, NULL, OPT_METRICS_SOCKET},
+    {"metrics-shm", required_argument, NULL, OPT_METRICS_SHM},
+    {"io",       required_argument,  NULL, OPT_IO},
+    {"io-buffers", required_argument, NULL, OPT_IO_BUFFERS},
+    {"io-sync",  required_argument,  NULL, OPT_IO_SYNC},
+    {"durable-size", required_argument, NULL, OPT_DURABLE_SIZE},
+    {"durable-time", required_argument, NULL, OPT_DURABLE_TIME},
+    {"rotate-samples", required_argument, NULL, OPT_ROTATE_SAMPLES},
+    {"rotate-size", required_argument, NULL, OPT_ROTATE_SIZE},
+    {"rotate-align", no_argument,    NULL, OPT_ROTATE_ALIGN},
+    {"stripe",   required_argument,  NULL, OPT_STRIPE},
+    {"stripe-size", required_argument, NULL, OPT_STRIPE_SIZE},
+    {"shm",      required_argument,  NULL, OPT_SHM},
+    {"shm-size", required_argument,  NULL, OPT_SHM_SIZE},
+    {"net",      required_argument,  NULL, OPT_NET},
+    {"net-backlog", required_argument, NULL, OPT_NET_BACKLOG},
+    {"container", no_argument,       NULL, OPT_CONTAINER},
+    {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+    {"pretrigger", required_argument, NULL, OPT_PRETRIGGER},
+    {"posttrigger", required_argument, NULL, OPT_POSTTRIGGER},
+    {"trigger-socket", required_argument, NULL, OPT_TRIGGER_SOCKET},
+    {"trigger-power", required_argument, NULL, OPT_TRIGGER_POWER},
+    {"compress", required_argument,  NULL, OPT_COMPRESS},
+    {"compress-threads", required_argument, NULL, OPT_COMPRESS_THREADS},
     {NULL,       no_argument,        NULL, 0}
   };
 
   opterr = 0;
   int c;
   int option_index = 0;
-  while ((c = getopt_long(argc, argv, "vs:i:h1r::c:", long_opts, &option_index)) != -1)
+  while ((c = getopt_long(argc, argv, "vs:i:h1r::c:b:o:kp:t:l:a::", long_opts, &option_index)) != -1)
     switch (c) {
       case 'v':
         verbose++;
@@ -417,23 +2121,300 @@ int main(int argc, char **argv){
           return EXIT_FAILURE;
         }
         break;
+      case 'b': {
+        long long int size = parse_size(optarg);
+        if (size <= 0) {
+          fprintf(stderr, "Invalid buffer size argument.\n");
+          return EXIT_FAILURE;
+        }
+        ring_size = size;
+        break;
+      }
+      case 'o':
+        if (parse_overflow_policy(optarg, &overflow_policy) < 0) {
+          fprintf(stderr, "Invalid overflow policy argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'k':
+        continue_on_overflow = 1;
+        break;
+      case OPT_SPILL_DIR:
+        spill_dir = optarg;
+        break;
+      case OPT_USB_CPU:
+      case OPT_WRITER_CPU: {
+        int cpu = atoi(optarg);
+        if (cpu < 0 || cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+          fprintf(stderr, "Invalid CPU argument.\n");
+          return EXIT_FAILURE;
+        }
+        if (c == OPT_USB_CPU)
+          usb_rt.cpu = cpu;
+        else
+          writer_rt.cpu = cpu;
+        break;
+      }
+      case OPT_USB_PRIORITY:
+      case OPT_WRITER_PRIORITY: {
+        int prio = atoi(optarg);
+        if (prio < 1 || prio > 99) {
+          fprintf(stderr, "Invalid priority argument.\n");
+          return EXIT_FAILURE;
+        }
+        if (c == OPT_USB_PRIORITY)
+          usb_rt.priority = prio;
+        else
+          writer_rt.priority = prio;
+        break;
+      }
+      case OPT_SCHED: {
+        int policy;
+        if (rt_parse_policy(optarg, &policy) < 0) {
+          fprintf(stderr, "Invalid scheduling policy argument.\n");
+          return EXIT_FAILURE;
+        }
+        usb_rt.policy = writer_rt.policy = policy;
+        break;
+      }
+      case OPT_MLOCK:
+        lock_memory = 1;
+        break;
+      case OPT_TIMESTAMPS:
+        ts_interval = optarg ? parse_size(optarg) : TS_INTERVAL;
+        if (ts_interval <= 0) {
+          fprintf(stderr, "Invalid timestamp interval argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'p':
+        packets_per_transfer = atoi(optarg);
+        if (packets_per_transfer <= 0 || packets_per_transfer > 1024) {
+          fprintf(stderr, "Invalid packets per transfer argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 't':
+        num_transfers = atoi(optarg);
+        if (num_transfers <= 0 || num_transfers > 4096) {
+          fprintf(stderr, "Invalid number of transfers argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'l':
+        latency_timer = atoi(optarg);
+        if (latency_timer <= 0 || latency_timer > 255) {
+          fprintf(stderr, "Invalid latency timer argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'a':
+        autotune_seconds = optarg ? atoi(optarg) : AUTOTUNE_SECONDS;
+        if (autotune_seconds <= 0) {
+          fprintf(stderr, "Invalid autotune duration argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
       case 'r':
         rotate_interval = optarg ? atoi(optarg) : 3600;
         break;
+      case OPT_ROTATE_SAMPLES:
+        rotate_samples = parse_size(optarg);
+        if (rotate_samples <= 0) {
+          fprintf(stderr, "Invalid rotation sample count argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_ROTATE_SIZE:
+        rotate_size = parse_size(optarg);
+        if (rotate_size <= 0) {
+          fprintf(stderr, "Invalid rotation size argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_ROTATE_ALIGN:
+        rotate_align = 1;
+        break;
+      case OPT_STRIPE: {
+        char *arg = strtok(optarg, ",");
+        num_stripe_dirs = 0;
+        while (arg) {
+          if (num_stripe_dirs == STRIPE_MAX_FILES) {
+            fprintf(stderr, "Too many stripe directories.\n");
+            return EXIT_FAILURE;
+          }
+          stripe_dirs[num_stripe_dirs++] = arg;
+          arg = strtok(NULL, ",");
+        }
+        if (!num_stripe_dirs) {
+          fprintf(stderr, "Invalid stripe directory argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case OPT_STRIPE_SIZE: {
+        long long int size = parse_size(optarg);
+        if (size <= 0) {
+          fprintf(stderr, "Invalid stripe size argument.\n");
+          return EXIT_FAILURE;
+        }
+        stripe_size = size;
+        break;
+      }
+      case OPT_SHM:
+        shm_name = optarg;
+        break;
+      case OPT_SHM_SIZE: {
+        long long int size = parse_size(optarg);
+        if (size <= 0) {
+          fprintf(stderr, "Invalid shared memory size argument.\n");
+          return EXIT_FAILURE;
+        }
+        shm_size = size;
+        break;
+      }
+      case OPT_NET:
+        net_addr = optarg;
+        break;
+      case OPT_NET_BACKLOG: {
+        long long int size = parse_size(optarg);
+        if (size <= 0) {
+          fprintf(stderr, "Invalid network backlog argument.\n");
+          return EXIT_FAILURE;
+        }
+        net_backlog = size;
+        break;
+      }
       case 'i': {
-        pid = parse_pid(optarg);
-        if (!pid) {
+        char *arg = strtok(optarg, ",");
+        num_pids = 0;
+        while (arg) {
+          if (num_pids == MAX_DEVICES || !(pids[num_pids++] = parse_pid(arg))) {
+            fprintf(stderr, "Invalid ID argument.\n");
+            return EXIT_FAILURE;
+          }
+          arg = strtok(NULL, ",");
+        }
+        if (!num_pids) {
           fprintf(stderr, "Invalid ID argument.\n");
           return EXIT_FAILURE;
         }
         break;
       }
+      case OPT_IO:
+        if (parse_output_backend(optarg, &output_backend) < 0) {
+          fprintf(stderr, "Invalid I/O backend argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_IO_BUFFERS:
+        io_buffers = atoi(optarg);
+        if (io_buffers < 2 || io_buffers > 64) {
+          fprintf(stderr, "Invalid I/O buffer count argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_IO_SYNC: {
+        long long int size = parse_size(optarg);
+        if (size <= 0) {
+          fprintf(stderr, "Invalid I/O sync interval argument.\n");
+          return EXIT_FAILURE;
+        }
+        io_sync = size;
+        break;
+      }
+      case OPT_DURABLE_SIZE: {
+        long long int size = parse_size(optarg);
+        if (size <= 0) {
+          fprintf(stderr, "Invalid durable size argument.\n");
+          return EXIT_FAILURE;
+        }
+        durable_size = size;
+        break;
+      }
+      case OPT_DURABLE_TIME:
+        durable_time = atoi(optarg);
+        if (durable_time <= 0) {
+          fprintf(stderr, "Invalid durable time argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_CONTAINER:
+        container = 1;
+        break;
+      case OPT_PRETRIGGER:
+      case OPT_POSTTRIGGER: {
+        char *end;
+        double seconds = strtod(optarg, &end);
+        if (*end || end == optarg || seconds <= 0 || seconds > 3600) {
+          fprintf(stderr, "Invalid trigger window argument.\n");
+          return EXIT_FAILURE;
+        }
+        *(c == OPT_PRETRIGGER ? &pretrigger_bytes : &posttrigger_bytes) =
+          (uint64_t)(seconds * SAMPLE_RATE / SAMPLES_PER_BYTE);
+        break;
+      }
+      case OPT_TRIGGER_SOCKET:
+        trigger_socket = optarg;
+        break;
+      case OPT_TRIGGER_POWER: {
+        char *end;
+        trigger_power_db = strtod(optarg, &end);
+        if (*end || end == optarg) {
+          fprintf(stderr, "Invalid trigger power argument.\n");
+          return EXIT_FAILURE;
+        }
+        trigger_power = 1;
+        break;
+      }
+      case OPT_DRAIN_TIMEOUT:
+        drain_timeout = atoi(optarg);
+        if (drain_timeout <= 0) {
+          fprintf(stderr, "Invalid drain timeout argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_COMPRESS:
+        if (parse_compress(optarg, &compress_codec, &compress_level) < 0) {
+          fprintf(stderr, "Invalid compression argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_COMPRESS_THREADS:
+        compress_threads = atoi(optarg);
+        if (compress_threads < 1 || compress_threads > 64) {
+          fprintf(stderr, "Invalid compression thread count argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_METRICS_FILE:
+        metrics.prometheus_file = optarg;
+        break;
+      case OPT_METRICS_SOCKET:
+        metrics.socket_path = optarg;
+        break;
+      case OPT_METRICS_SHM:
+        metrics_shm = optarg;
+        break;
+      case OPT_ALL_DEVICES:
+        all_devices = 1;
+        break;
+      case OPT_USB_THREADS:
+        usb_threads = atoi(optarg);
+        if (usb_threads <= 0 || usb_threads > MAX_DEVICES) {
+          fprintf(stderr, "Invalid USB thread count argument.\n");
+          return EXIT_FAILURE;
+        }
+        break;
       case 'h':
         print_usage();
         return EXIT_SUCCESS;
       case '1':
 	pack_1bit = 1;
 	break;
+      case OPT_DENSE3:
+        pack_dense3 = 1;
+        break;
       case '?':
         if (optopt == 'i')
           fprintf(stderr, "ID argument requires an argument.\n");
@@ -447,6 +2428,23 @@ int main(int argc, char **argv){
         return EXIT_FAILURE;
     }
 
+  /* A priority on its own means SCHED_FIFO. */
+  if (usb_rt.priority && usb_rt.policy == SCHED_OTHER)
+    usb_rt.policy = SCHED_FIFO;
+  if (writer_rt.priority && writer_rt.policy == SCHED_OTHER)
+    writer_rt.policy = SCHED_FIFO;
+  if ((usb_rt.policy != SCHED_OTHER && !usb_rt.priority) ||
+      (writer_rt.policy != SCHED_OTHER && !writer_rt.priority)) {
+    fprintf(stderr, "A real-time policy needs a priority.\n");
+    return EXIT_FAILURE;
+  }
+  if (usb_rt.cpu >= 0 &&
+      usb_rt.cpu + usb_threads > sysconf(_SC_NPROCESSORS_CONF)) {
+    fprintf(stderr, "Not enough CPUs from --usb-cpu %d for %d USB threads.\n",
+            usb_rt.cpu, usb_threads);
+    return EXIT_FAILURE;
+  }
+
   if (optind < argc - 1) {
     /* Too many extra args. */
     print_usage();
@@ -454,81 +2452,322 @@ int main(int argc, char **argv){
     /* Exactly one extra argument - file to write to. */
     output_filename = argv[optind];
   } else {
-    if (verbose)
+    struct stat st;
+    /* Piped into something, with nowhere else to send the samples:
+     * that's where they go. */
+    if (!shm_name && !net_addr && fstat(STDOUT_FILENO, &st) == 0 &&
+        S_ISFIFO(st.st_mode))
+      output_filename = "-";
+    else if (verbose)
       printf("No file name given, will not save samples to file\n");
   }
 
-  if ((ftdi = ftdi_new()) == 0){
-    fprintf(stderr, "ftdi_new failed\n");
+  if (output_filename && !strcmp(output_filename, "-")) {
+    if (isatty(STDOUT_FILENO)) {
+      fprintf(stderr, "Not writing samples to a terminal.\n");
+      return EXIT_FAILURE;
+    }
+    if (all_devices || num_pids > 1) {
+      fprintf(stderr, "Streaming to stdout works with one device at a "
+              "time.\n");
+      return EXIT_FAILURE;
+    }
+    if (rotate_interval || rotate_samples || rotate_size || num_stripe_dirs ||
+        ts_interval || container || compress_codec) {
+      fprintf(stderr, "Streaming to stdout can't be combined with "
+              "rotation, --stripe, --timestamps, --container or "
+              "--compress.\n");
+      return EXIT_FAILURE;
+    }
+    /* Samples get stdout to themselves, messages go to stderr. */
+    fflush(stdout);
+    if ((stdout_fd = dup(STDOUT_FILENO)) < 0 ||
+        dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+      perror("Can't stream to stdout");
+      return EXIT_FAILURE;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    /* A reader going away shows up as EPIPE in the writer. */
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  if (pack_1bit && pack_dense3) {
+    fprintf(stderr, "Use only one of -1 and --dense3.\n");
+    return EXIT_FAILURE;
+  }
+  if (pack_1bit || pack_dense3) {
+    pack_in = 4;
+    pack_out = pack_dense3 ? 3 : 1;
+  }
+  if (!!rotate_interval + !!rotate_samples + !!rotate_size > 1) {
+    fprintf(stderr, "Use only one of -r, --rotate-samples and "
+            "--rotate-size.\n");
+    return EXIT_FAILURE;
+  }
+  if (rotate_align && !rotate_interval) {
+    fprintf(stderr, "--rotate-align needs -r.\n");
+    return EXIT_FAILURE;
+  }
+  if (compress_codec)
+    container = 1;
+  if ((durable_size || durable_time) &&
+      (output_backend == OUTPUT_URING || num_stripe_dirs)) {
+    fprintf(stderr, "--durable-size and --durable-time work with --io stdio "
+            "or direct, without --stripe (--io uring has --io-sync).\n");
+    return EXIT_FAILURE;
+  }
+  if (pretrigger_bytes) {
+    if (!output_filename || !strcmp(output_filename, "-")) {
+      fprintf(stderr, "--pretrigger needs a file name to write to.\n");
+      return EXIT_FAILURE;
+    }
+    if (rotate_interval || rotate_samples || rotate_size || num_stripe_dirs ||
+        ts_interval || container || durable_size || durable_time) {
+      fprintf(stderr, "--pretrigger can't be combined with rotation, "
+              "--stripe, --timestamps, --container, --compress or "
+              "--durable-*.\n");
+      return EXIT_FAILURE;
+    }
+    /* The window is kept in memory, in the sample buffer. */
+    if (overflow_policy == OVERFLOW_SPILL) {
+      fprintf(stderr, "--pretrigger can't be combined with --overflow "
+              "spill.\n");
+      return EXIT_FAILURE;
+    }
+    if (!posttrigger_bytes)
+      posttrigger_bytes = (uint64_t)POSTTRIGGER_SECONDS * SAMPLE_RATE /
+                          SAMPLES_PER_BYTE;
+    /* Room for the window and as much again to write it out while the
+     * next samples come in. */
+    while (ring_size < 2 * pretrigger_bytes)
+      ring_size *= 2;
+  } else if (posttrigger_bytes || trigger_socket || trigger_power) {
+    fprintf(stderr, "--posttrigger, --trigger-socket and --trigger-power "
+            "need --pretrigger.\n");
     return EXIT_FAILURE;
   }
+  if (rotate_size && container) {
+    fprintf(stderr, "--rotate-size can't be combined with --container or "
+            "--compress.\n");
+    return EXIT_FAILURE;
+  }
+  if (num_stripe_dirs && (rotate_interval || rotate_span)) {
+    fprintf(stderr, "--stripe can't be combined with rotation.\n");
+    return EXIT_FAILURE;
+  }
+  /* Files have to hold whole bytes of output. */
+  if (bytes_wanted && pack_in > 1 && bytes_wanted % pack_in) {
+    fprintf(stderr, "-s must be a multiple of %d with -1 or --dense3.\n",
+            (int)(SAMPLES_PER_BYTE * pack_in));
+    return EXIT_FAILURE;
+  }
+  if (rotate_samples) {
+    long long int group = SAMPLES_PER_BYTE * pack_in;
+    if (rotate_samples % group) {
+      fprintf(stderr, "--rotate-samples must be a multiple of %lld.\n",
+              group);
+      return EXIT_FAILURE;
+    }
+    rotate_span = rotate_samples / SAMPLES_PER_BYTE;
+  } else if (rotate_size) {
+    if (rotate_size % pack_out) {
+      fprintf(stderr, "--rotate-size must be a multiple of %zu.\n",
+              pack_out);
+      return EXIT_FAILURE;
+    }
+    rotate_span = rotate_size / pack_out * pack_in;
+  }
 
-  if (ftdi_set_interface(ftdi, INTERFACE_A) < 0){
-    fprintf(stderr, "ftdi_set_interface failed\n");
-    ftdi_free(ftdi);
+  if (autotune_seconds && (all_devices || num_pids > 1)) {
+    fprintf(stderr, "Autotune works with one device at a time.\n");
     return EXIT_FAILURE;
   }
 
-  if (ftdi_usb_open_desc(ftdi, USB_CUSTOM_VID, pid, descstring, NULL) < 0){
-    fprintf(stderr,"Can't open ftdi device: %s\n",ftdi_get_error_string(ftdi));
-    ftdi_free(ftdi);
+  if (open_devices() < 0) {
+    close_devices();
     return EXIT_FAILURE;
   }
+  signal(SIGINT, sigintHandler);
+  if (pretrigger_bytes) {
+    trigger_init(&triggers);
+    signal(SIGUSR1, sigusr1Handler);
+    if (trigger_socket && trigger_socket_start(&triggers, trigger_socket) < 0) {
+      fprintf(stderr, "Can't listen on %s: %s\n", trigger_socket,
+              strerror(errno));
+      close_devices();
+      return EXIT_FAILURE;
+    }
+  }
 
-  /* A timeout value of 1 results in may skipped blocks. */
-  if(ftdi_set_latency_timer(ftdi, 2)){
-    fprintf(stderr,"Can't set latency, Error %s\n",ftdi_get_error_string(ftdi));
-    ftdi_usb_close(ftdi);
-    ftdi_free(ftdi);
+  if (!(telemetry = telemetry_create(metrics_shm, num_captures))) {
+    fprintf(stderr, "Can't create telemetry block: %s\n", strerror(errno));
+    abandon_captures(0);
     return EXIT_FAILURE;
   }
+  for (int i = 0; i < num_captures; i++) {
+    captures[i].tm = &telemetry->devices[i];
+    strcpy(captures[i].tm->name, captures[i].name);
+  }
+
+  if (num_captures > 1 || verbose)
+    printf("Capturing from %d device%s with %d USB thread%s\n", num_captures,
+           num_captures > 1 ? "s" : "", num_groups, num_groups > 1 ? "s" : "");
+
+  if (autotune_seconds) {
+    struct ftdi_context *ftdi = captures[0].ftdi;
+    struct usb_queue_params best;
+    if (usb_autotune(ftdi, autotune_seconds, NUM_FLUSH_BYTES, &exitRequested,
+                     &best) < 0) {
+      fprintf(stderr, "Autotune failed\n");
+      abandon_captures(0);
+      return EXIT_FAILURE;
+    }
+    if ((!output_filename && !shm_name && !net_addr) || exitRequested) {
+      abandon_captures(0);
+      return EXIT_SUCCESS;
+    }
+    packets_per_transfer = best.packets_per_transfer;
+    num_transfers = best.num_transfers;
+    latency_timer = best.latency;
+    if (ftdi_set_latency_timer(ftdi, latency_timer)) {
+      fprintf(stderr,"Can't set latency, Error %s\n",ftdi_get_error_string(ftdi));
+      abandon_captures(0);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (verbose)
+    printf("Using %s FIFO error check\n", fifo_error_scan_impl());
+  if (verbose && pack_dense3)
+    printf("Using %s dense3 packing\n", dense3_impl());
+
+  /* Lock before allocating so every capture buffer is resident. */
+  if (lock_memory)
+    rt_lock_memory();
+
+  for (int i = 0; i < num_captures; i++) {
+    struct capture *cap = &captures[i];
+
+    /* Only create the sample buffer if we have a file to write samples to. */
+    if (output_filename && start_writer(cap) < 0) {
+      abandon_captures(i + 1);
+      return EXIT_FAILURE;
+    }
+    if (shm_name && !(cap->shm = shm_ring_create(cap->shm_name, shm_size))) {
+      fprintf(stderr, "Can't create shared memory ring %s: %s\n",
+              cap->shm_name, strerror(errno));
+      abandon_captures(i + 1);
+      return EXIT_FAILURE;
+    }
+    if (net_addr && (!(cap->net = malloc(sizeof(*cap->net))) ||
+                     net_sink_start(cap->net, net_addr, cap->name,
+                                    net_backlog) < 0)) {
+      /* A sink that didn't start has nothing to stop. */
+      free(cap->net);
+      cap->net = NULL;
+      abandon_captures(i + 1);
+      return EXIT_FAILURE;
+    }
+
+    cap->stream = usb_stream_new(cap->ftdi, packets_per_transfer,
+                                 num_transfers, num_transfers);
+    if (!cap->stream) {
+      fprintf(stderr, "Can't allocate USB transfers\n");
+      abandon_captures(i + 1);
+      return EXIT_FAILURE;
+    }
+    if (lock_memory)
+      usb_stream_prefault(cap->stream);
+  }
+  for (int g = 0; g < num_groups; g++) {
+    struct usb_group *grp = &groups[g];
+    for (int i = 0; i < grp->num_streams; i++)
+      grp->streams[i] = ((struct capture *)grp->userdata[i])->stream;
+    grp->start = num_groups > 1 ? &start_barrier : NULL;
+  }
+  if (num_groups > 1)
+    pthread_barrier_init(&start_barrier, NULL, num_groups);
 
-  if (ftdi_usb_purge_rx_buffer(ftdi) < 0){
-    fprintf(stderr,"Can't rx purge %s\n",ftdi_get_error_string(ftdi));
+  metrics.print_progress = verbose;
+  if ((metrics.print_progress || metrics.prometheus_file ||
+       metrics.socket_path) && telemetry_start(telemetry, &metrics) < 0) {
+    abandon_captures(num_captures);
     return EXIT_FAILURE;
   }
-  signal(SIGINT, sigintHandler);
 
-  /* Only create pipe if we have a file to write samples to. */
-  if (output_filename) {
-    sample_pipe = pipe_new(sizeof(char),PIPE_SIZE);
-    pipe_writer = pipe_producer_new(sample_pipe);
-    pipe_reader = pipe_consumer_new(sample_pipe);
-    pipe_free(sample_pipe);
-    pthread_create(&file_writing_thread, NULL, &file_writer, pipe_reader);
-  }
-
-  /* Read samples from the Piksi. ftdi_readstream blocks until user hits ^C. */
-  err = ftdi_readstream(ftdi, readCallback, NULL, 8, 256);
-  if (err < 0 && !exitRequested)
-    exit(1);
-  exitRequested = 1;
-
-  /* Close thread and free pipe pointers. */
-  /* Seems to hang here, not sure why. */
-  //if (outputFile) {
-  //  pthread_join(file_writing_thread,NULL);
-  //  pipe_producer_free(pipe_writer);
-  //  pipe_consumer_free(pipe_reader);
-  //}
-
-  /* Close file. */
-  if (outputFile) {
-    fclose(outputFile);
-    outputFile = NULL;
+  /* Read samples from the Piksies, one USB thread per group of devices, so
+   * their CPUs and priority stay off this thread, which shuts down after.
+   * Blocks until user hits ^C.
+   */
+  time_t capture_start = time(NULL);
+  for (int g = 0; g < num_groups; g++)
+    pthread_create(&groups[g].thread, NULL, &usb_thread, &groups[g]);
+  for (int g = 0; g < num_groups; g++)
+    pthread_join(groups[g].thread, NULL);
+  for (int g = 0; g < num_groups; g++)
+    if (groups[g].result < 0 && !err)
+      err = groups[g].result;
+  if (num_groups > 1)
+    pthread_barrier_destroy(&start_barrier);
+  double seconds = difftime(time(NULL), capture_start);
+  int failed = err < 0 && !exitRequested;
+  if (!exitRequested)
+    exitRequested = 1;
+  trigger_socket_stop(&triggers);
+
+  /* The USB streams have stopped: close the producer side of every sample
+   * buffer, so the writers drain them while the rest is shut down. */
+  for (int i = 0; i < num_captures; i++) {
+    struct capture *cap = &captures[i];
+
+    end_overflow_run(cap);
+    usb_stream_free(cap->stream);
+    cap->done = 1;
+    if (output_filename) {
+      sample_buffer_finish(&cap->sample_buf);
+      cap->drain_pending = sample_buffer_pending(&cap->sample_buf);
+      __atomic_store_n(&cap->producer_closed, 1, __ATOMIC_RELEASE);
+    }
   }
+
+  struct timespec drain_start;
+  clock_gettime(CLOCK_MONOTONIC, &drain_start);
+  for (int i = 0; i < num_captures; i++) {
+    struct capture *cap = &captures[i];
+
+    if (continue_on_overflow)
+      print_overflow_stats(cap, seconds);
+    if (cap->shm)
+      shm_ring_close(cap->shm, cap->shm_name);
+    if (cap->net) {
+      net_sink_stop(cap->net, cap->total_unflushed_bytes, NET_FLUSH_MS);
+      print_net_stats(cap);
+      free(cap->net);
+    }
+
+    /* Let the writer write out what is left and close the file. */
+    if (output_filename) {
+      drain_writer(cap, &drain_start);
+      print_buffer_stats(cap);
+      if (compress_codec)
+        print_compress_stats(cap);
+      sample_buffer_destroy(&cap->sample_buf);
+      if (ts_interval || container)
+        spsc_ring_destroy(&cap->ts_ring);
+      if (rotate_align)
+        spsc_ring_destroy(&cap->rotate_ring);
+    }
+    if (num_captures > 1 || verbose)
+      print_capture_stats(cap, seconds);
+  }
+  telemetry_stop(telemetry);
   if (verbose)
     printf("Capture ended.\n");
 
   /* Clean up. */
-  if (ftdi_set_bitmode(ftdi, 0xff, BITMODE_RESET) < 0){
-    fprintf(stderr,"Can't set synchronous fifo mode, Error %s\n",ftdi_get_error_string(ftdi));
-    ftdi_usb_close(ftdi);
-    ftdi_free(ftdi);
+  telemetry_destroy(telemetry, metrics_shm);
+  if (close_devices() < 0)
     return EXIT_FAILURE;
-  }
-  ftdi_usb_close(ftdi);
-  ftdi_free(ftdi);
   signal(SIGINT, SIG_DFL);
-  exit (0);
+  exit (failed ? 1 : 0);
 }
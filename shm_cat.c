@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "shm_cat.c"
+ *
+ *   Purpose : Copy the live sample stream published by sample_grabber --shm
+ *             to stdout, from now until the capture ends, reporting any
+ *             data missed because the reader fell behind (the exit status
+ *             is then 2).
+ *
+ *   Usage :   ./shm_cat /piksi | ./my_receiver
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+#define CHUNK (1024*1024)
+#define IDLE_US 1000
+
+int main(int argc, char *argv[])
+{
+  static uint8_t buf[CHUNK];
+  struct shm_ring_reader r;
+  ssize_t n;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s NAME > filename\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (shm_ring_attach(&r, argv[1]) < 0) {
+    fprintf(stderr, "Can't attach to %s: %s\n", argv[1], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  while (!shm_ring_eof(&r)) {
+    uint64_t at = r.cursor;
+    if ((n = shm_ring_read(&r, buf, sizeof(buf))) < 0) {
+      fprintf(stderr, "Fell behind, lost %llu bytes at stream offset %llu\n",
+              (unsigned long long)(r.cursor - at), (unsigned long long)at);
+      continue;
+    }
+    if (n == 0) {
+      usleep(IDLE_US);
+      continue;
+    }
+    if (fwrite(buf, 1, n, stdout) != (size_t)n) {
+      perror("Write error");
+      break;
+    }
+  }
+  shm_ring_detach(&r);
+  return r.lost ? 2 : 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "shm_ring.c"
+ *
+ *   Purpose : Publish the sample stream in a shared memory ring that any
+ *             number of local processes can read without slowing the
+ *             capture down, and the reader side of it.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_ring.h"
+
+struct shm_ring_header *shm_ring_create(const char *name, size_t size)
+{
+  struct shm_ring_header *h;
+  struct timespec ts;
+  size_t cap = 4096;
+  int fd;
+
+  while (cap < size)
+    cap <<= 1;
+
+  shm_unlink(name);
+  if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644)) < 0)
+    return NULL;
+  if (ftruncate(fd, SHM_RING_HEADER_SIZE + cap) < 0) {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  h = mmap(NULL, SHM_RING_HEADER_SIZE + cap, PROT_READ | PROT_WRITE,
+           MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    shm_unlink(name);
+    return NULL;
+  }
+
+  h->version = SHM_RING_VERSION;
+  h->header_size = SHM_RING_HEADER_SIZE;
+  h->size = cap;
+  h->pid = getpid();
+  h->samples_per_byte = 2;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  h->start_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  /* shm_ring_attach trusts size and header_size once it finds the magic,
+   * so they must be visible before it is. */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(h->magic, SHM_RING_MAGIC, sizeof(h->magic));
+  return h;
+}
+
+void shm_ring_write(struct shm_ring_header *h, const void *data, size_t len)
+{
+  uint8_t *ring = (uint8_t *)h + SHM_RING_HEADER_SIZE;
+  const uint8_t *src = data;
+  size_t mask = h->size - 1;
+
+  while (len) {
+    /* Half the ring at a time, so a reader can tell what was lapped. */
+    size_t n = len < h->size / 2 ? len : h->size / 2;
+    uint64_t head = h->head;
+    size_t off = head & mask;
+    size_t first = n < h->size - off ? n : h->size - off;
+
+    __atomic_store_n(&h->reserved, head + n, __ATOMIC_RELAXED);
+    /* Readers must see reserved move before any of the data changes. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    memcpy(ring + off, src, first);
+    memcpy(ring, src + first, n - first);
+    __atomic_store_n(&h->head, head + n, __ATOMIC_RELEASE);
+    src += n;
+    len -= n;
+  }
+}
+
+void shm_ring_close(struct shm_ring_header *h, const char *name)
+{
+  __atomic_store_n(&h->closed, 1, __ATOMIC_RELEASE);
+  munmap(h, SHM_RING_HEADER_SIZE + h->size);
+  shm_unlink(name);
+}
+
+int shm_ring_attach(struct shm_ring_reader *r, const char *name)
+{
+  const struct shm_ring_header *h;
+  struct stat st;
+  int fd;
+
+  memset(r, 0, sizeof(*r));
+  if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < SHM_RING_HEADER_SIZE) {
+    close(fd);
+    errno = EPROTO;
+    return -1;
+  }
+  h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED)
+    return -1;
+  if (memcmp(h->magic, SHM_RING_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != SHM_RING_VERSION ||
+      h->header_size + h->size > (uint64_t)st.st_size) {
+    munmap((void *)h, st.st_size);
+    errno = EPROTO;
+    return -1;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  r->h = h;
+  r->data = (const uint8_t *)h + h->header_size;
+  r->map_size = st.st_size;
+  r->cursor = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  return 0;
+}
+
+void shm_ring_detach(struct shm_ring_reader *r)
+{
+  if (r->h)
+    munmap((void *)r->h, r->map_size);
+  r->h = NULL;
+}
+
+ssize_t shm_ring_read(struct shm_ring_reader *r, void *buf, size_t len)
+{
+  const struct shm_ring_header *h = r->h;
+  uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  size_t mask = h->size - 1;
+  size_t off = r->cursor & mask;
+  size_t n, first;
+
+  if (head - r->cursor > h->size)
+    goto lapped;
+  n = head - r->cursor < len ? head - r->cursor : len;
+  first = n < h->size - off ? n : h->size - off;
+  memcpy(buf, r->data + off, first);
+  memcpy((uint8_t *)buf + first, r->data, n - first);
+  /* Check the copy against what the writer may have touched since. */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&h->reserved, __ATOMIC_RELAXED) > r->cursor + h->size)
+    goto lapped;
+  r->cursor += n;
+  return n;
+
+lapped:
+  head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  r->lost += head - r->cursor;
+  r->cursor = head;
+  errno = EOVERFLOW;
+  return -1;
+}
+
+int shm_ring_eof(const struct shm_ring_reader *r)
+{
+  return __atomic_load_n(&r->h->closed, __ATOMIC_ACQUIRE) &&
+         __atomic_load_n(&r->h->head, __ATOMIC_ACQUIRE) == r->cursor;
+}
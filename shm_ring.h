@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __SHM_RING_H
+#define __SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Broadcast of the sample stream through a POSIX shared memory object
+ * (/dev/shm/NAME), for any number of local readers.
+ *
+ * The object is a one page header followed by size bytes of data, size a
+ * power of two. The byte at stream offset x (counting from the first byte
+ * after the USB flush, as in filename.gaps) is at data[x & (size - 1)]
+ * until it is overwritten size bytes later.
+ *
+ * There is one writer and it never waits for readers. Each reader keeps its
+ * own cursor and finds out it was lapped by checking reserved after copying:
+ * the writer raises reserved before overwriting anything and head after, so
+ * data a reader copied from offset x is intact if reserved <= x + size.
+ */
+
+#define SHM_RING_MAGIC "PKSRING1"
+#define SHM_RING_VERSION 1
+#define SHM_RING_HEADER_SIZE 4096
+
+struct shm_ring_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;      /* Offset of the data. */
+  uint64_t size;             /* Data bytes. */
+  int32_t pid;               /* Of the writer. */
+  uint32_t samples_per_byte; /* Raw Piksi bytes, always 2. */
+  int64_t start_ns;          /* CLOCK_REALTIME at creation. */
+
+  /* Written by the writer only. */
+  struct {
+    uint64_t reserved;       /* Data up to here may be being written. */
+    uint64_t head;           /* Data up to here is complete. */
+    uint32_t closed;         /* The capture has ended. */
+  } __attribute__((aligned(64)));
+};
+
+/* Create (or replace) shared memory object name holding size bytes of data,
+ * rounded up to a power of two. Returns the mapped header or NULL with
+ * errno set.
+ */
+struct shm_ring_header *shm_ring_create(const char *name, size_t size);
+
+/* Append len bytes, overwriting the oldest data. */
+void shm_ring_write(struct shm_ring_header *h, const void *data, size_t len);
+
+/* Mark the stream ended, unmap it and remove the name. Attached readers
+ * keep their mapping and see the end of the stream.
+ */
+void shm_ring_close(struct shm_ring_header *h, const char *name);
+
+struct shm_ring_reader {
+  const struct shm_ring_header *h;
+  const uint8_t *data;
+  size_t map_size;
+  uint64_t cursor;           /* Stream offset of the next byte to read. */
+  uint64_t lost;             /* Bytes skipped after being lapped. */
+};
+
+/* Map shared memory object name read-only, with the cursor at the newest
+ * data. Returns 0, or -1 with errno set (EPROTO if it isn't a ring).
+ */
+int shm_ring_attach(struct shm_ring_reader *r, const char *name);
+void shm_ring_detach(struct shm_ring_reader *r);
+
+/* Copy up to len bytes from the cursor into buf and advance it. Returns the
+ * number of bytes copied, 0 if there is nothing new yet, or -1 with errno
+ * EOVERFLOW if the writer lapped the reader; the bytes missed are added to
+ * lost and the cursor moves on to the newest data.
+ */
+ssize_t shm_ring_read(struct shm_ring_reader *r, void *buf, size_t len);
+
+/* 1 once the writer has closed the ring and everything has been read. */
+int shm_ring_eof(const struct shm_ring_reader *r);
+
+#endif
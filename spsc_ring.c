@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "spsc_ring.h"
+
+int spsc_ring_init(struct spsc_ring *r, size_t size)
+{
+  size_t cap = 4096;
+
+  while (cap < size)
+    cap <<= 1;
+
+  memset(r, 0, sizeof(*r));
+  r->buf = mmap(NULL, cap, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->buf == MAP_FAILED) {
+    r->buf = NULL;
+    return -1;
+  }
+  r->size = cap;
+  r->mask = cap - 1;
+  return 0;
+}
+
+void spsc_ring_destroy(struct spsc_ring *r)
+{
+  if (r->buf)
+    munmap(r->buf, r->size);
+  r->buf = NULL;
+}
+
+size_t spsc_ring_write_space(struct spsc_ring *r)
+{
+  r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  return r->size - (r->head - r->tail_cache);
+}
+
+size_t spsc_ring_write_peek(struct spsc_ring *r, uint8_t **p)
+{
+  size_t space = spsc_ring_write_space(r);
+  size_t off = r->head & r->mask;
+
+  *p = r->buf + off;
+  return space < r->size - off ? space : r->size - off;
+}
+
+void spsc_ring_write_commit(struct spsc_ring *r, size_t n)
+{
+  __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+}
+
+int spsc_ring_write(struct spsc_ring *r, const void *src, size_t n)
+{
+  const uint8_t *s = src;
+  size_t off, first;
+
+  /* Only look at the consumer's cache line when the cached tail says
+   * there is not enough room.
+   */
+  if (r->size - (r->head - r->tail_cache) < n &&
+      spsc_ring_write_space(r) < n)
+    return -1;
+
+  off = r->head & r->mask;
+  first = r->size - off < n ? r->size - off : n;
+  memcpy(r->buf + off, s, first);
+  memcpy(r->buf, s + first, n - first);
+  spsc_ring_write_commit(r, n);
+  return 0;
+}
+
+size_t spsc_ring_read_avail(struct spsc_ring *r)
+{
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+}
+
+size_t spsc_ring_read_peek(struct spsc_ring *r, const uint8_t **p)
+{
+  size_t avail = spsc_ring_read_avail(r);
+  size_t off = r->tail & r->mask;
+
+  *p = r->buf + off;
+  return avail < r->size - off ? avail : r->size - off;
+}
+
+size_t spsc_ring_read_peek_at(struct spsc_ring *r, size_t skip,
+                              const uint8_t **p)
+{
+  size_t avail = spsc_ring_read_avail(r);
+  size_t off = (r->tail + skip) & r->mask;
+
+  if (avail <= skip)
+    return 0;
+  avail -= skip;
+  *p = r->buf + off;
+  return avail < r->size - off ? avail : r->size - off;
+}
+
+void spsc_ring_read_commit(struct spsc_ring *r, size_t n)
+{
+  __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __SPSC_RING_H
+#define __SPSC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPSC_RING_CACHE_LINE 64
+
+/* Lock-free single-producer / single-consumer byte ring.
+ *
+ * head and tail are free-running byte counters; only the producer stores
+ * head and only the consumer stores tail, each on its own cache line. The
+ * producer keeps a cached copy of tail so that spsc_ring_write() only reads
+ * the consumer's line when the ring looks full.
+ */
+struct spsc_ring {
+  uint8_t *buf;
+  size_t size;  /* Capacity in bytes, a power of two. */
+  size_t mask;
+
+  /* Producer side. */
+  uint64_t head __attribute__((aligned(SPSC_RING_CACHE_LINE)));
+  uint64_t tail_cache;
+
+  /* Consumer side. */
+  uint64_t tail __attribute__((aligned(SPSC_RING_CACHE_LINE)));
+} __attribute__((aligned(SPSC_RING_CACHE_LINE)));
+
+/* Allocate a ring of at least size bytes, rounded up to a power of two.
+ * The buffer is page aligned. Returns 0 on success, -1 on error.
+ */
+int spsc_ring_init(struct spsc_ring *r, size_t size);
+void spsc_ring_destroy(struct spsc_ring *r);
+
+/* Producer API. */
+size_t spsc_ring_write_space(struct spsc_ring *r);
+/* Point *p at the next writable byte and return how many bytes can be
+ * written there contiguously.
+ */
+size_t spsc_ring_write_peek(struct spsc_ring *r, uint8_t **p);
+void spsc_ring_write_commit(struct spsc_ring *r, size_t n);
+/* Copy n bytes into the ring. All or nothing: returns 0 if the data was
+ * queued, -1 if there was not enough space for it.
+ */
+int spsc_ring_write(struct spsc_ring *r, const void *src, size_t n);
+
+/* Consumer API. */
+size_t spsc_ring_read_avail(struct spsc_ring *r);
+/* Point *p at the oldest unread byte and return how many bytes can be read
+ * there contiguously. In a ring written only in records of one power of two
+ * size, that is always a whole number of records.
+ */
+size_t spsc_ring_read_peek(struct spsc_ring *r, const uint8_t **p);
+/* As spsc_ring_read_peek, but skip bytes past the oldest unread byte, for a
+ * consumer that hands data on before it is done with it.
+ */
+size_t spsc_ring_read_peek_at(struct spsc_ring *r, size_t skip,
+                              const uint8_t **p);
+void spsc_ring_read_commit(struct spsc_ring *r, size_t n);
+
+#endif
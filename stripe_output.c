@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "stripe_output.c"
+ *
+ *   Purpose : Spread the output stream round-robin over files on several
+ *             disks, one writer thread per disk, for capture rates a single
+ *             drive can't keep up with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "stripe_output.h"
+#include "rt_sched.h"
+
+/* How long a stripe writer sleeps when its queue is empty, and the stream
+ * side when a queue is full. */
+#define STRIPE_IDLE_US 1000
+
+static void *stripe_writer(void *arg)
+{
+  struct stripe_file *f = arg;
+  const uint8_t *p;
+
+  while (1) {
+    /* Everything is queued before stop is set. */
+    int stop = __atomic_load_n(&f->stop, __ATOMIC_ACQUIRE);
+    size_t n = spsc_ring_read_peek(&f->queue, &p);
+    if (n == 0) {
+      if (stop)
+        break;
+      usleep(STRIPE_IDLE_US);
+      continue;
+    }
+    /* After an error keep emptying the queue so the stream side can't
+     * block on it; it sees the error on its next write. */
+    if (!__atomic_load_n(&f->error, __ATOMIC_RELAXED) &&
+        file_output_write(&f->out, p, n) < 0)
+      __atomic_store_n(&f->error, errno ? errno : EIO, __ATOMIC_RELEASE);
+    spsc_ring_read_commit(&f->queue, n);
+  }
+  return NULL;
+}
+
+static int write_manifest(const struct stripe_output *s, int with_length)
+{
+  char tmp[sizeof(s->manifest) + 8];
+  FILE *m;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", s->manifest);
+  if (!(m = fopen(tmp, "w")))
+    return -1;
+  fprintf(m, "# sample_grabber stripe manifest\n");
+  fprintf(m, "version %d\n", STRIPE_MANIFEST_VERSION);
+  fprintf(m, "stripe_size %llu\n", (unsigned long long)s->stripe_size);
+  fprintf(m, "files %d\n", s->num_files);
+  for (int i = 0; i < s->num_files; i++)
+    fprintf(m, "file %d %s\n", i, s->files[i].path);
+  if (with_length)
+    fprintf(m, "length %llu\n", (unsigned long long)s->offset);
+  if (fclose(m) != 0 || rename(tmp, s->manifest) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* Stop and join the writers of the first n files and close them. */
+static int stop_files(struct stripe_output *s, int n)
+{
+  int ret = 0;
+
+  for (int i = 0; i < n; i++) {
+    struct stripe_file *f = &s->files[i];
+    __atomic_store_n(&f->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(f->thread, NULL);
+    if (f->error) {
+      fprintf(stderr, "Write error on %s: %s\n", f->path, strerror(f->error));
+      ret = -1;
+    }
+    if (file_output_close(&f->out) < 0) {
+      fprintf(stderr, "Write error on %s: %s\n", f->path, strerror(errno));
+      ret = -1;
+    }
+    file_output_destroy(&f->out);
+    spsc_ring_destroy(&f->queue);
+  }
+  return ret;
+}
+
+int stripe_output_open(struct stripe_output *s, const char *filename,
+                       char *const *dirs, int num_dirs, uint64_t stripe_size,
+                       enum output_backend backend, size_t buf_size,
+                       int num_bufs)
+{
+  const char *name = strrchr(filename, '/') ? strrchr(filename, '/') + 1 :
+                     filename;
+  const char *ext = strrchr(name, '.');
+  int base_len = ext ? (int)(ext - name) : (int)strlen(name);
+
+  memset(s, 0, sizeof(*s));
+  s->num_files = num_dirs;
+  s->stripe_size = stripe_size;
+  snprintf(s->manifest, sizeof(s->manifest), "%s.stripes", filename);
+
+  for (int i = 0; i < num_dirs; i++) {
+    struct stripe_file *f = &s->files[i];
+    snprintf(f->path, sizeof(f->path), "%s/%.*s-s%d%s", dirs[i], base_len,
+             name, i, ext ? ext : "");
+    /* Room for the stripe being filled and the next. */
+    if (spsc_ring_init(&f->queue, 2 * (stripe_size > buf_size ?
+                                       stripe_size : buf_size)) < 0) {
+      fprintf(stderr, "Unable to allocate stripe queue\n");
+      stop_files(s, i);
+      return -1;
+    }
+    if (file_output_init(&f->out, backend, buf_size, num_bufs) < 0 ||
+        file_output_open(&f->out, f->path) < 0) {
+      fprintf(stderr, "Can't open stripe file %s, Error %s\n", f->path,
+              strerror(errno));
+      file_output_destroy(&f->out);
+      spsc_ring_destroy(&f->queue);
+      stop_files(s, i);
+      return -1;
+    }
+    if (rt_thread_create(&f->thread, stripe_writer, f) != 0) {
+      fprintf(stderr, "Unable to start stripe writer\n");
+      file_output_close(&f->out);
+      file_output_destroy(&f->out);
+      spsc_ring_destroy(&f->queue);
+      stop_files(s, i);
+      return -1;
+    }
+  }
+
+  if (write_manifest(s, 0) < 0) {
+    fprintf(stderr, "Can't write stripe manifest %s, Error %s\n",
+            s->manifest, strerror(errno));
+    stop_files(s, num_dirs);
+    return -1;
+  }
+  return 0;
+}
+
+int stripe_output_write(struct stripe_output *s, const void *data,
+                        size_t len)
+{
+  const uint8_t *src = data;
+
+  while (len) {
+    uint64_t stripe = s->offset / s->stripe_size;
+    struct stripe_file *f = &s->files[stripe % s->num_files];
+    size_t n = s->stripe_size - s->offset % s->stripe_size;
+    uint8_t *p;
+    size_t space;
+
+    if (n > len)
+      n = len;
+    while ((space = spsc_ring_write_peek(&f->queue, &p)) == 0) {
+      if (__atomic_load_n(&f->error, __ATOMIC_ACQUIRE))
+        break;
+      usleep(STRIPE_IDLE_US);
+    }
+    if (__atomic_load_n(&f->error, __ATOMIC_ACQUIRE)) {
+      errno = f->error;
+      return -1;
+    }
+    if (n > space)
+      n = space;
+    memcpy(p, src, n);
+    spsc_ring_write_commit(&f->queue, n);
+    s->offset += n;
+    src += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int stripe_output_close(struct stripe_output *s)
+{
+  int ret = stop_files(s, s->num_files);
+
+  if (write_manifest(s, 1) < 0) {
+    fprintf(stderr, "Can't write stripe manifest %s, Error %s\n",
+            s->manifest, strerror(errno));
+    ret = -1;
+  }
+  return ret;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __STRIPE_OUTPUT_H
+#define __STRIPE_OUTPUT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "spsc_ring.h"
+#include "file_output.h"
+
+/* Striped output: the stream is cut into stripes of stripe_size bytes and
+ * stripe k goes to file k % num_files, each in its own directory (ideally
+ * on its own disk) and written by its own thread from its own queue.
+ *
+ * Stripe k lives at offset (k / num_files) * stripe_size of its file. A text
+ * manifest next to the output filename lists the layout:
+ *
+ *   # sample_grabber stripe manifest
+ *   version 1
+ *   stripe_size 16777216
+ *   files 2
+ *   file 0 /disk0/out-s0.dat
+ *   file 1 /disk1/out-s1.dat
+ *   length 123456789
+ *
+ * length is only added once the capture has ended; without it, the stream
+ * runs until the first stripe that is short.
+ */
+
+#define STRIPE_MANIFEST_VERSION 1
+#define STRIPE_MAX_FILES 16
+
+struct stripe_file {
+  char path[2240];
+  struct spsc_ring queue;
+  struct file_output out;
+  pthread_t thread;
+  int stop;
+  int error;               /* errno of the first failed write. */
+};
+
+struct stripe_output {
+  int num_files;
+  uint64_t stripe_size;
+  uint64_t offset;         /* Bytes written to the stream so far. */
+  char manifest[2240];
+  struct stripe_file files[STRIPE_MAX_FILES];
+};
+
+/* Create the stripe files for filename (its last path component, with -sN
+ * added before the extension) in each of dirs, write the manifest to
+ * filename.stripes and start a writer thread per file. Each file is written
+ * through a file_output with backend, buf_size and num_bufs. Returns 0, or
+ * -1 with a message printed.
+ */
+int stripe_output_open(struct stripe_output *s, const char *filename,
+                       char *const *dirs, int num_dirs, uint64_t stripe_size,
+                       enum output_backend backend, size_t buf_size,
+                       int num_bufs);
+
+/* Queue len bytes, waiting while a file's queue is full. Returns 0, or -1
+ * with errno set if a stripe writer has failed.
+ */
+int stripe_output_write(struct stripe_output *s, const void *data,
+                        size_t len);
+
+/* Write out everything queued, stop the writers, close the files and add
+ * the length to the manifest. Returns 0 or -1 on error.
+ */
+int stripe_output_close(struct stripe_output *s);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "telemetry.c"
+ *
+ *   Purpose : Keep capture counters in a block of memory the hot paths can
+ *             update without syscalls or locks, and publish them from a
+ *             separate reporter thread as a Prometheus text file, JSON on a
+ *             Unix socket and (by mapping the block itself) POSIX shared
+ *             memory.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "telemetry.h"
+#include "unix_server.h"
+
+/* There is one reporter per process. */
+static struct {
+  struct telemetry *t;
+  struct telemetry_export exp;
+  pthread_t thread;
+  int running;
+  volatile int stop;
+  struct unix_server server;
+  /* For progress lines. */
+  uint64_t last_received[TELEMETRY_MAX_DEVICES];
+  int64_t last_ns;
+} reporter;
+
+static int64_t now_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t get(const uint64_t *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+struct telemetry *telemetry_create(const char *shm_name, int num_devices)
+{
+  struct telemetry *t;
+  int fd = -1;
+
+  if (num_devices > TELEMETRY_MAX_DEVICES)
+    return NULL;
+
+  if (shm_name) {
+    if ((fd = shm_open(shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644)) < 0)
+      return NULL;
+    if (ftruncate(fd, sizeof(*t)) < 0) {
+      close(fd);
+      shm_unlink(shm_name);
+      return NULL;
+    }
+    t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  } else {
+    t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (t == MAP_FAILED) {
+    if (shm_name)
+      shm_unlink(shm_name);
+    return NULL;
+  }
+
+  memset(t, 0, sizeof(*t));
+  t->version = TELEMETRY_VERSION;
+  t->size = sizeof(*t);
+  t->pid = getpid();
+  t->num_devices = num_devices;
+  t->start_ns = now_ns(CLOCK_REALTIME);
+  /* A monitor may map the block while it is still zeros; the magic tells
+   * it the version and size fields above can be used. */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(t->magic, TELEMETRY_MAGIC, sizeof(t->magic));
+  return t;
+}
+
+void telemetry_destroy(struct telemetry *t, const char *shm_name)
+{
+  if (!t)
+    return;
+  munmap(t, sizeof(*t));
+  if (shm_name)
+    shm_unlink(shm_name);
+}
+
+static double hist_bound(int i)
+{
+  return (double)(1ULL << i) * 1e-6;
+}
+
+static void prom_hist(FILE *f, const char *metric, const char *help,
+                      const struct telemetry *t, size_t offset)
+{
+  fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", metric, help, metric);
+  for (uint32_t d = 0; d < t->num_devices; d++) {
+    const struct telemetry_device *dev = &t->devices[d];
+    const struct telemetry_hist *h =
+      (const struct telemetry_hist *)((const char *)dev + offset);
+    uint64_t cum = 0;
+    for (int i = 0; i < TELEMETRY_HIST_BUCKETS; i++) {
+      cum += get(&h->buckets[i]);
+      if (i == TELEMETRY_HIST_BUCKETS - 1)
+        fprintf(f, "%s_bucket{device=\"%s\",le=\"+Inf\"} %llu\n", metric,
+                dev->name, (unsigned long long)cum);
+      else
+        fprintf(f, "%s_bucket{device=\"%s\",le=\"%g\"} %llu\n", metric,
+                dev->name, hist_bound(i), (unsigned long long)cum);
+    }
+    fprintf(f, "%s_sum{device=\"%s\"} %.9f\n", metric, dev->name,
+            get(&h->sum_ns) * 1e-9);
+    fprintf(f, "%s_count{device=\"%s\"} %llu\n", metric, dev->name,
+            (unsigned long long)get(&h->count));
+  }
+}
+
+static void prom_counter(FILE *f, const char *metric, const char *type,
+                         const char *help, const struct telemetry *t,
+                         size_t offset)
+{
+  fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+  for (uint32_t d = 0; d < t->num_devices; d++) {
+    const struct telemetry_device *dev = &t->devices[d];
+    fprintf(f, "%s{device=\"%s\"} %llu\n", metric, dev->name,
+            (unsigned long long)get(
+              (const uint64_t *)((const char *)dev + offset)));
+  }
+}
+
+#define DEV_OFFSET(field) offsetof(struct telemetry_device, field)
+
+static void write_prometheus(const struct telemetry *t, const char *path)
+{
+  char tmp[4096];
+  FILE *f;
+
+  /* Write a new file and rename it over the old so scrapers never see a
+   * partial one. */
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (!(f = fopen(tmp, "w")))
+    return;
+  prom_counter(f, "sample_grabber_received_bytes_total", "counter",
+               "Bytes received from USB.", t, DEV_OFFSET(bytes_received));
+  prom_counter(f, "sample_grabber_buffered_bytes_total", "counter",
+               "Bytes passed to the sample buffer.", t,
+               DEV_OFFSET(bytes_buffered));
+  prom_counter(f, "sample_grabber_written_bytes_total", "counter",
+               "Bytes taken from the sample buffer and written out.", t,
+               DEV_OFFSET(bytes_written));
+  prom_counter(f, "sample_grabber_buffer_depth_bytes", "gauge",
+               "Bytes waiting in the sample buffer.", t,
+               DEV_OFFSET(buffer_depth));
+  prom_counter(f, "sample_grabber_fifo_errors_total", "counter",
+               "FPGA FIFO overflow events.", t, DEV_OFFSET(fifo_errors));
+  prom_counter(f, "sample_grabber_rotations_total", "counter",
+               "Output file rotations.", t, DEV_OFFSET(rotations));
+  prom_hist(f, "sample_grabber_callback_seconds",
+            "Time from USB transfer completion to the end of its callback.",
+            t, DEV_OFFSET(callback));
+  prom_hist(f, "sample_grabber_write_seconds",
+            "Duration of each output file write.", t, DEV_OFFSET(write));
+  if (fclose(f) == 0)
+    rename(tmp, path);
+  else
+    unlink(tmp);
+}
+
+static void json_hist(FILE *f, const char *name, const struct telemetry_hist *h)
+{
+  fprintf(f, "\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"buckets_us\":[", name,
+          (unsigned long long)get(&h->count),
+          (unsigned long long)get(&h->sum_ns));
+  for (int i = 0; i < TELEMETRY_HIST_BUCKETS; i++)
+    fprintf(f, "%s%llu", i ? "," : "", (unsigned long long)get(&h->buckets[i]));
+  fprintf(f, "]}");
+}
+
+static void write_json(const struct telemetry *t, FILE *f)
+{
+  fprintf(f, "{\"pid\":%d,\"start_ns\":%lld,\"updated_ns\":%lld,\"devices\":[",
+          t->pid, (long long)t->start_ns, (long long)t->updated_ns);
+  for (uint32_t d = 0; d < t->num_devices; d++) {
+    const struct telemetry_device *dev = &t->devices[d];
+    fprintf(f, "%s{\"name\":\"%s\",\"bytes_received\":%llu,"
+            "\"bytes_buffered\":%llu,\"bytes_written\":%llu,"
+            "\"buffer_depth\":%llu,\"fifo_errors\":%llu,\"rotations\":%llu,",
+            d ? "," : "", dev->name,
+            (unsigned long long)get(&dev->bytes_received),
+            (unsigned long long)get(&dev->bytes_buffered),
+            (unsigned long long)get(&dev->bytes_written),
+            (unsigned long long)get(&dev->buffer_depth),
+            (unsigned long long)get(&dev->fifo_errors),
+            (unsigned long long)get(&dev->rotations));
+    json_hist(f, "callback", &dev->callback);
+    fprintf(f, ",");
+    json_hist(f, "write", &dev->write);
+    fprintf(f, "}");
+  }
+  fprintf(f, "]}\n");
+}
+
+/* Each client gets the counters as one JSON object. */
+static void serve_client(int fd, void *arg)
+{
+  const struct telemetry *t = arg;
+  char *json = NULL;
+  size_t len = 0;
+  FILE *f;
+
+  if (!(f = open_memstream(&json, &len)))
+    return;
+  write_json(t, f);
+  fclose(f);
+  /* One that hangs up mustn't raise SIGPIPE. */
+  for (size_t off = 0; off < len; ) {
+    ssize_t n = send(fd, json + off, len - off, MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    off += n;
+  }
+  free(json);
+}
+
+static void print_progress(struct telemetry *t, int64_t now)
+{
+  double total_time = (now - t->start_ns) * 1e-9;
+  double interval = (now - reporter.last_ns) * 1e-9;
+
+  for (uint32_t d = 0; d < t->num_devices; d++) {
+    const struct telemetry_device *dev = &t->devices[d];
+    uint64_t bytes = get(&dev->bytes_received);
+    if (t->num_devices > 1)
+      printf("[%s] ", dev->name);
+    printf("%10.02fs total time %9.3f MiB captured %7.1f kB/s curr %7.1f kB/s total\n",
+           total_time, bytes / (1024.0 * 1024.0),
+           interval > 0 ? (bytes - reporter.last_received[d]) / interval / 1024.0 : 0.0,
+           total_time > 0 ? bytes / total_time / 1024.0 : 0.0);
+    reporter.last_received[d] = bytes;
+  }
+  fflush(stdout);
+  reporter.last_ns = now;
+}
+
+static void publish(struct telemetry *t)
+{
+  int64_t now = now_ns(CLOCK_REALTIME);
+
+  for (uint32_t d = 0; d < t->num_devices; d++) {
+    struct telemetry_device *dev = &t->devices[d];
+    uint64_t in = get(&dev->bytes_buffered), out = get(&dev->bytes_written);
+    __atomic_store_n(&dev->buffer_depth, in > out ? in - out : 0,
+                     __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&t->updated_ns, now, __ATOMIC_RELEASE);
+
+  if (reporter.exp.prometheus_file)
+    write_prometheus(t, reporter.exp.prometheus_file);
+  if (reporter.exp.print_progress)
+    print_progress(t, now);
+}
+
+static void *reporter_thread(void *arg)
+{
+  struct telemetry *t = arg;
+  int64_t next = now_ns(CLOCK_MONOTONIC) + reporter.exp.interval_ms * 1000000LL;
+
+  while (!reporter.stop) {
+    int64_t now = now_ns(CLOCK_MONOTONIC);
+    if (now >= next) {
+      publish(t);
+      next = now + reporter.exp.interval_ms * 1000000LL;
+    }
+    /* Sleep until the next report, capped so a stop request is noticed
+     * promptly. */
+    int timeout = (int)((next - now) / 1000000) + 1;
+    if (timeout > 100)
+      timeout = 100;
+    usleep(timeout * 1000);
+  }
+  publish(t);
+  return NULL;
+}
+
+int telemetry_start(struct telemetry *t, const struct telemetry_export *exp)
+{
+  reporter.t = t;
+  reporter.exp = *exp;
+  if (reporter.exp.interval_ms <= 0)
+    reporter.exp.interval_ms = 1000;
+  reporter.stop = 0;
+  reporter.last_ns = t->start_ns;
+
+  if (exp->socket_path &&
+      unix_server_start(&reporter.server, exp->socket_path, serve_client,
+                        t) < 0) {
+    fprintf(stderr, "Can't listen on %s: %s\n", exp->socket_path,
+            strerror(errno));
+    return -1;
+  }
+  if (pthread_create(&reporter.thread, NULL, reporter_thread, t) != 0) {
+    unix_server_stop(&reporter.server);
+    return -1;
+  }
+  reporter.running = 1;
+  return 0;
+}
+
+void telemetry_stop(struct telemetry *t)
+{
+  if (!reporter.running)
+    return;
+  reporter.stop = 1;
+  pthread_join(reporter.thread, NULL);
+  reporter.running = 0;
+  unix_server_stop(&reporter.server);
+}
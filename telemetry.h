@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+#include <stdint.h>
+
+/* Live counters for the capture pipeline.
+ *
+ * The block is plain memory, optionally a POSIX shared memory object that
+ * other processes can map read-only. Every counter has exactly one writer
+ * thread, which updates it with a relaxed atomic store, so the hot paths
+ * never take a lock or a locked instruction. Readers get a consistent value
+ * of each counter but not a snapshot across counters.
+ */
+
+#define TELEMETRY_MAGIC "PKSTELE1"
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_MAX_DEVICES 16
+/* Bucket 0 counts durations under 1 us, bucket i (i > 0) those from
+ * 2^(i-1) us up to 2^i us, and the last bucket everything longer.
+ */
+#define TELEMETRY_HIST_BUCKETS 24
+
+struct telemetry_hist {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t buckets[TELEMETRY_HIST_BUCKETS];
+};
+
+struct telemetry_device {
+  char name[32];
+
+  /* Written by the USB event thread. */
+  struct {
+    uint64_t bytes_received;  /* Everything from USB, including the flush. */
+    uint64_t bytes_buffered;  /* Pushed into the sample buffer. */
+    uint64_t fifo_errors;     /* FPGA FIFO overflow events. */
+    struct telemetry_hist callback;  /* Transfer completion to callback end. */
+  } __attribute__((aligned(64)));
+
+  /* Written by the file writing thread. */
+  struct {
+    uint64_t bytes_written;   /* Taken out of the sample buffer. */
+    uint64_t rotations;
+    struct telemetry_hist write;     /* Time spent in each file write. */
+  } __attribute__((aligned(64)));
+
+  /* Written by the reporter. */
+  struct {
+    uint64_t buffer_depth;    /* bytes_buffered - bytes_written. */
+  } __attribute__((aligned(64)));
+};
+
+struct telemetry {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;           /* sizeof(struct telemetry). */
+  int32_t pid;
+  uint32_t num_devices;
+  int64_t start_ns;        /* CLOCK_REALTIME at creation. */
+  int64_t updated_ns;      /* CLOCK_REALTIME of the last reporter pass. */
+  struct telemetry_device devices[TELEMETRY_MAX_DEVICES];
+};
+
+/* Where the reporter thread publishes the counters. Any may be NULL. */
+struct telemetry_export {
+  const char *prometheus_file;  /* Text exposition format, replaced whole. */
+  const char *socket_path;      /* Unix socket, one JSON object per connect. */
+  int interval_ms;
+  int print_progress;           /* Progress lines on stdout, as -v did. */
+};
+
+/* Allocate the counter block, in the shared memory object shm_name (for
+ * shm_open, e.g. "/sample_grabber") if that is not NULL. Returns NULL on
+ * error.
+ */
+struct telemetry *telemetry_create(const char *shm_name, int num_devices);
+void telemetry_destroy(struct telemetry *t, const char *shm_name);
+
+/* Start or stop the reporter thread. Start returns 0 or -1 on error. */
+int telemetry_start(struct telemetry *t, const struct telemetry_export *exp);
+void telemetry_stop(struct telemetry *t);
+
+/* Add to a counter from its one writer thread. */
+static inline void telemetry_add(uint64_t *counter, uint64_t n)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+/* Record a duration in a histogram, from its one writer thread. */
+static inline void telemetry_hist_add(struct telemetry_hist *h, uint64_t ns)
+{
+  uint64_t us = ns / 1000;
+  int i = us ? 64 - __builtin_clzll(us) : 0;
+
+  if (i >= TELEMETRY_HIST_BUCKETS)
+    i = TELEMETRY_HIST_BUCKETS - 1;
+  telemetry_add(&h->buckets[i], 1);
+  telemetry_add(&h->sum_ns, ns);
+  telemetry_add(&h->count, 1);
+}
+
+#endif
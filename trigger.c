@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "trigger.c"
+ *
+ *   Purpose : Trigger sources for --pretrigger capture: a counter that
+ *             SIGUSR1 and a Unix control socket fire, and a power
+ *             threshold measured on the sample stream.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "trigger.h"
+
+void trigger_init(struct trigger *t)
+{
+  memset(t, 0, sizeof(*t));
+}
+
+void trigger_fire(struct trigger *t, enum trigger_reason reason)
+{
+  __atomic_store_n(&t->reason, reason, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&t->fired, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t trigger_count(struct trigger *t, enum trigger_reason *reason)
+{
+  uint64_t n = __atomic_load_n(&t->fired, __ATOMIC_ACQUIRE);
+
+  if (reason)
+    *reason = __atomic_load_n(&t->reason, __ATOMIC_RELAXED);
+  return n;
+}
+
+const char *trigger_reason_name(enum trigger_reason reason)
+{
+  switch (reason) {
+    case TRIGGER_SIGNAL:
+      return "signal";
+    case TRIGGER_SOCKET:
+      return "socket";
+    case TRIGGER_POWER:
+      return "power";
+    default:
+      return "unknown";
+  }
+}
+
+/* A client hanging up mustn't raise SIGPIPE. */
+static void reply(int fd, const char *line)
+{
+  send(fd, line, strlen(line), MSG_NOSIGNAL);
+}
+
+/* Answer the lines a client sends until it hangs up or goes quiet. */
+static void serve_client(int fd, void *arg)
+{
+  struct trigger *t = arg;
+  char line[64], answer[32];
+  FILE *f;
+  int in;
+
+  /* Replies go straight to the socket, the stream is only for reading. */
+  if ((in = dup(fd)) < 0)
+    return;
+  if (!(f = fdopen(in, "r"))) {
+    close(in);
+    return;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (strcmp(line, "trigger") == 0)
+      trigger_fire(t, TRIGGER_SOCKET);
+    else if (strcmp(line, "status") != 0) {
+      reply(fd, "error\n");
+      continue;
+    }
+    snprintf(answer, sizeof(answer), "ok %llu\n",
+             (unsigned long long)trigger_count(t, NULL));
+    reply(fd, answer);
+  }
+  fclose(f);
+}
+
+int trigger_socket_start(struct trigger *t, const char *path)
+{
+  return unix_server_start(&t->server, path, serve_client, t);
+}
+
+void trigger_socket_stop(struct trigger *t)
+{
+  unix_server_stop(&t->server);
+}
+
+/* I^2 + Q^2 of the two samples in each Piksi byte. A sample is (MAX_I1,
+ * MAX_I0, MAX_Q1): I in sign-magnitude, +-1 or +-3 as MAX_I0 is clear or
+ * set, and Q a sign alone, +-1. Only the I magnitude bits, 6 and 3, make a
+ * difference. */
+static uint8_t square_table[256];
+/* Each device's writer sets up its detector, possibly at the same time. */
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void make_table(void)
+{
+  for (int b = 0; b < 256; b++)
+    square_table[b] = (b & 0x40 ? 9 : 1) + 1 + (b & 0x08 ? 9 : 1) + 1;
+}
+
+void power_detector_init(struct power_detector *d, double threshold_db,
+                         uint64_t window)
+{
+  pthread_once(&table_once, make_table);
+  memset(d, 0, sizeof(*d));
+  d->threshold = pow(10.0, threshold_db / 10.0);
+  d->window = window ? window : 1;
+}
+
+ssize_t power_detector_feed(struct power_detector *d, const uint8_t *data,
+                            size_t len)
+{
+  size_t i = 0;
+
+  while (i < len) {
+    size_t n = d->window - d->count;
+    uint64_t sum = 0;
+    if (n > len - i)
+      n = len - i;
+    for (size_t k = 0; k < n; k++)
+      sum += square_table[data[i + k]];
+    d->sum += sum;
+    d->count += n;
+    i += n;
+    if (d->count == d->window) {
+      /* Two samples a byte, each at least 2, the 0 dB level. */
+      double power = (double)d->sum / (4 * d->window);
+      d->last_db = 10.0 * log10(power);
+      d->sum = d->count = 0;
+      if (power >= d->threshold)
+        return i;
+    }
+  }
+  return -1;
+}
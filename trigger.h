@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __TRIGGER_H
+#define __TRIGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "unix_server.h"
+
+/* Triggers for --pretrigger capture. SIGUSR1 and the control socket fire a
+ * struct trigger shared by all devices, whose writers poll its count. The
+ * power threshold is measured by each writer on its own stream with a
+ * power_detector.
+ */
+enum trigger_reason {
+  TRIGGER_SIGNAL,
+  TRIGGER_SOCKET,
+  TRIGGER_POWER,
+};
+
+struct trigger {
+  uint64_t fired;          /* Triggers so far, bumped atomically. */
+  uint32_t reason;         /* enum trigger_reason of the last one. */
+
+  struct unix_server server; /* Control socket. */
+};
+
+void trigger_init(struct trigger *t);
+
+/* Fire the trigger. Only does lock-free atomics, so it can be called from a
+ * signal handler.
+ */
+void trigger_fire(struct trigger *t, enum trigger_reason reason);
+
+/* Number of times the trigger has fired, and why it last did if reason
+ * isn't NULL.
+ */
+uint64_t trigger_count(struct trigger *t, enum trigger_reason *reason);
+
+/* Listen on Unix socket path. Each connection may send lines of "trigger",
+ * which fire it, or "status"; each is answered with a line "ok COUNT" (or
+ * "error"). Returns 0, or -1 with errno set.
+ */
+int trigger_socket_start(struct trigger *t, const char *path);
+void trigger_socket_stop(struct trigger *t);
+
+const char *trigger_reason_name(enum trigger_reason reason);
+
+/* Mean I^2 + Q^2 of windows of a Piksi byte stream, in dB over its least
+ * value. I is 2-bit sign-magnitude (+-1 or +-3) and Q 1-bit (+-1), so
+ * power is 0 dB with no I magnitude bit set and 7 dB with all of them set.
+ */
+struct power_detector {
+  double threshold;        /* Mean square value to trigger at. */
+  uint64_t window;         /* Bytes per measurement. */
+  uint64_t sum;            /* Of the squares in the current window, */
+  uint64_t count;          /* over this many bytes. */
+  double last_db;          /* Power of the last whole window. */
+};
+
+void power_detector_init(struct power_detector *d, double threshold_db,
+                         uint64_t window);
+
+/* Measure len more bytes of the stream. Returns the number of bytes into
+ * data at which the first window at or over the threshold ended, or -1 if
+ * none did.
+ */
+ssize_t power_detector_feed(struct power_detector *d, const uint8_t *data,
+                            size_t len);
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "trigger_test.c"
+ *
+ *   Purpose : Fire each kind of --pretrigger trigger (signal, control socket
+ *             and power threshold) and write an event file for one the way
+ *             sample_grabber's trigger writer does, in a scratch directory.
+ *             Exits non-zero if anything goes wrong.
+ *
+ *   Usage :   ./trigger_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "file_output.h"
+#include "file_rotation.h"
+#include "trigger.h"
+
+#define WINDOW 4096
+#define EVENT_SAMPLE 1234
+#define EVENT_BYTES 100000
+
+static struct trigger triggers;
+static int failures;
+
+static void check(int ok, const char *what)
+{
+  printf("%-44s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok)
+    failures++;
+}
+
+static void on_usr1(int sig)
+{
+  (void)sig;
+  trigger_fire(&triggers, TRIGGER_SIGNAL);
+}
+
+/* Send one line to the control socket and return its answer. */
+static int socket_command(const char *path, const char *cmd, char *answer,
+                          size_t len)
+{
+  struct sockaddr_un addr;
+  ssize_t n;
+  int fd;
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      write(fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd) ||
+      (n = read(fd, answer, len - 1)) <= 0) {
+    close(fd);
+    return -1;
+  }
+  answer[n] = 0;
+  close(fd);
+  return 0;
+}
+
+static void test_signal(void)
+{
+  enum trigger_reason reason;
+  uint64_t before = trigger_count(&triggers, NULL);
+
+  signal(SIGUSR1, on_usr1);
+  raise(SIGUSR1);
+  check(trigger_count(&triggers, &reason) == before + 1 &&
+        reason == TRIGGER_SIGNAL, "SIGUSR1 fires the trigger");
+}
+
+static void test_socket(const char *dir)
+{
+  enum trigger_reason reason;
+  char path[256], answer[64], expect[64];
+  uint64_t before = trigger_count(&triggers, NULL);
+
+  snprintf(path, sizeof(path), "%s/trigger.sock", dir);
+  if (trigger_socket_start(&triggers, path) < 0) {
+    check(0, "control socket starts");
+    return;
+  }
+  snprintf(expect, sizeof(expect), "ok %llu\n",
+           (unsigned long long)before + 1);
+  check(socket_command(path, "trigger\n", answer, sizeof(answer)) == 0 &&
+        !strcmp(answer, expect), "\"trigger\" on the socket is answered");
+  check(trigger_count(&triggers, &reason) == before + 1 &&
+        reason == TRIGGER_SOCKET, "\"trigger\" on the socket fires it");
+  check(socket_command(path, "status\n", answer, sizeof(answer)) == 0 &&
+        !strcmp(answer, expect), "\"status\" on the socket doesn't");
+  trigger_socket_stop(&triggers);
+  check(access(path, F_OK) < 0, "control socket is removed on stop");
+}
+
+static void test_power(void)
+{
+  static uint8_t quiet[2 * WINDOW], loud[WINDOW];
+  struct power_detector d;
+
+  /* No I magnitude bits is 0 dB, all of them 7 dB. */
+  memset(loud, 0x48, sizeof(loud));
+  power_detector_init(&d, 3.0, WINDOW);
+  check(power_detector_feed(&d, quiet, sizeof(quiet)) < 0 &&
+        d.last_db == 0.0, "power under the threshold doesn't fire");
+  check(power_detector_feed(&d, loud, WINDOW / 2) < 0,
+        "power detector waits for a whole window");
+  check(power_detector_feed(&d, loud, WINDOW) == WINDOW / 2,
+        "power over the threshold fires at its window");
+}
+
+/* Take, write and finish an event file as trigger_writer does. */
+static void test_event_file(const char *dir)
+{
+  static uint8_t data[EVENT_BYTES];
+  struct rotation_point start = { 0, EVENT_SAMPLE };
+  struct file_rotation naming;
+  struct file_output out;
+  struct output_file f;
+  struct stat st;
+  char base[256], expect[256], path[ROTATION_PATH_MAX];
+
+  snprintf(base, sizeof(base), "%s/ev.dat", dir);
+  snprintf(expect, sizeof(expect), "%s/ev-%012d.dat", dir, EVENT_SAMPLE);
+  if (file_output_init(&out, OUTPUT_STDIO, 1 << 20, 2) < 0 ||
+      file_rotation_init(&naming, base, OUTPUT_STDIO, 0, 1) < 0) {
+    check(0, "event file output starts");
+    return;
+  }
+  check(file_rotation_take(&naming, start, &f, NULL, path,
+                           sizeof(path)) == 0 && !strcmp(path, expect),
+        "event file is named by its first sample");
+  file_output_attach(&out, &f);
+  check(file_output_write(&out, data, sizeof(data)) == 0 &&
+        file_output_detach(&out, &f) == 0, "event file is written");
+  file_rotation_retire(&naming, &f, NULL);
+  file_rotation_destroy(&naming);
+  file_output_destroy(&out);
+  check(stat(expect, &st) == 0 && st.st_size == EVENT_BYTES,
+        "event file holds what was written");
+  unlink(expect);
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/trigger_test.XXXXXX";
+
+  if (!mkdtemp(dir)) {
+    fprintf(stderr, "Can't make a scratch directory: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  trigger_init(&triggers);
+  test_signal();
+  test_socket(dir);
+  test_power();
+  test_event_file(dir);
+  rmdir(dir);
+  return failures ? EXIT_FAILURE : 0;
+}
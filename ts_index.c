@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ts_index.h"
+
+int ts_index_start(FILE *f, uint64_t base_sample)
+{
+  struct ts_index_header h;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TS_INDEX_MAGIC, sizeof(h.magic));
+  h.version = TS_INDEX_VERSION;
+  h.record_size = sizeof(struct ts_record);
+  h.base_sample = base_sample;
+  return fwrite(&h, sizeof(h), 1, f) == 1 ? 0 : -1;
+}
+
+FILE *ts_index_create(const char *path, uint64_t base_sample)
+{
+  FILE *f;
+
+  if (!(f = fopen(path, "w")))
+    return NULL;
+  if (ts_index_start(f, base_sample) < 0) {
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+int ts_index_append(FILE *f, const struct ts_record *rec)
+{
+  return fwrite(rec, sizeof(*rec), 1, f) == 1 ? 0 : -1;
+}
+
+int ts_index_load(struct ts_index *idx, const char *path)
+{
+  FILE *f;
+  long size;
+
+  memset(idx, 0, sizeof(*idx));
+  if (!(f = fopen(path, "r")))
+    return -1;
+
+  if (fread(&idx->header, sizeof(idx->header), 1, f) != 1 ||
+      memcmp(idx->header.magic, TS_INDEX_MAGIC, sizeof(idx->header.magic)) ||
+      idx->header.version != TS_INDEX_VERSION ||
+      idx->header.record_size != sizeof(struct ts_record))
+    goto fail;
+
+  if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0)
+    goto fail;
+  /* Ignore a partly written last record. */
+  idx->count = (size - sizeof(idx->header)) / sizeof(struct ts_record);
+  if (fseek(f, sizeof(idx->header), SEEK_SET) < 0)
+    goto fail;
+
+  if (idx->count) {
+    if (!(idx->records = malloc(idx->count * sizeof(struct ts_record))))
+      goto fail;
+    if (fread(idx->records, sizeof(struct ts_record), idx->count, f) !=
+        idx->count)
+      goto fail;
+  }
+  fclose(f);
+  return 0;
+
+fail:
+  fclose(f);
+  ts_index_free(idx);
+  return -1;
+}
+
+void ts_index_free(struct ts_index *idx)
+{
+  free(idx->records);
+  idx->records = NULL;
+  idx->count = 0;
+}
+
+int ts_index_lookup(const struct ts_index *idx, uint64_t sample,
+                    enum ts_clock clock, int64_t *ns)
+{
+  size_t lo = 0, hi;
+  const struct ts_record *a, *b;
+
+  if (idx->count < 2 || clock >= TS_NUM_CLOCKS)
+    return -1;
+
+  /* Find the last record at or before sample, clamped so that it has a
+   * successor to interpolate towards.
+   */
+  hi = idx->count - 1;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (idx->records[mid].sample <= sample)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  a = &idx->records[lo];
+  b = &idx->records[lo + 1];
+
+  if (b->sample == a->sample) {
+    *ns = a->ns[clock];
+    return 0;
+  }
+  *ns = a->ns[clock] + (int64_t)((double)(b->ns[clock] - a->ns[clock]) *
+                                 ((double)sample - (double)a->sample) /
+                                 (double)(b->sample - a->sample));
+  return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __TS_INDEX_H
+#define __TS_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Timestamp index sidecar (".tidx") for a sample file.
+ *
+ * A 32 byte header followed by 32 byte records, all little-endian. Each
+ * record gives the host clocks at the moment the USB transfer ending just
+ * before sample number `sample` (counted from the start of the sample file)
+ * completed. Records are in increasing sample order.
+ */
+
+#define TS_INDEX_MAGIC "PKSTIDX1"
+#define TS_INDEX_VERSION 1
+
+enum ts_clock {
+  TS_REALTIME,
+  TS_MONOTONIC,
+  TS_TAI,
+  TS_NUM_CLOCKS
+};
+
+struct ts_index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t base_sample;  /* Stream sample number of the file's first sample. */
+  uint64_t reserved;
+};
+
+struct ts_record {
+  uint64_t sample;
+  int64_t ns[TS_NUM_CLOCKS];  /* Nanoseconds since each clock's epoch. */
+};
+
+/* Writing. ts_index_start writes the header to a file opened beforehand. */
+FILE *ts_index_create(const char *path, uint64_t base_sample);
+int ts_index_start(FILE *f, uint64_t base_sample);
+int ts_index_append(FILE *f, const struct ts_record *rec);
+
+/* Reading. */
+struct ts_index {
+  struct ts_index_header header;
+  struct ts_record *records;
+  size_t count;
+};
+
+/* Load an index file. Returns 0 on success, -1 on error. */
+int ts_index_load(struct ts_index *idx, const char *path);
+void ts_index_free(struct ts_index *idx);
+
+/* Find the time of sample on the given clock by binary search, linearly
+ * interpolating between the surrounding records (or extrapolating from the
+ * nearest two at either end). Returns 0 on success, -1 if the index has
+ * fewer than two records.
+ */
+int ts_index_lookup(const struct ts_index *idx, uint64_t sample,
+                    enum ts_clock clock, int64_t *ns);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "ts_lookup.c"
+ *
+ *   Purpose : Print the host time of sample numbers in a sample file from
+ *             its sample_grabber --timestamps index. With no sample numbers
+ *             the index is checked instead: records in sample order, and
+ *             every record's own times given back by the lookup.
+ *
+ *   Usage :   ./ts_lookup [-c realtime|monotonic|tai] FILE.tidx [SAMPLE...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ts_index.h"
+
+static const char *clock_names[TS_NUM_CLOCKS] = {
+  [TS_REALTIME] = "realtime",
+  [TS_MONOTONIC] = "monotonic",
+  [TS_TAI] = "tai",
+};
+
+static void print_ns(int64_t ns)
+{
+  lldiv_t d = lldiv(ns, 1000000000);
+
+  if (d.rem < 0) {
+    d.quot--;
+    d.rem += 1000000000;
+  }
+  printf("%lld.%09lld", d.quot, d.rem);
+}
+
+static int check_index(const struct ts_index *idx)
+{
+  int bad = 0;
+
+  for (size_t i = 0; i < idx->count; i++) {
+    const struct ts_record *r = &idx->records[i];
+
+    if (i && r->sample < idx->records[i - 1].sample) {
+      fprintf(stderr, "Record %zu at sample %llu is out of order\n", i,
+              (unsigned long long)r->sample);
+      bad = 1;
+    }
+    /* Records sharing a sample number can't all be found. */
+    if (i + 1 < idx->count && idx->records[i + 1].sample == r->sample)
+      continue;
+    for (int c = 0; c < TS_NUM_CLOCKS; c++) {
+      int64_t ns;
+      if (ts_index_lookup(idx, r->sample, c, &ns) < 0 || ns != r->ns[c]) {
+        fprintf(stderr, "Lookup of sample %llu on %s is wrong\n",
+                (unsigned long long)r->sample, clock_names[c]);
+        bad = 1;
+      }
+    }
+  }
+  if (idx->count)
+    printf("%zu records, samples %llu to %llu from base sample %llu\n",
+           idx->count, (unsigned long long)idx->records[0].sample,
+           (unsigned long long)idx->records[idx->count - 1].sample,
+           (unsigned long long)idx->header.base_sample);
+  else
+    printf("No records\n");
+  return bad;
+}
+
+int main(int argc, char *argv[])
+{
+  enum ts_clock clock = TS_REALTIME;
+  struct ts_index idx;
+  int opt, err = 0;
+
+  while ((opt = getopt(argc, argv, "c:")) != -1) {
+    switch (opt) {
+      case 'c':
+        for (clock = 0; clock < TS_NUM_CLOCKS; clock++)
+          if (!strcmp(optarg, clock_names[clock]))
+            break;
+        if (clock == TS_NUM_CLOCKS) {
+          fprintf(stderr, "Unknown clock %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        err = 1;
+    }
+  }
+  if (err || optind >= argc) {
+    fprintf(stderr, "Usage: %s [-c realtime|monotonic|tai] FILE.tidx "
+            "[SAMPLE...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (ts_index_load(&idx, argv[optind]) < 0) {
+    fprintf(stderr, "Can't load index %s\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  if (optind + 1 == argc) {
+    err = check_index(&idx);
+  } else {
+    for (int i = optind + 1; i < argc; i++) {
+      uint64_t sample = strtoull(argv[i], NULL, 0);
+      int64_t ns;
+      if (ts_index_lookup(&idx, sample, clock, &ns) < 0) {
+        fprintf(stderr, "Index has too few records to look up times\n");
+        err = 1;
+        break;
+      }
+      printf("%llu ", (unsigned long long)sample);
+      print_ns(ns);
+      printf("\n");
+    }
+  }
+  ts_index_free(&idx);
+  return err ? EXIT_FAILURE : 0;
+}
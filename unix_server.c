@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "unix_server.c"
+ *
+ *   Purpose : A Unix stream socket served by a thread, one client at a
+ *             time, shared by the telemetry and trigger sockets.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "unix_server.h"
+
+/* How long the thread waits at a time, so a stop is noticed. */
+#define POLL_MS 100
+
+static void *server_thread(void *arg)
+{
+  struct unix_server *s = arg;
+  struct timeval tv = { 1, 0 };
+
+  while (!s->stop) {
+    struct pollfd pfd = { s->listen_fd, POLLIN, 0 };
+    int fd;
+    if (poll(&pfd, 1, POLL_MS) <= 0 ||
+        (fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    s->handler(fd, s->arg);
+    close(fd);
+  }
+  return NULL;
+}
+
+int unix_server_start(struct unix_server *s, const char *path,
+                      unix_server_handler *handler, void *arg)
+{
+  struct sockaddr_un addr;
+  int err;
+
+  memset(s, 0, sizeof(*s));
+  s->listen_fd = -1;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if ((s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(s->listen_fd, 8) < 0 || !(s->path = strdup(path)))
+    goto fail;
+  s->handler = handler;
+  s->arg = arg;
+  if ((errno = pthread_create(&s->thread, NULL, server_thread, s)) != 0) {
+    unlink(path);
+    goto fail;
+  }
+  s->running = 1;
+  return 0;
+
+fail:
+  err = errno;
+  close(s->listen_fd);
+  s->listen_fd = -1;
+  free(s->path);
+  s->path = NULL;
+  errno = err;
+  return -1;
+}
+
+void unix_server_stop(struct unix_server *s)
+{
+  if (!s->running)
+    return;
+  s->stop = 1;
+  pthread_join(s->thread, NULL);
+  s->running = 0;
+  close(s->listen_fd);
+  unlink(s->path);
+  free(s->path);
+  s->listen_fd = -1;
+  s->path = NULL;
+}
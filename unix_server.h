@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __UNIX_SERVER_H
+#define __UNIX_SERVER_H
+
+#include <pthread.h>
+
+/* Handle one client connection on fd, which is closed afterwards. */
+typedef void (unix_server_handler)(int fd, void *arg);
+
+/* A Unix stream socket whose clients are served one at a time by a thread
+ * of its own, for the small control and status sockets.
+ */
+struct unix_server {
+  int listen_fd;
+  char *path;
+  unix_server_handler *handler;
+  void *arg;
+  pthread_t thread;
+  volatile int stop;
+  int running;
+};
+
+/* Listen on path, replacing any socket left there, and serve each client
+ * with handler. Clients get a second to send or take each reply before
+ * they are given up on, so a stalled one can't hold up the rest for long.
+ * Returns 0, or -1 with errno set.
+ */
+int unix_server_start(struct unix_server *s, const char *path,
+                      unix_server_handler *handler, void *arg);
+
+/* Stop serving and remove the socket. Does nothing if it isn't running. */
+void unix_server_stop(struct unix_server *s);
+
+#endif
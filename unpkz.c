@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "unpkz.c"
+ *
+ *   Purpose : Turn a container written by sample_grabber --container or
+ *             --compress back into the sample stream on stdout, from the
+ *             start or, using the block index, from any byte offset or
+ *             sample number. -i describes the file and checks every block
+ *             instead.
+ *
+ *   Usage :   ./unpkz [-o OFFSET | -s SAMPLE] [-n LENGTH] out.dat > raw.dat
+ *             ./unpkz -i out.dat
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "pkz_reader.h"
+
+static const char *format_name(uint32_t format)
+{
+  switch (format) {
+    case FORMAT_PIKSI:
+      return "piksi";
+    case FORMAT_1BIT:
+      return "1bit";
+    case FORMAT_DENSE3:
+      return "dense3";
+    default:
+      return "unknown";
+  }
+}
+
+/* Print the header and check every block. Returns the number of bad
+ * blocks. */
+static uint64_t describe(struct pkz_reader *r)
+{
+  const struct pkz_header *h = &r->header;
+  uint64_t bad = 0, gaps = 0, fifo = 0;
+  struct pkz_block b;
+
+  printf("Format:      %s, %u samples in %u bytes\n", format_name(h->format),
+         h->group_samples, h->group_bytes);
+  printf("Device:      %s pid 0x%04x on %s\n", h->device[0] ? h->device : "-",
+         h->usb_pid, h->host[0] ? h->host : "-");
+  printf("Started:     %lld.%09lld\n", (long long)(h->start_ns / 1000000000),
+         (long long)(h->start_ns % 1000000000));
+  printf("Samples:     %llu from %llu\n", (unsigned long long)r->samples,
+         (unsigned long long)h->base_sample);
+  printf("Blocks:      %llu of %u bytes, %llu bytes in all%s\n",
+         (unsigned long long)r->blocks, h->block_size,
+         (unsigned long long)r->raw_length,
+         r->finished ? "" : " (no index, capture not finished)");
+  for (uint64_t k = 0; k < r->blocks; k++) {
+    if (pkz_read_block(r, k, &b, NULL) < 0) {
+      printf("Block %llu at sample %llu: %s\n", (unsigned long long)k,
+             (unsigned long long)r->index[k].sample, strerror(errno));
+      bad++;
+      continue;
+    }
+    gaps += !!(b.flags & PKZ_BLOCK_GAP);
+    fifo += !!(b.flags & PKZ_BLOCK_FIFO);
+  }
+  printf("Flagged:     %llu blocks after gaps, %llu with FIFO errors\n",
+         (unsigned long long)gaps, (unsigned long long)fifo);
+  printf("Bad blocks:  %llu\n", (unsigned long long)bad);
+  return bad;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned long long offset = 0, length = UINT64_MAX, sample = 0;
+  int by_sample = 0, info = 0;
+  struct pkz_reader r;
+  struct pkz_block b;
+  uint64_t pos;
+  int64_t k;
+  uint8_t *raw;
+  int c;
+
+  while ((c = getopt(argc, argv, "o:s:n:i")) != -1) {
+    switch (c) {
+      case 'o':
+        offset = strtoull(optarg, NULL, 0);
+        break;
+      case 's':
+        sample = strtoull(optarg, NULL, 0);
+        by_sample = 1;
+        break;
+      case 'n':
+        length = strtoull(optarg, NULL, 0);
+        break;
+      case 'i':
+        info = 1;
+        break;
+      default:
+        optind = argc;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s [-o OFFSET | -s SAMPLE] [-n LENGTH] filename "
+            "> raw\n       %s -i filename\n", argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (pkz_open(&r, argv[optind]) < 0) {
+    if (errno == EINVAL)
+      fprintf(stderr, "%s is not a capture container\n", argv[optind]);
+    else
+      perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+  if (info)
+    return describe(&r) ? EXIT_FAILURE : 0;
+  if (!(raw = malloc(r.header.block_size))) {
+    fprintf(stderr, "Out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  /* A sample number starts at the byte holding it. */
+  if (by_sample) {
+    if ((k = pkz_find_sample(&r, sample)) < 0) {
+      fprintf(stderr, "Sample %llu is not in %s\n", sample, argv[optind]);
+      return EXIT_FAILURE;
+    }
+    offset = (sample - r.header.base_sample) / r.header.group_samples *
+             r.header.group_bytes;
+  }
+  k = pkz_find_offset(&r, offset);
+  pos = k < 0 ? r.raw_length : (uint64_t)k * r.header.block_size;
+
+  for (; k >= 0 && (uint64_t)k < r.blocks && length; k++) {
+    ssize_t len = pkz_read_block(&r, k, &b, raw);
+    uint64_t skip, n;
+    if (len < 0) {
+      fprintf(stderr, "Block at stream offset %llu: %s\n",
+              (unsigned long long)pos, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    skip = offset > pos ? offset - pos : 0;
+    n = len - skip;
+    if (n > length)
+      n = length;
+    if (fwrite(raw + skip, 1, n, stdout) != n) {
+      perror("Write error");
+      return EXIT_FAILURE;
+    }
+    length -= n;
+    pos += len;
+  }
+  if (!r.finished) {
+    fprintf(stderr, "%s has no index (capture not finished), stream ends at "
+            "%llu bytes\n", argv[optind], (unsigned long long)r.raw_length);
+    return 2;
+  }
+  pkz_close(&r);
+  free(raw);
+  return 0;
+}
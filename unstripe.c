@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "unstripe.c"
+ *
+ *   Purpose : Put a stream captured with sample_grabber --stripe back
+ *             together from its manifest (filename.stripes), on stdout.
+ *
+ *   Usage :   ./unstripe out.dat.stripes > out.dat
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MAX_FILES 16
+#define CHUNK (1024*1024)
+
+int main(int argc, char *argv[])
+{
+  static char line[4096], path[MAX_FILES][4096];
+  static uint8_t buf[CHUNK];
+  FILE *files[MAX_FILES] = { NULL };
+  unsigned long long stripe_size = 0, length = 0, written = 0;
+  int version = 0, num_files = 0, have_length = 0, i;
+  FILE *m;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s filename.stripes > filename\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!(m = fopen(argv[1], "r"))) {
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+  while (fgets(line, sizeof(line), m)) {
+    line[strcspn(line, "\n")] = 0;
+    if (sscanf(line, "version %d", &version) == 1 ||
+        sscanf(line, "stripe_size %llu", &stripe_size) == 1 ||
+        sscanf(line, "files %d", &num_files) == 1)
+      continue;
+    if (sscanf(line, "length %llu", &length) == 1) {
+      have_length = 1;
+    } else if (sscanf(line, "file %d", &i) == 1) {
+      char *p = strchr(line + 5, ' ');
+      if (i < 0 || i >= MAX_FILES || !p) {
+        fprintf(stderr, "Bad manifest line: %s\n", line);
+        return EXIT_FAILURE;
+      }
+      strcpy(path[i], p + 1);
+    }
+  }
+  fclose(m);
+  if (version != 1 || !stripe_size || num_files <= 0 ||
+      num_files > MAX_FILES) {
+    fprintf(stderr, "%s is not a version 1 stripe manifest\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < num_files; i++) {
+    if (!(files[i] = fopen(path[i], "r"))) {
+      perror(path[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* Stripe k is the (k / num_files)th stripe of file k % num_files, and the
+   * files are read in order, so no seeking is needed. Without a length the
+   * stream ends at the first short stripe. */
+  for (uint64_t k = 0; !have_length || written < length; k++) {
+    FILE *f = files[k % num_files];
+    unsigned long long left = stripe_size;
+    if (have_length && left > length - written)
+      left = length - written;
+    while (left) {
+      size_t want = left < CHUNK ? left : CHUNK;
+      size_t got = fread(buf, 1, want, f);
+      fwrite(buf, 1, got, stdout);
+      written += got;
+      left -= got;
+      if (got < want)
+        break;
+    }
+    if (left)
+      break;
+  }
+  if (have_length && written != length) {
+    fprintf(stderr, "Stream ends at %llu of %llu bytes\n", written, length);
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "usb_autotune.c"
+ *
+ *   Purpose : Find USB queue settings a host can sustain by streaming with
+ *             each combination for a fixed time and comparing the results.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include "usb_autotune.h"
+#include "usb_stream.h"
+#include "fifo_check.h"
+
+static const int sweep_packets[] = { 8, 16, 32, 64 };
+static const int sweep_transfers[] = { 64, 128, 256, 512 };
+static const int sweep_latency[] = { 1, 2, 4, 8 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct tune_run {
+  /* Settings. */
+  double duration;
+  uint64_t flush_bytes;
+  volatile int *stop;
+  /* Results. */
+  uint64_t bytes;
+  uint64_t fifo_errors;
+  double start, last;
+  double interval_sum, interval_sq_sum, interval_max;
+  uint64_t intervals;
+};
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static int tune_callback(struct usb_buffer *buffer,
+                         struct usb_stream_progress *progress, void *userdata)
+{
+  struct tune_run *run = userdata;
+  double t = now_s();
+
+  if (buffer) {
+    if (run->flush_bytes > 0) {
+      run->flush_bytes = buffer->length < run->flush_bytes ?
+                         run->flush_bytes - buffer->length : 0;
+      run->start = run->last = t;
+    } else {
+      const uint8_t *p = buffer->data;
+      size_t n = buffer->length, i;
+      double dt = t - run->last;
+      /* Count error runs rather than flagged bytes. */
+      while ((i = fifo_error_scan(p, n)) < n) {
+        run->fifo_errors++;
+        i += fifo_error_run_length(p + i, n - i);
+        p += i;
+        n -= i;
+      }
+      run->bytes += buffer->length;
+      run->interval_sum += dt;
+      run->interval_sq_sum += dt * dt;
+      if (dt > run->interval_max)
+        run->interval_max = dt;
+      run->intervals++;
+      run->last = t;
+    }
+    usb_stream_release(buffer);
+  }
+
+  if (*run->stop)
+    return 1;
+  return run->flush_bytes == 0 && run->intervals > 0 &&
+         t - run->start >= run->duration;
+}
+
+int usb_autotune(struct ftdi_context *ftdi, int seconds, int flush_bytes,
+                 volatile int *stop, struct usb_queue_params *best)
+{
+  double best_rate = -1, best_jitter = 0;
+  uint64_t best_errors = 0;
+
+  printf("%8s %9s %7s %10s %10s %10s %8s\n", "packets", "transfers",
+         "latency", "MB/s", "jitter ms", "max ms", "errors");
+
+  for (size_t l = 0; l < ARRAY_SIZE(sweep_latency); l++)
+  for (size_t p = 0; p < ARRAY_SIZE(sweep_packets); p++)
+  for (size_t t = 0; t < ARRAY_SIZE(sweep_transfers); t++) {
+    struct usb_queue_params params = {
+      sweep_packets[p], sweep_transfers[t], sweep_latency[l]
+    };
+    struct tune_run run = {
+      .duration = seconds, .flush_bytes = flush_bytes, .stop = stop
+    };
+    struct usb_stream *stream;
+    double elapsed, mean, jitter, rate;
+    int better;
+
+    if (*stop)
+      break;
+    if (ftdi_set_latency_timer(ftdi, params.latency)) {
+      fprintf(stderr, "Can't set latency, Error %s\n",
+              ftdi_get_error_string(ftdi));
+      continue;
+    }
+    stream = usb_stream_new(ftdi, params.packets_per_transfer,
+                            params.num_transfers, params.num_transfers);
+    if (!stream)
+      continue;
+    if (usb_stream_run(stream, tune_callback, &run) < 0 || !run.intervals) {
+      usb_stream_free(stream);
+      printf("%8d %9d %7d %10s\n", params.packets_per_transfer,
+             params.num_transfers, params.latency, "failed");
+      continue;
+    }
+    usb_stream_free(stream);
+
+    elapsed = run.last - run.start;
+    rate = elapsed > 0 ? run.bytes / elapsed : 0;
+    mean = run.interval_sum / run.intervals;
+    jitter = sqrt(fmax(0, run.interval_sq_sum / run.intervals - mean * mean));
+    printf("%8d %9d %7d %10.3f %10.3f %10.3f %8llu\n",
+           params.packets_per_transfer, params.num_transfers, params.latency,
+           rate / 1e6, jitter * 1e3, run.interval_max * 1e3,
+           (unsigned long long)run.fifo_errors);
+    fflush(stdout);
+
+    if (best_rate < 0)
+      better = 1;
+    else if (run.fifo_errors != best_errors)
+      better = run.fifo_errors < best_errors;
+    else if (fabs(rate - best_rate) > 0.001 * best_rate)
+      better = rate > best_rate;
+    else
+      better = jitter < best_jitter;
+
+    if (better) {
+      *best = params;
+      best_rate = rate;
+      best_jitter = jitter;
+      best_errors = run.fifo_errors;
+    }
+  }
+
+  if (best_rate < 0)
+    return -1;
+
+  printf("Best: --packets %d --transfers %d --latency %d "
+         "(%.3f MB/s, %.3f ms jitter, %llu FIFO errors)\n",
+         best->packets_per_transfer, best->num_transfers, best->latency,
+         best_rate / 1e6, best_jitter * 1e3, (unsigned long long)best_errors);
+  return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __USB_AUTOTUNE_H
+#define __USB_AUTOTUNE_H
+
+#include "ftdi.h"
+
+struct usb_queue_params {
+  int packets_per_transfer;
+  int num_transfers;
+  int latency;  /* FTDI latency timer, ms. */
+};
+
+/* Stream from the device with each combination of queue parameters for
+ * seconds each, discarding the first flush_bytes of every run, and print the
+ * sustained rate, callback jitter and FIFO error count of each. The best
+ * combination is returned in best: no FIFO errors first, then the highest
+ * rate, then the lowest jitter. The sweep ends early if *stop becomes
+ * non-zero.
+ * Returns 0 on success, -1 if no combination could be run.
+ */
+int usb_autotune(struct ftdi_context *ftdi, int seconds, int flush_bytes,
+                 volatile int *stop, struct usb_queue_params *best);
+
+#endif
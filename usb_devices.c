@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "usb_devices.c"
+ *
+ *   Purpose : Find Piksies on the bus and open them with libftdi inside a
+ *             libusb context shared with other devices, so one event loop
+ *             can service transfers for all of them.
+ */
+
+#include <stdio.h>
+
+#include "libusb.h"
+#include "usb_devices.h"
+
+int usb_find_devices(struct libusb_context *ctx, int vid, const int *pids,
+                     int num_pids, int all, struct usb_device_id *ids,
+                     int max_ids)
+{
+  libusb_device **list;
+  ssize_t count;
+  int found = 0;
+
+  if ((count = libusb_get_device_list(ctx, &list)) < 0)
+    return (int)count;
+
+  /* Go through pids in order so devices come back in the order asked for. */
+  for (int p = 0; p < num_pids; p++) {
+    for (ssize_t i = 0; i < count && found < max_ids; i++) {
+      struct libusb_device_descriptor desc;
+      if (libusb_get_device_descriptor(list[i], &desc) < 0 ||
+          desc.idVendor != vid || desc.idProduct != pids[p])
+        continue;
+      ids[found].pid = pids[p];
+      ids[found].bus = libusb_get_bus_number(list[i]);
+      ids[found].address = libusb_get_device_address(list[i]);
+      found++;
+      if (!all)
+        break;
+    }
+  }
+
+  libusb_free_device_list(list, 1);
+  return found;
+}
+
+struct ftdi_context *usb_open_ftdi(struct libusb_context *ctx, int vid,
+                                   const struct usb_device_id *id)
+{
+  struct ftdi_context *ftdi;
+  libusb_device **list, *dev = NULL;
+  ssize_t count;
+
+  if ((ftdi = ftdi_new()) == 0) {
+    fprintf(stderr, "ftdi_new failed\n");
+    return NULL;
+  }
+  /* libftdi always makes a libusb context of its own. Swap it for the
+   * shared one; usb_close_ftdi makes sure ftdi_free doesn't tear that down.
+   */
+  libusb_exit(ftdi->usb_ctx);
+  ftdi->usb_ctx = ctx;
+
+  if (ftdi_set_interface(ftdi, INTERFACE_A) < 0) {
+    fprintf(stderr, "ftdi_set_interface failed\n");
+    usb_close_ftdi(ftdi);
+    return NULL;
+  }
+
+  if ((count = libusb_get_device_list(ctx, &list)) < 0) {
+    fprintf(stderr, "Can't list USB devices: %s\n",
+            libusb_error_name((int)count));
+    usb_close_ftdi(ftdi);
+    return NULL;
+  }
+  for (ssize_t i = 0; i < count && !dev; i++) {
+    struct libusb_device_descriptor desc;
+    if (libusb_get_bus_number(list[i]) == id->bus &&
+        libusb_get_device_address(list[i]) == id->address &&
+        libusb_get_device_descriptor(list[i], &desc) == 0 &&
+        desc.idVendor == vid && desc.idProduct == id->pid)
+      dev = list[i];
+  }
+  if (!dev || ftdi_usb_open_dev(ftdi, dev) < 0) {
+    fprintf(stderr, "Can't open ftdi device 0x%04x on bus %d address %d: %s\n",
+            id->pid, id->bus, id->address,
+            dev ? ftdi_get_error_string(ftdi) : "device gone");
+    libusb_free_device_list(list, 1);
+    usb_close_ftdi(ftdi);
+    return NULL;
+  }
+  libusb_free_device_list(list, 1);
+  return ftdi;
+}
+
+void usb_close_ftdi(struct ftdi_context *ftdi)
+{
+  if (ftdi->usb_dev)
+    ftdi_usb_close(ftdi);
+  ftdi->usb_ctx = NULL;
+  ftdi_free(ftdi);
+}
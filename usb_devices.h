@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __USB_DEVICES_H
+#define __USB_DEVICES_H
+
+#include <stdint.h>
+
+#include "ftdi.h"
+
+/* Where a device sits on the bus, stable for as long as it stays plugged in
+ * and the same in every libusb context.
+ */
+struct usb_device_id {
+  int pid;
+  uint8_t bus;
+  uint8_t address;
+};
+
+/* Find devices in ctx with the given vendor ID and one of the num_pids
+ * product IDs. With all set every matching device is returned, otherwise
+ * only the first for each product ID. Returns the number of devices stored
+ * in ids (at most max_ids), or a negative libusb error code.
+ */
+int usb_find_devices(struct libusb_context *ctx, int vid, const int *pids,
+                     int num_pids, int all, struct usb_device_id *ids,
+                     int max_ids);
+
+/* Open a device found by usb_find_devices with libftdi, on interface A.
+ * The ftdi context uses ctx for all its USB I/O, so several devices opened
+ * in one ctx can share a libusb event loop. Returns NULL on error.
+ */
+struct ftdi_context *usb_open_ftdi(struct libusb_context *ctx, int vid,
+                                   const struct usb_device_id *id);
+
+/* Close and free a context from usb_open_ftdi, leaving ctx alive. */
+void usb_close_ftdi(struct ftdi_context *ftdi);
+
+#endif
@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   "usb_stream.c"
+ *
+ *   Purpose : Stream data from an FT232H in synchronous FIFO mode using
+ *             libusb asynchronous bulk transfers directly, in place of
+ *             ftdi_readstream. Completed transfers are handed to the
+ *             consumer whole, without copying, and resubmitted once the
+ *             consumer releases them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "libusb.h"
+#include "usb_stream.h"
+
+/* Each USB packet from the FTDI starts with two modem status bytes. */
+#define FTDI_STATUS_BYTES 2
+/* How often the callback is given progress information, in seconds. */
+#define PROGRESS_INTERVAL 1.0
+
+#ifndef CLOCK_TAI
+#define CLOCK_TAI 11
+#endif
+
+struct usb_stream {
+  struct ftdi_context *ftdi;
+  int packet_size;
+  int transfer_size;
+  int num_transfers;
+  int num_buffers;
+  struct usb_buffer *buffers;
+
+  /* Released buffers, pushed from any thread and taken by the event thread. */
+  struct usb_buffer *free_list;
+  /* Only touched on the event thread. */
+  int in_flight;
+  int result;
+  int cancelled;
+  int completions;
+
+  usb_stream_callback *callback;
+  void *userdata;
+
+  struct usb_stream_progress progress;
+  struct timeval start, last, last_activity;
+  uint64_t last_bytes;
+};
+
+static double tv_diff(const struct timeval *a, const struct timeval *b)
+{
+  return (a->tv_sec - b->tv_sec) + 1e-6 * (a->tv_usec - b->tv_usec);
+}
+
+static void free_list_push(struct usb_stream *s, struct usb_buffer *b)
+{
+  struct usb_buffer *head = __atomic_load_n(&s->free_list, __ATOMIC_RELAXED);
+  do {
+    b->next = head;
+  } while (!__atomic_compare_exchange_n(&s->free_list, &head, b, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Strip the modem status bytes from every packet, moving the payloads down
+ * so they are contiguous. Returns the payload length.
+ */
+static size_t strip_status(uint8_t *buf, int length, int packet_size)
+{
+  uint8_t *dst = buf;
+
+  for (int off = 0; off < length; off += packet_size) {
+    int packet_len = length - off < packet_size ? length - off : packet_size;
+    int payload_len = packet_len - FTDI_STATUS_BYTES;
+    if (payload_len <= 0)
+      continue;
+    memmove(dst, buf + off + FTDI_STATUS_BYTES, payload_len);
+    dst += payload_len;
+  }
+  return dst - buf;
+}
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+  struct usb_buffer *b = transfer->user_data;
+  struct usb_stream *s = b->stream;
+
+  s->in_flight--;
+
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !s->result) {
+      fprintf(stderr, "USB transfer failed, status %d\n", transfer->status);
+      s->result = LIBUSB_ERROR_IO;
+    }
+    free_list_push(s, b);
+    return;
+  }
+
+  s->completions++;
+  b->length = strip_status(b->data, transfer->actual_length, s->packet_size);
+  if (b->length == 0 || s->result) {
+    free_list_push(s, b);
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &b->realtime);
+  clock_gettime(CLOCK_MONOTONIC, &b->monotonic);
+  clock_gettime(CLOCK_TAI, &b->tai);
+
+  s->progress.total_bytes += b->length;
+  if (s->callback(b, NULL, s->userdata))
+    s->result = 1;
+}
+
+/* Keep num_transfers submitted, using whatever buffers have been released. */
+static void refill(struct usb_stream *s)
+{
+  struct usb_buffer *b;
+
+  if (s->result || s->in_flight >= s->num_transfers)
+    return;
+
+  b = __atomic_exchange_n(&s->free_list, NULL, __ATOMIC_ACQUIRE);
+  while (b) {
+    struct usb_buffer *next = b->next;
+    if (s->result || s->in_flight >= s->num_transfers) {
+      free_list_push(s, b);
+    } else {
+      int err = libusb_submit_transfer(b->transfer);
+      if (err) {
+        fprintf(stderr, "Can't submit USB transfer: %s\n",
+                libusb_error_name(err));
+        s->result = err;
+        free_list_push(s, b);
+      } else {
+        s->in_flight++;
+      }
+    }
+    b = next;
+  }
+}
+
+static void report_progress(struct usb_stream *s, const struct timeval *now)
+{
+  double interval = tv_diff(now, &s->last);
+
+  if (interval < PROGRESS_INTERVAL)
+    return;
+
+  s->progress.total_time = tv_diff(now, &s->start);
+  s->progress.total_rate = s->progress.total_bytes / s->progress.total_time;
+  s->progress.current_rate =
+    (s->progress.total_bytes - s->last_bytes) / interval;
+  s->last = *now;
+  s->last_bytes = s->progress.total_bytes;
+
+  if (s->callback(NULL, &s->progress, s->userdata) && !s->result)
+    s->result = 1;
+}
+
+struct usb_stream *usb_stream_new(struct ftdi_context *ftdi,
+                                  int packets_per_transfer, int num_transfers,
+                                  int num_buffers)
+{
+  struct usb_stream *s;
+
+  if (ftdi->type != TYPE_2232H && ftdi->type != TYPE_232H) {
+    fprintf(stderr, "Device doesn't support synchronous FIFO mode\n");
+    return NULL;
+  }
+  if (packets_per_transfer <= 0 || num_transfers <= 0)
+    return NULL;
+  if (num_buffers < num_transfers)
+    num_buffers = num_transfers;
+
+  if (!(s = calloc(1, sizeof(*s))))
+    return NULL;
+  s->ftdi = ftdi;
+  s->packet_size = ftdi->max_packet_size;
+  s->transfer_size = packets_per_transfer * s->packet_size;
+  s->num_transfers = num_transfers;
+  s->num_buffers = num_buffers;
+
+  if (!(s->buffers = calloc(num_buffers, sizeof(*s->buffers)))) {
+    free(s);
+    return NULL;
+  }
+
+  for (int i = 0; i < num_buffers; i++) {
+    struct usb_buffer *b = &s->buffers[i];
+    b->stream = s;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    /* Let usbfs DMA straight into our memory where the kernel supports it. */
+    b->data = libusb_dev_mem_alloc(ftdi->usb_dev, s->transfer_size);
+    b->dev_mem = b->data != NULL;
+#endif
+    if (!b->data)
+      b->data = malloc(s->transfer_size);
+    b->transfer = libusb_alloc_transfer(0);
+    if (!b->data || !b->transfer) {
+      usb_stream_free(s);
+      return NULL;
+    }
+    /* Note libftdi names endpoints from the chip's point of view. */
+    libusb_fill_bulk_transfer(b->transfer, ftdi->usb_dev, ftdi->out_ep,
+                              b->data, s->transfer_size, transfer_cb, b, 0);
+    free_list_push(s, b);
+  }
+
+  return s;
+}
+
+void usb_stream_free(struct usb_stream *s)
+{
+  if (!s)
+    return;
+  for (int i = 0; i < s->num_buffers; i++) {
+    struct usb_buffer *b = &s->buffers[i];
+    if (b->transfer)
+      libusb_free_transfer(b->transfer);
+    if (!b->data)
+      continue;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    if (b->dev_mem) {
+      libusb_dev_mem_free(s->ftdi->usb_dev, b->data, s->transfer_size);
+      continue;
+    }
+#endif
+    free(b->data);
+  }
+  free(s->buffers);
+  free(s);
+}
+
+void usb_stream_prefault(struct usb_stream *s)
+{
+  for (int i = 0; i < s->num_buffers; i++)
+    memset(s->buffers[i].data, 0, s->transfer_size);
+}
+
+void usb_stream_release(struct usb_buffer *buffer)
+{
+  free_list_push(buffer->stream, buffer);
+}
+
+/* Reset the chip and queue the transfers, ready for start_fifo(). */
+static void prepare(struct usb_stream *s, usb_stream_callback *callback,
+                    void *userdata)
+{
+  struct ftdi_context *ftdi = s->ftdi;
+
+  s->callback = callback;
+  s->userdata = userdata;
+  s->result = 0;
+  s->cancelled = 0;
+  memset(&s->progress, 0, sizeof(s->progress));
+  s->last_bytes = 0;
+
+  if (ftdi_set_bitmode(ftdi, 0xff, BITMODE_RESET) < 0) {
+    fprintf(stderr, "Can't reset bitmode: %s\n", ftdi_get_error_string(ftdi));
+    s->result = LIBUSB_ERROR_IO;
+    return;
+  }
+  if (ftdi_usb_purge_buffers(ftdi) < 0) {
+    fprintf(stderr, "Can't purge buffers: %s\n", ftdi_get_error_string(ftdi));
+    s->result = LIBUSB_ERROR_IO;
+    return;
+  }
+
+  refill(s);
+}
+
+/* Only switch the chip into FIFO mode once all transfers are queued,
+ * otherwise the first few ms of data arrive with nowhere to go.
+ */
+static void start_fifo(struct usb_stream *s)
+{
+  struct ftdi_context *ftdi = s->ftdi;
+
+  if (!s->result && ftdi_set_bitmode(ftdi, 0xff, BITMODE_SYNCFF) < 0) {
+    fprintf(stderr, "Can't set synchronous fifo mode: %s\n",
+            ftdi_get_error_string(ftdi));
+    s->result = LIBUSB_ERROR_IO;
+  }
+
+  gettimeofday(&s->start, NULL);
+  s->last = s->last_activity = s->start;
+}
+
+/* Housekeeping after each round of event handling. Once the stream has been
+ * asked to stop, whatever is still queued is cancelled. Returns 1 when the
+ * stream has stopped and all its transfers have come back.
+ */
+static int poll_stream(struct usb_stream *s, const struct timeval *now)
+{
+  struct ftdi_context *ftdi = s->ftdi;
+
+  if (s->completions) {
+    s->completions = 0;
+    s->last_activity = *now;
+  } else if (!s->result &&
+             tv_diff(now, &s->last_activity) * 1000 > ftdi->usb_read_timeout) {
+    fprintf(stderr, "No data from device for %d ms\n",
+            ftdi->usb_read_timeout);
+    s->result = LIBUSB_ERROR_TIMEOUT;
+  }
+
+  refill(s);
+  if (!s->result)
+    report_progress(s, now);
+
+  if (s->result && !s->cancelled) {
+    for (int i = 0; i < s->num_buffers; i++)
+      libusb_cancel_transfer(s->buffers[i].transfer);
+    s->cancelled = 1;
+  }
+  return s->result && s->in_flight == 0;
+}
+
+int usb_stream_run_group(struct usb_stream **streams, int num_streams,
+                         usb_stream_callback *callback, void **userdata,
+                         pthread_barrier_t *start)
+{
+  struct libusb_context *ctx = streams[0]->ftdi->usb_ctx;
+  struct timeval now;
+  int running = num_streams, live = num_streams, result = 0, err;
+
+  for (int i = 0; i < num_streams; i++)
+    prepare(streams[i], callback, userdata ? userdata[i] : NULL);
+  if (start)
+    pthread_barrier_wait(start);
+  /* Start the devices back to back so their captures line up. */
+  for (int i = 0; i < num_streams; i++)
+    start_fifo(streams[i]);
+
+  while (running) {
+    struct timeval tv = { 0, 100000 };
+    err = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    if (err && err != LIBUSB_ERROR_INTERRUPTED) {
+      /* Don't wait forever for cancellations that can't be delivered. */
+      if (!live)
+        break;
+      for (int i = 0; i < num_streams; i++)
+        if (!streams[i]->result)
+          streams[i]->result = err;
+    }
+
+    gettimeofday(&now, NULL);
+    running = live = 0;
+    for (int i = 0; i < num_streams; i++) {
+      if (!poll_stream(streams[i], &now))
+        running++;
+      if (!streams[i]->result)
+        live++;
+    }
+  }
+
+  for (int i = 0; i < num_streams; i++)
+    if (streams[i]->result < 0 && !result)
+      result = streams[i]->result;
+  return result;
+}
+
+int usb_stream_run(struct usb_stream *s, usb_stream_callback *callback,
+                   void *userdata)
+{
+  return usb_stream_run_group(&s, 1, callback, &userdata, NULL);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2016 Swift Navigation Inc.
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+#ifndef __USB_STREAM_H
+#define __USB_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ftdi.h"
+
+struct usb_stream;
+
+/* Payload of one completed bulk transfer with the FTDI modem status bytes
+ * already removed. The stream callback takes ownership of the buffer and
+ * must hand it back with usb_stream_release() when it is done with the
+ * data, from any thread.
+ */
+struct usb_buffer {
+  uint8_t *data;
+  size_t length;
+  /* Host clocks when the transfer completed. */
+  struct timespec realtime, monotonic, tai;
+
+  /* Private to usb_stream. */
+  struct usb_stream *stream;
+  struct libusb_transfer *transfer;
+  struct usb_buffer *next;
+  int dev_mem;             /* data is from libusb_dev_mem_alloc. */
+};
+
+struct usb_stream_progress {
+  uint64_t total_bytes;  /* Payload bytes received since start. */
+  double total_time;     /* Seconds since start. */
+  double total_rate;     /* Bytes per second since start. */
+  double current_rate;   /* Bytes per second over the last interval. */
+};
+
+/* Called on the event thread with each completed buffer (progress NULL), and
+ * about once a second with progress information (buffer NULL). Returning
+ * non-zero stops the stream.
+ */
+typedef int (usb_stream_callback)(struct usb_buffer *buffer,
+                                  struct usb_stream_progress *progress,
+                                  void *userdata);
+
+/* Create a stream reading from an opened FT232H/FT2232H. Each transfer is
+ * packets_per_transfer max size USB packets, num_transfers are kept in
+ * flight and num_buffers (>= num_transfers) are allocated so that consumers
+ * can hold on to some buffers while the queue stays full.
+ * Returns NULL on error.
+ */
+struct usb_stream *usb_stream_new(struct ftdi_context *ftdi,
+                                  int packets_per_transfer, int num_transfers,
+                                  int num_buffers);
+void usb_stream_free(struct usb_stream *s);
+
+/* Put the chip into synchronous FIFO mode, submit the transfers and run the
+ * libusb event loop until the callback asks to stop or an error occurs.
+ * All in-flight transfers are cancelled before returning.
+ * Returns 0 on a requested stop or a negative libusb error code.
+ */
+int usb_stream_run(struct usb_stream *s, usb_stream_callback *callback,
+                   void *userdata);
+
+/* Run several streams from one libusb event loop, all devices having been
+ * opened in the same libusb context (see usb_open_ftdi). Each stream gets
+ * the callback with its own entry of userdata (which may be NULL). A stream
+ * whose callback asks to stop or which fails is cancelled on its own while
+ * the rest carry on; this returns once all have stopped. If start is given
+ * it is waited on just before the devices are put into FIFO mode, to line
+ * up captures run from several threads.
+ * Returns 0 if every stream stopped on request, otherwise the first
+ * negative libusb error code.
+ */
+int usb_stream_run_group(struct usb_stream **streams, int num_streams,
+                         usb_stream_callback *callback, void **userdata,
+                         pthread_barrier_t *start);
+
+/* Touch every page of the stream's buffers so none fault during capture. */
+void usb_stream_prefault(struct usb_stream *s);
+
+/* Return a buffer to the stream's pool so it can be resubmitted. */
+void usb_stream_release(struct usb_buffer *buffer);
+
+#endif